@@ -0,0 +1,49 @@
+#include "engine.h"
+
+#include <cassert>
+#include <cstring>
+
+void Buffer::Create(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memprop) {
+	device_ = GetEngine().GetDevice();
+	size_ = size;
+	usage_ = usage;
+	memprop_ = memprop;
+	if ((memprop_ & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0) {
+		usage_ |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	}
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size_;
+	bufferInfo.usage = usage_;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	auto res = vkCreateBuffer(device_, &bufferInfo, nullptr, &buffer_);
+	assert(VK_SUCCESS == res);
+
+	// Host-visible buffers prefer device-local memory too (resizable bar,
+	// integrated gpus) so per-frame data skips the staging copy.
+	AllocationInfo allocInfo{};
+	allocInfo.required = memprop_;
+	if (memprop_ & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		allocInfo.preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	}
+	auto pass = GetEngine().GetAllocator().AllocateForBuffer(buffer_, allocInfo, allocation_);
+	assert(pass);
+}
+
+void Buffer::Destroy() {
+	if (buffer_ == VK_NULL_HANDLE) return;
+	GetEngine().DeferDestroy(buffer_, allocation_);
+	buffer_ = VK_NULL_HANDLE;
+	size_ = 0;
+}
+
+void Buffer::Update(const void* data, VkDeviceSize size, VkDeviceSize offset) {
+	assert(offset + size <= size_);
+	if (allocation_.mapped) {
+		memcpy(allocation_.mapped + offset, data, (size_t)size);
+		GetEngine().FlushMappedRange(allocation_, offset, size);
+	} else {
+		GetEngine().StageUpload(buffer_, offset, data, size);
+	}
+}
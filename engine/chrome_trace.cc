@@ -0,0 +1,105 @@
+#include "chrome_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+static void WriteEscaped(std::ofstream& fs, const std::string& text) {
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			fs << '\\' << c;
+		} else if ((unsigned char)c < 0x20) {
+			fs << ' ';
+		} else {
+			fs << c;
+		}
+	}
+}
+
+// Trace times are microseconds, three decimals keep the nanoseconds.
+static void WriteMicros(std::ofstream& fs, int64_t ns) {
+	if (ns < 0) {
+		fs << '-';
+		ns = -ns;
+	}
+	char fraction[4];
+	int64_t rest = ns % 1000;
+	fraction[0] = (char)('0' + rest / 100);
+	fraction[1] = (char)('0' + rest / 10 % 10);
+	fraction[2] = (char)('0' + rest % 10);
+	fraction[3] = 0;
+	fs << ns / 1000 << '.' << fraction;
+}
+
+void ChromeTrace::SetTrackName(uint32_t track, const char* name) {
+	for (auto& entry : track_names_) {
+		if (entry.first == track) {
+			entry.second = name;
+			return;
+		}
+	}
+	track_names_.emplace_back(track, name);
+}
+
+void ChromeTrace::AddEvent(const char* name, uint32_t track, int64_t begin_ns, int64_t duration_ns) {
+	Event event{};
+	event.name = name;
+	event.track = track;
+	event.begin_ns = begin_ns;
+	event.duration_ns = std::max<int64_t>(duration_ns, 0);
+	events_.push_back(std::move(event));
+}
+
+bool ChromeTrace::Write(const char* path) const {
+	std::ofstream fs{ path, std::ios::trunc };
+	if (!fs) {
+		std::cerr << "trace: cannot write " << path << std::endl;
+		return false;
+	}
+
+	// Relative to the first event, viewers handle small numbers better.
+	int64_t origin = 0;
+	if (!events_.empty()) {
+		origin = events_[0].begin_ns;
+		for (const auto& event : events_) origin = std::min(origin, event.begin_ns);
+	}
+
+	fs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	for (const auto& track : track_names_) {
+		if (!first) fs << ",\n";
+		first = false;
+		fs << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << track.first << ",\"args\":{\"name\":\"";
+		WriteEscaped(fs, track.second);
+		fs << "\"}}";
+	}
+	for (const auto& event : events_) {
+		if (!first) fs << ",\n";
+		first = false;
+		fs << "{\"ph\":\"X\",\"name\":\"";
+		WriteEscaped(fs, event.name);
+		fs << "\",\"pid\":1,\"tid\":" << event.track << ",\"ts\":";
+		WriteMicros(fs, event.begin_ns - origin);
+		fs << ",\"dur\":";
+		WriteMicros(fs, event.duration_ns);
+		fs << '}';
+	}
+	fs << "\n]}\n";
+	fs.close();
+	if (!fs) {
+		std::cerr << "trace: failed to write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void ChromeTrace::Clear() {
+	track_names_.clear();
+	events_.clear();
+}
+
+int64_t ChromeTrace::Now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
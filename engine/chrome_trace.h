@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Collects complete events and writes them in the Chrome trace event format,
+// for chrome://tracing and Perfetto. Times are steady_clock nanoseconds, the
+// profilers convert their own clocks before adding events.
+class ChromeTrace {
+public:
+    // Track ids group events into rows, names label them in the viewer.
+    void SetTrackName(uint32_t track, const char* name);
+    void AddEvent(const char* name, uint32_t track, int64_t begin_ns, int64_t duration_ns);
+
+    bool Write(const char* path) const;
+    void Clear();
+
+    static int64_t Now();
+
+private:
+    struct Event {
+        std::string name{};
+        uint32_t track{ 0 };
+        int64_t begin_ns{ 0 };
+        int64_t duration_ns{ 0 };
+    };
+
+    std::vector<std::pair<uint32_t, std::string>> track_names_{};
+    std::vector<Event> events_{};
+};
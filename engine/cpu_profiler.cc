@@ -0,0 +1,221 @@
+#include "cpu_profiler.h"
+#include "chrome_trace.h"
+#include "profile_format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+std::atomic<bool> CpuProfiler::recording_{ false };
+thread_local CpuProfiler::ThreadBuffer* CpuProfiler::thread_buffer_ = nullptr;
+
+// Often enough that a thread recording a few hundred thousand scopes per
+// second never fills its ring.
+static const std::chrono::milliseconds kCollectInterval{ 5 };
+
+void CpuProfiler::Ring::Drain(std::vector<ProfileEvent>& out) {
+	uint64_t tail = tail_.load(std::memory_order_relaxed);
+	uint64_t head = head_.load(std::memory_order_acquire);
+	for (; tail != head; ++tail) {
+		out.push_back(events_[tail & (kCapacity - 1)]);
+	}
+	tail_.store(tail, std::memory_order_release);
+}
+
+CpuProfiler::~CpuProfiler() {
+	Stop();
+}
+
+void CpuProfiler::Start() {
+	if (IsRecording()) return;
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		for (auto& buffer : buffers_) {
+			// Scopes that ended after the last capture stopped.
+			buffer->ring.Drain(buffer->events);
+			buffer->events.clear();
+			buffer->dropped.store(0, std::memory_order_relaxed);
+		}
+	}
+	start_ns_ = ChromeTrace::Now();
+	start_ticks_ = ProfileTicks();
+	ns_per_tick_ = 1.0;
+
+	collector_stopping_ = false;
+	collector_ = std::thread{ &CpuProfiler::CollectorLoop, this };
+	recording_.store(true);
+}
+
+void CpuProfiler::Stop() {
+	if (!IsRecording()) return;
+	recording_.store(false);
+	{
+		std::lock_guard<std::mutex> lock{ collector_mutex_ };
+		collector_stopping_ = true;
+	}
+	collector_wake_.notify_one();
+	collector_.join();
+	Collect();
+
+#ifdef PROFILE_RDTSC
+	// The tick rate over the whole capture, long enough to be accurate to
+	// a few parts per million.
+	uint64_t end_ticks = ProfileTicks();
+	int64_t end_ns = ChromeTrace::Now();
+	if (end_ticks > start_ticks_) {
+		ns_per_tick_ = (double)(end_ns - start_ns_) / (double)(end_ticks - start_ticks_);
+	}
+#endif
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	for (auto& buffer : buffers_) {
+		// Parents before the children they contain.
+		std::sort(buffer->events.begin(), buffer->events.end(), [](const ProfileEvent& a, const ProfileEvent& b) {
+			if (a.begin != b.begin) return a.begin < b.begin;
+			return a.end > b.end;
+		});
+	}
+}
+
+void CpuProfiler::SetThreadName(const char* name) {
+	ThreadBuffer* buffer = GetThreadBuffer();
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	buffer->name = name;
+}
+
+CpuProfiler::ThreadBuffer* CpuProfiler::GetThreadBuffer() {
+	if (thread_buffer_) return thread_buffer_;
+	// Once per thread. Buffers stay until the profiler goes away, so events
+	// of threads that have exited are still collected.
+	auto buffer = std::make_unique<ThreadBuffer>();
+	thread_buffer_ = buffer.get();
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	buffers_.push_back(std::move(buffer));
+	return thread_buffer_;
+}
+
+void CpuProfiler::CollectorLoop() {
+	std::unique_lock<std::mutex> lock{ collector_mutex_ };
+	while (!collector_stopping_) {
+		collector_wake_.wait_for(lock, kCollectInterval);
+		lock.unlock();
+		Collect();
+		lock.lock();
+	}
+}
+
+void CpuProfiler::Collect() {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	for (auto& buffer : buffers_) {
+		buffer->ring.Drain(buffer->events);
+	}
+}
+
+int64_t CpuProfiler::ToNs(uint64_t ticks) const {
+	return start_ns_ + (int64_t)((double)(int64_t)(ticks - start_ticks_) * ns_per_tick_);
+}
+
+void CpuProfiler::ExportTrace(ChromeTrace& trace) const {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	for (uint32_t i = 0; i < buffers_.size(); ++i) {
+		const ThreadBuffer& buffer = *buffers_[i];
+		if (buffer.events.empty()) continue;
+		std::string name = buffer.name.empty() ? "Thread " + std::to_string(i) : buffer.name;
+		trace.SetTrackName(i, name.c_str());
+		for (const auto& event : buffer.events) {
+			int64_t begin = ToNs(event.begin);
+			trace.AddEvent(event.name, i, begin, ToNs(event.end) - begin);
+		}
+	}
+}
+
+bool CpuProfiler::WriteBinary(const char* path) const {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	// Names are deduplicated by pointer, equal literals from different
+	// translation units just end up in the table twice.
+	std::unordered_map<const char*, uint32_t> string_indices{};
+	std::vector<const char*> strings{};
+	auto intern = [&](const char* text) {
+		auto it = string_indices.emplace(text, (uint32_t)strings.size());
+		if (it.second) strings.push_back(text);
+		return it.first->second;
+	};
+
+	uint64_t origin = start_ticks_;
+	uint64_t dropped = 0;
+	for (const auto& buffer : buffers_) {
+		if (!buffer->events.empty()) origin = std::min(origin, buffer->events.front().begin);
+		dropped += buffer->dropped.load(std::memory_order_relaxed);
+	}
+
+	// Reserved up front, the table holds pointers into these.
+	std::vector<std::string> thread_names{};
+	thread_names.reserve(buffers_.size());
+	std::vector<uint8_t> threads{};
+	uint32_t thread_count = 0;
+	for (uint32_t i = 0; i < buffers_.size(); ++i) {
+		const ThreadBuffer& buffer = *buffers_[i];
+		if (buffer.events.empty()) continue;
+		thread_names.push_back(buffer.name.empty() ? "Thread " + std::to_string(i) : buffer.name);
+		++thread_count;
+		WriteProfileVarint(threads, intern(thread_names.back().c_str()));
+		WriteProfileVarint(threads, buffer.events.size());
+		uint64_t previous = origin;
+		for (const auto& event : buffer.events) {
+			WriteProfileVarint(threads, intern(event.name));
+			WriteProfileVarint(threads, event.begin - previous);
+			WriteProfileVarint(threads, event.end - event.begin);
+			previous = event.begin;
+		}
+	}
+
+	std::vector<uint8_t> table{};
+	for (const char* text : strings) {
+		size_t length = strlen(text);
+		WriteProfileVarint(table, length);
+		table.insert(table.end(), text, text + length);
+	}
+
+	ProfileHeader header{};
+	header.magic = kProfileMagic;
+	header.version = kProfileVersion;
+	header.string_count = (uint32_t)strings.size();
+	header.thread_count = thread_count;
+	header.ns_per_tick = ns_per_tick_;
+	header.origin_ticks = origin;
+	header.origin_ns = ToNs(origin);
+	header.dropped = dropped;
+
+	std::ofstream fs{ path, std::ios::binary | std::ios::trunc };
+	fs.write((const char*)&header, sizeof(header));
+	fs.write((const char*)table.data(), table.size());
+	fs.write((const char*)threads.data(), threads.size());
+	fs.close();
+	if (!fs) {
+		std::cerr << "profile: failed to write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+uint64_t CpuProfiler::GetEventCount() const {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	uint64_t count = 0;
+	for (const auto& buffer : buffers_) count += buffer->events.size();
+	return count;
+}
+
+uint64_t CpuProfiler::GetDroppedCount() const {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	uint64_t dropped = 0;
+	for (const auto& buffer : buffers_) dropped += buffer->dropped.load(std::memory_order_relaxed);
+	return dropped;
+}
+
+CpuProfiler& GetCpuProfiler() {
+	static CpuProfiler sProfiler{};
+	return sProfiler;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PROFILE_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_RDTSC 1
+#endif
+
+class ChromeTrace;
+class CpuProfiler;
+
+CpuProfiler& GetCpuProfiler();
+
+// Scope markers compile to nothing unless VULKANBRO_PROFILE is defined.
+// Names must outlive the capture, string literals and __func__ do.
+#ifdef VULKANBRO_PROFILE
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__){ name }
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__func__)
+#define PROFILE_THREAD(name) GetCpuProfiler().SetThreadName(name)
+#else
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_FUNCTION() ((void)0)
+#define PROFILE_THREAD(name) ((void)0)
+#endif
+
+// The invariant TSC where there is one, steady_clock nanoseconds elsewhere.
+// Captures convert ticks with a rate measured over the capture itself.
+inline uint64_t ProfileTicks() {
+#ifdef PROFILE_RDTSC
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct ProfileEvent {
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Scoped cpu timings. Every thread records into a ring buffer of its own
+// without locks or allocation, a collector thread drains the rings into the
+// capture every few milliseconds. A full ring drops events instead of ever
+// blocking the thread that records.
+class CpuProfiler {
+public:
+    // Starts a new capture, dropping the previous one.
+    void Start();
+    // Collects what is left and ends the capture. Scopes still open are
+    // not part of it.
+    void Stop();
+    static bool IsRecording() { return recording_.load(std::memory_order_relaxed); }
+
+    // Labels the calling thread's track.
+    void SetThreadName(const char* name);
+    // Inline so a scope ending costs a thread_local read and a store into
+    // the ring, the buffer lookup only happens once per thread.
+    static void Record(const char* name, uint64_t begin, uint64_t end) {
+        ThreadBuffer* buffer = thread_buffer_ ? thread_buffer_ : GetCpuProfiler().GetThreadBuffer();
+        if (!buffer->ring.Push(ProfileEvent{ name, begin, end })) {
+            buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Both take the capture once Stop() has returned. ExportTrace() adds a
+    // track per thread that recorded anything.
+    void ExportTrace(ChromeTrace& trace) const;
+    // Compact dump in the format of profile_format.h.
+    bool WriteBinary(const char* path) const;
+
+    uint64_t GetEventCount() const;
+    uint64_t GetDroppedCount() const;
+
+    ~CpuProfiler();
+
+private:
+    // Single producer, single consumer: only the owning thread pushes and
+    // only the collector drains.
+    class Ring {
+    public:
+        static constexpr uint64_t kCapacity = 1 << 14;
+
+        bool Push(const ProfileEvent& event) {
+            uint64_t head = head_.load(std::memory_order_relaxed);
+            if (head - cached_tail_ >= kCapacity) {
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+                if (head - cached_tail_ >= kCapacity) return false;
+            }
+            events_[head & (kCapacity - 1)] = event;
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+        void Drain(std::vector<ProfileEvent>& out);
+
+    private:
+        alignas(64) std::atomic<uint64_t> head_{ 0 };
+        // Producer's last look at tail_, saves touching the collector's
+        // cache line on every push.
+        uint64_t cached_tail_{ 0 };
+        alignas(64) std::atomic<uint64_t> tail_{ 0 };
+        ProfileEvent events_[kCapacity];
+    };
+
+    struct ThreadBuffer {
+        Ring ring{};
+        std::atomic<uint64_t> dropped{ 0 };
+        std::string name{};
+        // Collected events, sorted by begin once the capture stops.
+        std::vector<ProfileEvent> events{};
+    };
+
+    ThreadBuffer* GetThreadBuffer();
+    void CollectorLoop();
+    void Collect();
+    int64_t ToNs(uint64_t ticks) const;
+
+    static std::atomic<bool> recording_;
+    static thread_local ThreadBuffer* thread_buffer_;
+
+    // Guards the buffer list, taken once per thread and by the collector.
+    mutable std::mutex mutex_{};
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers_{};
+
+    std::thread collector_{};
+    std::mutex collector_mutex_{};
+    std::condition_variable collector_wake_{};
+    bool collector_stopping_{ false };
+
+    uint64_t start_ticks_{ 0 };
+    int64_t start_ns_{ 0 };
+    double ns_per_tick_{ 1.0 };
+};
+
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* name)
+        : name_(name), begin_(CpuProfiler::IsRecording() ? ProfileTicks() : 0) {}
+    ~ProfileScope() {
+        if (begin_ != 0) CpuProfiler::Record(name_, begin_, ProfileTicks());
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    const char* name_;
+    uint64_t begin_;
+};
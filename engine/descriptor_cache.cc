@@ -0,0 +1,290 @@
+#include "descriptor_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+static void HashCombine(uint64_t& hash, const void* data, size_t size) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+}
+
+template<typename T>
+static void HashValue(uint64_t& hash, const T& value) {
+	HashCombine(hash, &value, sizeof(T));
+}
+
+bool DescriptorCounts::Fits(const DescriptorCounts& request) const {
+	if (request.sets > sets) return false;
+	for (uint32_t i = 0; i < kTypeCount; ++i) {
+		if (request.descriptors[i] > descriptors[i]) return false;
+	}
+	return true;
+}
+
+void DescriptorCounts::Take(const DescriptorCounts& request) {
+	sets -= request.sets;
+	for (uint32_t i = 0; i < kTypeCount; ++i) {
+		descriptors[i] -= request.descriptors[i];
+	}
+}
+
+void DescriptorLayoutCache::Create(VkDevice device) {
+	device_ = device;
+}
+
+void DescriptorLayoutCache::Destroy() {
+	for (auto& pair : layouts_) {
+		vkDestroyDescriptorSetLayout(device_, pair.second, nullptr);
+	}
+	layouts_.clear();
+	counts_.clear();
+}
+
+bool DescriptorLayoutCache::Key::operator==(const Key& other) const {
+	if (bindings.size() != other.bindings.size()) return false;
+	for (size_t i = 0; i < bindings.size(); ++i) {
+		const auto& a = bindings[i];
+		const auto& b = other.bindings[i];
+		if (a.binding != b.binding || a.descriptorType != b.descriptorType ||
+			a.descriptorCount != b.descriptorCount || a.stageFlags != b.stageFlags) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t DescriptorLayoutCache::KeyHash::operator()(const Key& key) const {
+	uint64_t hash = 14695981039346656037ull;
+	for (const auto& binding : key.bindings) {
+		HashValue(hash, binding.binding);
+		HashValue(hash, binding.descriptorType);
+		HashValue(hash, binding.descriptorCount);
+		HashValue(hash, binding.stageFlags);
+	}
+	return (size_t)hash;
+}
+
+VkDescriptorSetLayout DescriptorLayoutCache::Get(const VkDescriptorSetLayoutBinding* bindings, uint32_t count) {
+	Key key;
+	key.bindings.assign(bindings, bindings + count);
+	std::sort(key.bindings.begin(), key.bindings.end(),
+		[](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) {
+			return a.binding < b.binding;
+		});
+	for (const auto& binding : key.bindings) {
+		assert(binding.pImmutableSamplers == nullptr);
+	}
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	auto it = layouts_.find(key);
+	if (it != layouts_.end()) return it->second;
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = count;
+	layoutInfo.pBindings = key.bindings.data();
+
+	VkDescriptorSetLayout layout = VK_NULL_HANDLE;
+	auto res = vkCreateDescriptorSetLayout(device_, &layoutInfo, nullptr, &layout);
+	assert(VK_SUCCESS == res);
+
+	DescriptorCounts counts{};
+	counts.sets = 1;
+	for (const auto& binding : key.bindings) {
+		assert(binding.descriptorType < DescriptorCounts::kTypeCount);
+		counts.descriptors[binding.descriptorType] += binding.descriptorCount;
+	}
+	counts_.emplace(layout, counts);
+	layouts_.emplace(std::move(key), layout);
+	return layout;
+}
+
+DescriptorCounts DescriptorLayoutCache::GetCounts(VkDescriptorSetLayout layout) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	auto it = counts_.find(layout);
+	assert(it != counts_.end());
+	return it->second;
+}
+
+void DescriptorAllocator::Create(VkDevice device, uint32_t frame_count, DescriptorLayoutCache* layouts) {
+	device_ = device;
+	layouts_ = layouts;
+	frames_.resize(frame_count);
+	next_pool_size_ = sets_per_pool;
+}
+
+void DescriptorAllocator::Destroy() {
+	for (auto& frame : frames_) {
+		free_pools_.insert(free_pools_.end(), frame.pools.begin(), frame.pools.end());
+	}
+	for (const auto& pool : free_pools_) {
+		vkDestroyDescriptorPool(device_, pool.pool, nullptr);
+	}
+	free_pools_.clear();
+	frames_.clear();
+}
+
+DescriptorAllocator::Pool DescriptorAllocator::GrabPool(const DescriptorCounts& request) {
+	for (size_t i = free_pools_.size(); i-- > 0;) {
+		if (!free_pools_[i].capacity.Fits(request)) continue;
+		Pool pool = free_pools_[i];
+		free_pools_.erase(free_pools_.begin() + i);
+		return pool;
+	}
+
+	// Ratios loosely follow what material and post-processing sets use.
+	struct Ratio {
+		VkDescriptorType type;
+		float count;
+	};
+	const Ratio ratios[] = {
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1.0f },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1.0f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 0.5f },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4.0f },
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 2.0f },
+		{ VK_DESCRIPTOR_TYPE_SAMPLER, 0.5f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1.0f },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER, 0.5f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER, 0.5f },
+		{ VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 0.5f },
+	};
+	Pool pool{};
+	pool.capacity.sets = next_pool_size_;
+	for (const auto& ratio : ratios) {
+		pool.capacity.descriptors[ratio.type] = std::max(1u, (uint32_t)(ratio.count * next_pool_size_));
+	}
+	// A layout with more of a type than a whole pool's share still gets a
+	// pool it fits in.
+	std::vector<VkDescriptorPoolSize> sizes;
+	for (uint32_t type = 0; type < DescriptorCounts::kTypeCount; ++type) {
+		uint32_t& count = pool.capacity.descriptors[type];
+		count = std::max(count, request.descriptors[type]);
+		if (count > 0) sizes.push_back({ (VkDescriptorType)type, count });
+	}
+	pool.left = pool.capacity;
+
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.maxSets = pool.capacity.sets;
+	poolInfo.poolSizeCount = (uint32_t)sizes.size();
+	poolInfo.pPoolSizes = sizes.data();
+
+	auto res = vkCreateDescriptorPool(device_, &poolInfo, nullptr, &pool.pool);
+	assert(VK_SUCCESS == res);
+	next_pool_size_ = std::min(next_pool_size_ * 2, max_sets_per_pool);
+	return pool;
+}
+
+VkDescriptorSet DescriptorAllocator::AllocateLocked(Frame& frame, VkDescriptorSetLayout layout) {
+	DescriptorCounts request = layouts_->GetCounts(layout);
+	// Only the newest pool is tried, the older ones are full enough that
+	// searching them is rarely worth it.
+	if (frame.pools.empty() || !frame.pools.back().left.Fits(request)) {
+		frame.pools.push_back(GrabPool(request));
+	}
+	Pool& pool = frame.pools.back();
+	pool.left.Take(request);
+
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = pool.pool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet set = VK_NULL_HANDLE;
+	auto res = vkAllocateDescriptorSets(device_, &allocInfo, &set);
+	assert(VK_SUCCESS == res);
+	return set;
+}
+
+VkDescriptorSet DescriptorAllocator::Allocate(uint32_t frame, VkDescriptorSetLayout layout) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	return AllocateLocked(frames_[frame], layout);
+}
+
+bool DescriptorAllocator::SetKey::operator==(const SetKey& other) const {
+	if (layout != other.layout || bindings.size() != other.bindings.size()) return false;
+	for (size_t i = 0; i < bindings.size(); ++i) {
+		const auto& a = bindings[i];
+		const auto& b = other.bindings[i];
+		if (a.binding != b.binding || a.type != b.type ||
+			a.buffer.buffer != b.buffer.buffer || a.buffer.offset != b.buffer.offset ||
+			a.buffer.range != b.buffer.range || a.image.sampler != b.image.sampler ||
+			a.image.imageView != b.image.imageView || a.image.imageLayout != b.image.imageLayout) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t DescriptorAllocator::SetKeyHash::operator()(const SetKey& key) const {
+	uint64_t hash = 14695981039346656037ull;
+	HashValue(hash, key.layout);
+	for (const auto& binding : key.bindings) {
+		HashValue(hash, binding.binding);
+		HashValue(hash, binding.type);
+		HashValue(hash, binding.buffer.buffer);
+		HashValue(hash, binding.buffer.offset);
+		HashValue(hash, binding.buffer.range);
+		HashValue(hash, binding.image.sampler);
+		HashValue(hash, binding.image.imageView);
+		HashValue(hash, binding.image.imageLayout);
+	}
+	return (size_t)hash;
+}
+
+VkDescriptorSet DescriptorAllocator::GetSet(uint32_t frame, VkDescriptorSetLayout layout,
+	const DescriptorBinding* bindings, uint32_t count) {
+	SetKey key;
+	key.layout = layout;
+	key.bindings.assign(bindings, bindings + count);
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	Frame& slot = frames_[frame];
+	auto it = slot.sets.find(key);
+	if (it != slot.sets.end()) return it->second;
+
+	VkDescriptorSet set = AllocateLocked(slot, layout);
+
+	std::vector<VkWriteDescriptorSet> writes(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		auto& write = writes[i];
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = set;
+		write.dstBinding = bindings[i].binding;
+		write.descriptorCount = 1;
+		write.descriptorType = bindings[i].type;
+		switch (bindings[i].type) {
+		case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+		case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+		case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+		case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+			write.pBufferInfo = &bindings[i].buffer;
+			break;
+		default:
+			write.pImageInfo = &bindings[i].image;
+			break;
+		}
+	}
+	vkUpdateDescriptorSets(device_, count, writes.data(), 0, nullptr);
+
+	slot.sets.emplace(std::move(key), set);
+	return set;
+}
+
+void DescriptorAllocator::ResetFrame(uint32_t frame) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	Frame& slot = frames_[frame];
+	for (auto& pool : slot.pools) {
+		vkResetDescriptorPool(device_, pool.pool, 0);
+		pool.left = pool.capacity;
+		free_pools_.push_back(pool);
+	}
+	slot.pools.clear();
+	slot.sets.clear();
+}
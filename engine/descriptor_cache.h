@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// One resource bound to one binding. Fill buffer for buffer types and image
+// for image and sampler types, unused fields must stay zero since the whole
+// struct takes part in the set cache key.
+struct DescriptorBinding {
+    uint32_t binding{ 0 };
+    VkDescriptorType type{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER };
+    VkDescriptorBufferInfo buffer{};
+    VkDescriptorImageInfo image{};
+};
+
+// Sets and descriptors of each core type, what a layout takes out of a pool
+// or what a pool has left.
+struct DescriptorCounts {
+    static const uint32_t kTypeCount = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT + 1;
+    uint32_t sets{ 0 };
+    uint32_t descriptors[kTypeCount]{};
+
+    bool Fits(const DescriptorCounts& request) const;
+    void Take(const DescriptorCounts& request);
+};
+
+// Layouts are deduplicated by their bindings and live until Destroy(), so
+// callers can keep the handles around without owning them.
+class DescriptorLayoutCache {
+public:
+    void Create(VkDevice device);
+    void Destroy();
+
+    // Binding order does not matter. Immutable samplers are not supported.
+    VkDescriptorSetLayout Get(const VkDescriptorSetLayoutBinding* bindings, uint32_t count);
+    // What one set of a layout created by Get() takes from a pool.
+    DescriptorCounts GetCounts(VkDescriptorSetLayout layout);
+
+private:
+    struct Key {
+        std::vector<VkDescriptorSetLayoutBinding> bindings{};
+        bool operator==(const Key& other) const;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    VkDevice device_{};
+    std::unordered_map<Key, VkDescriptorSetLayout, KeyHash> layouts_{};
+    std::unordered_map<VkDescriptorSetLayout, DescriptorCounts> counts_{};
+    std::mutex mutex_{};
+};
+
+// Hands out descriptor sets that live for one frame slot. Pools are grabbed
+// on demand and reset as a whole when the slot comes around again, which is
+// far cheaper than freeing sets one by one. Sets with identical contents are
+// only allocated and written once per frame.
+//
+// Running a pool dry is invalid usage on Vulkan 1.0 rather than an error the
+// driver has to report, so what every pool has left is tracked here and the
+// next pool is taken before an allocation could fail.
+class DescriptorAllocator {
+public:
+    // Layouts passed in later must come from this cache.
+    void Create(VkDevice device, uint32_t frame_count, DescriptorLayoutCache* layouts);
+    void Destroy();
+
+    VkDescriptorSet Allocate(uint32_t frame, VkDescriptorSetLayout layout);
+    VkDescriptorSet GetSet(uint32_t frame, VkDescriptorSetLayout layout,
+        const DescriptorBinding* bindings, uint32_t count);
+
+    // Only once the frame's fence has signalled.
+    void ResetFrame(uint32_t frame);
+
+    // Capacity of the first pool, later pools double up to max_sets_per_pool.
+    uint32_t sets_per_pool{ 128 };
+    uint32_t max_sets_per_pool{ 4096 };
+
+private:
+    struct SetKey {
+        VkDescriptorSetLayout layout{};
+        std::vector<DescriptorBinding> bindings{};
+        bool operator==(const SetKey& other) const;
+    };
+    struct SetKeyHash {
+        size_t operator()(const SetKey& key) const;
+    };
+    struct Pool {
+        VkDescriptorPool pool{};
+        DescriptorCounts capacity{};
+        DescriptorCounts left{};
+    };
+    struct Frame {
+        std::vector<Pool> pools{};
+        std::unordered_map<SetKey, VkDescriptorSet, SetKeyHash> sets{};
+    };
+
+    VkDescriptorSet AllocateLocked(Frame& frame, VkDescriptorSetLayout layout);
+    Pool GrabPool(const DescriptorCounts& request);
+
+    VkDevice device_{};
+    DescriptorLayoutCache* layouts_{ nullptr };
+    std::vector<Frame> frames_{};
+    std::vector<Pool> free_pools_{};
+    uint32_t next_pool_size_{ 0 };
+    std::mutex mutex_{};
+};
@@ -1,11 +1,19 @@
 #include "engine.h"
+#include "cpu_profiler.h"
 
 #include <iostream>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cassert>
 #include <map>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 
 #include <SDL2/SDL_vulkan.h>
 #include <vulkan/vulkan.h>
@@ -42,36 +50,67 @@ void PopulateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& create
 }
 
 bool Engine::GetMemoryType(uint32_t typeBits, VkFlags mask, uint32_t & typeIndex) {
-	for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
-		if ((typeBits & 1) == 1) {
-			if ((memory_properties.memoryTypes[i].propertyFlags & mask) == mask) {
-				typeIndex = i;
-				return true;
-			}
-		}
-		typeBits >>= 1;
-	}
-	return false;
+	return FindMemoryType(memory_properties, typeBits, mask, 0, typeIndex);
 }
 
 void Engine::Create() {
     CreateInstance();
     SetupDebugMessenger();
+    if (!headless) {
+        CreateSurface();
+    }
     GetGpuInfo();
-    CreateSurface();
+    if (headless) {
+        SelectHeadlessQueue();
+    } else {
+        SelectSurfaceQueue();
+    }
     CreateDevice();
     GetQueue();
-    CreateSwapchain();
-    CreateDepthImage();
-    CreateSemaphore();
+    allocator_.Create(device_, memory_properties, gpu_properties.limits);
+    jobs_.Create(worker_count, pin_workers);
+    CreatePipelineCache();
+    pipelines_.Create(device_, pipeline_cache_, &jobs_);
+    shaders_.Create(device_);
+    if (headless) {
+        CreateHeadlessImages();
+    } else {
+        CreateSwapchain();
+    }
+    SelectDepthFormat();
+    CreateFrames();
+    descriptor_layouts_.Create(device_);
+    descriptor_allocator_.Create(device_, frames_in_flight, &descriptor_layouts_);
+    uint32_t timestamp_bits = queue_family_properties[queue_indices[QueueType::eGraphics]].timestampValidBits;
+    gpu_profiler_.Create(device_, queue_indices[QueueType::eGraphics], gpu_profiling ? timestamp_bits : 0,
+        gpu_properties.limits, frames_in_flight);
+    render_graph_.Create(device_, &allocator_, frames_in_flight, &gpu_profiler_);
+    main_render_pass_ = render_graph_.GetCompatibleRenderPass(&surface_format, 1, depth_format);
+    textures_.Create(&jobs_);
 }
 
 void Engine::Destroy() {
-    DestroySemaphore();
-    DestroyDepthImage();
-    DestroySwapchain();
+    vkDeviceWaitIdle(device_);
+    pipelines_.Destroy();
+    textures_.Destroy();
+    jobs_.Destroy();
+    shaders_.Destroy();
+    render_graph_.Destroy();
+    gpu_profiler_.Destroy();
+    descriptor_allocator_.Destroy();
+    descriptor_layouts_.Destroy();
+    DestroyFrames();
+    if (headless) {
+        DestroyHeadlessImages();
+    } else {
+        DestroySwapchain();
+    }
+    DestroyPipelineCache();
+    allocator_.Destroy();
     DestroyDevice();
-    DestroySurface();
+    if (!headless) {
+        DestroySurface();
+    }
     UninstallDebugMessenger();
     DestroyInstance();
 }
@@ -100,7 +139,36 @@ void Engine::CreateInstance() {
 	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 	createInfo.pApplicationInfo = &appInfo;
 
-	auto extensions = GetWindow().GetExtensions();
+	std::vector<const char*> extensions{};
+	if (headless) {
+		if (kEnableValidationLayers) {
+			extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		}
+	} else {
+		extensions = GetWindow().GetExtensions();
+	}
+
+	// Optional, only used to read the device UUID for the gpu override. On
+	// a 1.0 instance the ID properties come with the external memory
+	// capabilities extension, which builds on properties2.
+	uint32_t instanceExtensionCount = 0;
+	vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount, nullptr);
+	std::vector<VkExtensionProperties> instanceExtensions(instanceExtensionCount);
+	vkEnumerateInstanceExtensionProperties(nullptr, &instanceExtensionCount, instanceExtensions.data());
+	bool has_properties2 = false, has_external_memory = false;
+	for (const auto& ext : instanceExtensions) {
+		if (strcmp(ext.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0) {
+			has_properties2 = true;
+		} else if (strcmp(ext.extensionName, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME) == 0) {
+			has_external_memory = true;
+		}
+	}
+	device_id_supported_ = has_properties2 && has_external_memory;
+	if (device_id_supported_) {
+		extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+		extensions.push_back(VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+	}
+
 	createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
 	createInfo.ppEnabledExtensionNames = extensions.data();
 
@@ -147,6 +215,103 @@ void Engine::UninstallDebugMessenger() {
 	}
 }
 
+static std::string UuidToString(const uint8_t uuid[VK_UUID_SIZE]) {
+	static const char kHex[] = "0123456789abcdef";
+	std::string str{};
+	for (uint32_t i = 0; i < VK_UUID_SIZE; ++i) {
+		str += kHex[uuid[i] >> 4];
+		str += kHex[uuid[i] & 0xF];
+	}
+	return str;
+}
+
+static bool MatchGpuOverride(const std::string& override_name,
+	const VkPhysicalDeviceProperties& props, const std::string& uuid) {
+	std::string hex{};
+	for (char c : override_name) {
+		if (c != '-') hex += (char)tolower((unsigned char)c);
+	}
+	if (!uuid.empty() && hex == uuid) return true;
+	return strstr(props.deviceName, override_name.c_str()) != nullptr;
+}
+
+std::vector<const char*> Engine::GetDeviceExtensions() const {
+	if (headless) return {};
+	return {
+		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+	};
+}
+
+int64_t Engine::RateGpu(VkPhysicalDevice gpu) const {
+	uint32_t extensionCount = 0;
+	vkEnumerateDeviceExtensionProperties(gpu, nullptr, &extensionCount, nullptr);
+	std::vector<VkExtensionProperties> extensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(gpu, nullptr, &extensionCount, extensions.data());
+	for (const char* required : GetDeviceExtensions()) {
+		bool found = false;
+		for (const auto& ext : extensions) {
+			if (strcmp(ext.extensionName, required) == 0) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) return -1;
+	}
+
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(gpu, &familyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(gpu, &familyCount, families.data());
+
+	bool has_graphics = false, has_async_compute = false, has_transfer = false;
+	for (const auto& family : families) {
+		if (family.queueCount == 0) continue;
+		VkQueueFlags flags = family.queueFlags;
+		if (flags & VK_QUEUE_GRAPHICS_BIT) has_graphics = true;
+		else if (flags & VK_QUEUE_COMPUTE_BIT) has_async_compute = true;
+		else if (flags & VK_QUEUE_TRANSFER_BIT) has_transfer = true;
+	}
+	if (!has_graphics) return -1;
+
+	if (surface_ != VK_NULL_HANDLE) {
+		bool can_present = false;
+		for (uint32_t i = 0; i < familyCount && !can_present; ++i) {
+			VkBool32 supported = VK_FALSE;
+			vkGetPhysicalDeviceSurfaceSupportKHR(gpu, i, surface_, &supported);
+			can_present = supported == VK_TRUE;
+		}
+		if (!can_present) return -1;
+	}
+
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(gpu, &props);
+	VkPhysicalDeviceMemoryProperties memProps;
+	vkGetPhysicalDeviceMemoryProperties(gpu, &memProps);
+
+	// Device type dominates, the rest only breaks ties between devices of
+	// the same kind. A cpu implementation still beats having no device.
+	int64_t score = 0;
+	switch (props.deviceType) {
+	case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:   score += 400000; break;
+	case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 300000; break;
+	case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:    score += 200000; break;
+	case VK_PHYSICAL_DEVICE_TYPE_CPU:            score += 100000; break;
+	default: break;
+	}
+
+	VkDeviceSize localMemory = 0;
+	for (uint32_t i = 0; i < memProps.memoryHeapCount; ++i) {
+		if (memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+			localMemory += memProps.memoryHeaps[i].size;
+		}
+	}
+	score += std::min<int64_t>((int64_t)(localMemory >> 20) / 16, 90000);
+
+	if (has_async_compute) score += 1000;
+	if (has_transfer) score += 1000;
+	return score;
+}
+
 void Engine::GetGpuInfo() {
 	uint32_t gpuCount = 0;
 	VkResult res = vkEnumeratePhysicalDevices(instance_, &gpuCount, nullptr);
@@ -155,14 +320,52 @@ void Engine::GetGpuInfo() {
 	res = vkEnumeratePhysicalDevices(instance_, &gpuCount, gpus.data());
 	assert(VK_SUCCESS == res);
 
+	std::string override_name = gpu_override;
+	if (const char* env = getenv("VULKANBRO_GPU")) {
+		override_name = env;
+	}
+
+	PFN_vkGetPhysicalDeviceProperties2KHR getProperties2 = nullptr;
+	if (device_id_supported_) {
+		getProperties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(
+			instance_, "vkGetPhysicalDeviceProperties2KHR");
+	}
+
+	int64_t best_score = -1;
+	bool overridden = false;
 	for (const auto& gpu : gpus) {
 		VkPhysicalDeviceProperties properties;
 		vkGetPhysicalDeviceProperties(gpu, &properties);
-		if (VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU == properties.deviceType) {
+
+		std::string uuid{};
+		if (getProperties2) {
+			VkPhysicalDeviceIDPropertiesKHR idProps = {};
+			idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES_KHR;
+			VkPhysicalDeviceProperties2KHR props2 = {};
+			props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+			props2.pNext = &idProps;
+			getProperties2(gpu, &props2);
+			uuid = UuidToString(idProps.deviceUUID);
+		}
+
+		int64_t score = RateGpu(gpu);
+#ifndef NDEBUG
+		std::cerr << "gpu: " << properties.deviceName << " [" << uuid << "] score " << score << std::endl;
+#endif
+		if (score < 0 || overridden) continue;
+
+		if (!override_name.empty() && MatchGpuOverride(override_name, properties, uuid)) {
 			gpu_ = gpu;
-			break;
+			overridden = true;
+		} else if (score > best_score) {
+			gpu_ = gpu;
+			best_score = score;
 		}
 	}
+	if (!override_name.empty() && !overridden) {
+		std::cerr << "gpu: no usable device matches \"" << override_name << "\"" << std::endl;
+	}
+	assert(gpu_ != VK_NULL_HANDLE);
 
 	vkGetPhysicalDeviceQueueFamilyProperties(gpu_, &queue_family_count, nullptr);
 	queue_family_properties = std::make_unique<VkQueueFamilyProperties[]>(queue_family_count);
@@ -171,10 +374,14 @@ void Engine::GetGpuInfo() {
 
 	vkGetPhysicalDeviceMemoryProperties(gpu_, &memory_properties);
 	vkGetPhysicalDeviceProperties(gpu_, &gpu_properties);
+	std::cerr << "gpu: using " << gpu_properties.deviceName << std::endl;
 }
 
 void Engine::CreateSurface() {
     surface_ = GetWindow().GenSurface(instance_);
+}
+
+void Engine::SelectSurfaceQueue() {
 	std::vector<VkBool32> supportsPresent = std::vector<VkBool32>(queue_family_count);
 	for (uint32_t i = 0; i < queue_family_count; i++) {
 		vkGetPhysicalDeviceSurfaceSupportKHR(gpu_, i, surface_, &supportsPresent[i]);
@@ -218,32 +425,116 @@ void Engine::CreateSurface() {
 	}
 }
 
+void Engine::SelectHeadlessQueue() {
+	queue_indices.fill(UINT32_MAX);
+	for (uint32_t i = 0; i < queue_family_count; ++i) {
+		if ((queue_family_properties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0) {
+			queue_indices[QueueType::eGraphics] = i;
+			queue_indices[QueueType::ePresent] = i;
+			break;
+		}
+	}
+	assert(queue_indices[QueueType::eGraphics] != UINT32_MAX);
+
+	// Same preference as the surface path so shaders and readback code do
+	// not care which mode produced the frame.
+	const VkFormat candidates[] = { VK_FORMAT_B8G8R8A8_UNORM, VK_FORMAT_R8G8B8A8_UNORM };
+	for (VkFormat format : candidates) {
+		VkFormatProperties props;
+		vkGetPhysicalDeviceFormatProperties(gpu_, format, &props);
+		if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT) {
+			surface_format = format;
+			break;
+		}
+	}
+	assert(surface_format != VK_FORMAT_UNDEFINED);
+}
+
 void Engine::DestroySurface() {
 	vkDestroySurfaceKHR(instance_, surface_, nullptr);
 }
 
+void Engine::SelectAsyncQueues() {
+	auto findFamily = [this](VkQueueFlags required, VkQueueFlags excluded) {
+		for (uint32_t i = 0; i < queue_family_count; ++i) {
+			VkQueueFlags flags = queue_family_properties[i].queueFlags;
+			if (queue_family_properties[i].queueCount > 0 &&
+				(flags & required) == required && (flags & excluded) == 0) {
+				return i;
+			}
+		}
+		return UINT32_MAX;
+	};
+
+	// Prefer dedicated families so async work does not compete with the
+	// graphics queue, fall back to sharing the graphics family.
+	uint32_t compute = findFamily(VK_QUEUE_COMPUTE_BIT, VK_QUEUE_GRAPHICS_BIT);
+	if (compute == UINT32_MAX) compute = queue_indices[QueueType::eGraphics];
+
+	uint32_t transfer = findFamily(VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
+	if (transfer == UINT32_MAX) transfer = findFamily(VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT);
+	if (transfer == UINT32_MAX) transfer = queue_indices[QueueType::eGraphics];
+
+	queue_indices[QueueType::eCompute] = compute;
+	queue_indices[QueueType::eTransfer] = transfer;
+
+	// Queue slot inside each family: present reuses the graphics queue when
+	// the families match, the others take the next free queue if any.
+	std::vector<uint32_t> used(queue_family_count, 0);
+	const QueueType order[] = { eGraphics, ePresent, eCompute, eTransfer };
+	for (QueueType type : order) {
+		uint32_t family = queue_indices[type];
+		if (type == ePresent && family == queue_indices[eGraphics]) {
+			queue_slots_[type] = queue_slots_[eGraphics];
+			continue;
+		}
+		if (used[family] < queue_family_properties[family].queueCount) {
+			queue_slots_[type] = used[family]++;
+		} else {
+			queue_slots_[type] = used[family] - 1;
+		}
+	}
+}
+
 void Engine::CreateDevice() {
-	VkDeviceQueueCreateInfo queueInfo = {};
+	SelectAsyncQueues();
+
+	std::vector<std::vector<float>> priorities(queue_family_count);
+	for (uint32_t type = 0; type < QueueType::eMaxQueue; ++type) {
+		auto& family = priorities[queue_indices[type]];
+		if (family.size() <= queue_slots_[type]) {
+			family.resize(queue_slots_[type] + 1, 0.0f);
+		}
+		family[queue_slots_[type]] = std::max(family[queue_slots_[type]], queue_priorities[type]);
+	}
 
-	float queue_priorities[1] = { 0.0 };
-	queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	queueInfo.pNext = NULL;
-	queueInfo.queueCount = 1;
-	queueInfo.pQueuePriorities = queue_priorities;
-	queueInfo.queueFamilyIndex = queue_indices[QueueType::ePresent];
+	std::vector<VkDeviceQueueCreateInfo> queueInfos{};
+	for (uint32_t i = 0; i < queue_family_count; ++i) {
+		if (priorities[i].empty()) continue;
+		VkDeviceQueueCreateInfo queueInfo = {};
+		queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueInfo.pNext = NULL;
+		queueInfo.queueFamilyIndex = i;
+		queueInfo.queueCount = (uint32_t)priorities[i].size();
+		queueInfo.pQueuePriorities = priorities[i].data();
+		queueInfos.push_back(queueInfo);
+	}
 
-	std::vector<const char*> device_extensions{
-		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-	};
+	auto device_extensions = GetDeviceExtensions();
 
 	VkDeviceCreateInfo deviceInfo = {};
 	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	deviceInfo.pNext = NULL;
-	deviceInfo.queueCreateInfoCount = 1;
-	deviceInfo.pQueueCreateInfos = &queueInfo;
+	deviceInfo.queueCreateInfoCount = (uint32_t)queueInfos.size();
+	deviceInfo.pQueueCreateInfos = queueInfos.data();
 	deviceInfo.enabledExtensionCount = (uint32_t)device_extensions.size();
 	deviceInfo.ppEnabledExtensionNames = device_extensions.data();
-	deviceInfo.pEnabledFeatures = NULL;
+	// Cooked textures are block compressed.
+	VkPhysicalDeviceFeatures supported = {};
+	vkGetPhysicalDeviceFeatures(gpu_, &supported);
+	enabled_features = {};
+	enabled_features.textureCompressionBC = supported.textureCompressionBC;
+	deviceInfo.pEnabledFeatures = &enabled_features;
 
 	auto res = vkCreateDevice(gpu_, &deviceInfo, NULL, &device_);
 	assert(VK_SUCCESS == res);
@@ -254,8 +545,107 @@ void Engine::DestroyDevice() {
 }
 
 void Engine::GetQueue() {
-	vkGetDeviceQueue(device_, queue_indices[QueueType::eGraphics], 0, &queues[eGraphics]);
-    vkGetDeviceQueue(device_, queue_indices[QueueType::ePresent], 0, &queues[ePresent]);
+	for (uint32_t type = 0; type < QueueType::eMaxQueue; ++type) {
+		vkGetDeviceQueue(device_, queue_indices[type], queue_slots_[type], &queues[type]);
+	}
+
+	// Types that ended up on the same VkQueue share one submit lock.
+	for (uint32_t type = 0; type < QueueType::eMaxQueue; ++type) {
+		queue_locks_[type] = type;
+		for (uint32_t other = 0; other < type; ++other) {
+			if (queues[other] == queues[type]) {
+				queue_locks_[type] = queue_locks_[other];
+				break;
+			}
+		}
+	}
+}
+
+VkResult Engine::QueueSubmit(QueueType type, uint32_t count, const VkSubmitInfo* submits, VkFence fence) {
+	std::lock_guard<std::mutex> lock{ queue_mutexes_[queue_locks_[type]] };
+	return vkQueueSubmit(queues[type], count, submits, fence);
+}
+
+VkResult Engine::QueuePresent(const VkPresentInfoKHR* present_info) {
+	std::lock_guard<std::mutex> lock{ queue_mutexes_[queue_locks_[QueueType::ePresent]] };
+	return vkQueuePresentKHR(queues[QueueType::ePresent], present_info);
+}
+
+void Engine::ReleaseBuffer(VkCommandBuffer cmd, VkBuffer buffer, const QueueTransfer& transfer) const {
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = transfer.src_access;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+
+	VkPipelineStageFlags dstStage = transfer.dst_stage;
+	if (NeedsOwnershipTransfer(transfer.src, transfer.dst)) {
+		barrier.srcQueueFamilyIndex = queue_indices[transfer.src];
+		barrier.dstQueueFamilyIndex = queue_indices[transfer.dst];
+		dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	} else {
+		barrier.dstAccessMask = transfer.dst_access;
+	}
+	vkCmdPipelineBarrier(cmd, transfer.src_stage, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void Engine::AcquireBuffer(VkCommandBuffer cmd, VkBuffer buffer, const QueueTransfer& transfer) const {
+	if (!NeedsOwnershipTransfer(transfer.src, transfer.dst)) return;
+
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.dstAccessMask = transfer.dst_access;
+	barrier.srcQueueFamilyIndex = queue_indices[transfer.src];
+	barrier.dstQueueFamilyIndex = queue_indices[transfer.dst];
+	barrier.buffer = buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, transfer.dst_stage,
+		0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void Engine::ReleaseImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range,
+	VkImageLayout old_layout, VkImageLayout new_layout, const QueueTransfer& transfer) const {
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = transfer.src_access;
+	barrier.oldLayout = old_layout;
+	barrier.newLayout = new_layout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange = range;
+
+	VkPipelineStageFlags dstStage = transfer.dst_stage;
+	if (NeedsOwnershipTransfer(transfer.src, transfer.dst)) {
+		barrier.srcQueueFamilyIndex = queue_indices[transfer.src];
+		barrier.dstQueueFamilyIndex = queue_indices[transfer.dst];
+		dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	} else {
+		barrier.dstAccessMask = transfer.dst_access;
+	}
+	vkCmdPipelineBarrier(cmd, transfer.src_stage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void Engine::AcquireImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range,
+	VkImageLayout old_layout, VkImageLayout new_layout, const QueueTransfer& transfer) const {
+	if (!NeedsOwnershipTransfer(transfer.src, transfer.dst)) return;
+
+	// Must repeat the layouts of the release half exactly.
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.dstAccessMask = transfer.dst_access;
+	barrier.oldLayout = old_layout;
+	barrier.newLayout = new_layout;
+	barrier.srcQueueFamilyIndex = queue_indices[transfer.src];
+	barrier.dstQueueFamilyIndex = queue_indices[transfer.dst];
+	barrier.image = image;
+	barrier.subresourceRange = range;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, transfer.dst_stage,
+		0, 0, nullptr, 0, nullptr, 1, &barrier);
 }
 
 void Engine::CreateSwapchain() {
@@ -288,10 +678,21 @@ void Engine::CreateSwapchain() {
 	} else {
 		swapchainExtent = surface_capabilities.currentExtent;
 	}
+	extent_ = swapchainExtent;
 
-	VkPresentModeKHR swapchainPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+	VkPresentModeKHR swapchainPresentMode = SelectPresentMode();
 
+	// A shallow queue keeps latency down, mailbox needs one spare image so
+	// the newest frame can always replace the queued one.
 	uint32_t minSwapchainImageCount = surface_capabilities.minImageCount;
+	if (present_policy == ePowerSave) {
+		minSwapchainImageCount = std::max(surface_capabilities.minImageCount, 2u);
+	} else if (present_policy == eThroughput || swapchainPresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+		minSwapchainImageCount = std::max(surface_capabilities.minImageCount + 1, 3u);
+	}
+	if (surface_capabilities.maxImageCount > 0) {
+		minSwapchainImageCount = std::min(minSwapchainImageCount, surface_capabilities.maxImageCount);
+	}
 
 	VkSurfaceTransformFlagBitsKHR preTransform;
 	if (surface_capabilities.supportedTransforms & VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR) {
@@ -326,7 +727,7 @@ void Engine::CreateSwapchain() {
 	swapchainInfo.compositeAlpha = compositeAlpha;
 	swapchainInfo.imageArrayLayers = 1;
 	swapchainInfo.presentMode = swapchainPresentMode;
-	swapchainInfo.oldSwapchain = VK_NULL_HANDLE;
+	swapchainInfo.oldSwapchain = swapchain_;
 	swapchainInfo.clipped = true;
 	swapchainInfo.imageColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
 	swapchainInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
@@ -341,8 +742,16 @@ void Engine::CreateSwapchain() {
         swapchainInfo.queueFamilyIndexCount = 1;
     }
 
+	// Handing the old swapchain over lets the driver recycle its images and
+	// keeps presentation going while the new one is built. The frame fences
+	// do not cover the presents queued from it, so it lives until the frame
+	// after the last of those has retired.
+	VkSwapchainKHR oldSwapchain = swapchain_;
 	res = vkCreateSwapchainKHR(device_, &swapchainInfo, NULL, &swapchain_);
 	assert(VK_SUCCESS == res);
+	if (oldSwapchain != VK_NULL_HANDLE) {
+		retired_swapchains_.push_back({ oldSwapchain, frame_number_ + frames_in_flight });
+	}
 
     res = vkGetSwapchainImagesKHR(device_, swapchain_, &framebuffer_count_, nullptr);
     assert(VK_SUCCESS == res);
@@ -375,124 +784,900 @@ void Engine::CreateSwapchain() {
     current_buffer_ = 0;
 }
 
+VkPresentModeKHR Engine::SelectPresentMode() const {
+	std::vector<VkPresentModeKHR> preferred{};
+	switch (present_policy) {
+	case eLowLatency:
+		preferred = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR,
+			VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+		break;
+	case eThroughput:
+		preferred = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR,
+			VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+		break;
+	case ePowerSave:
+	default:
+		break;
+	}
+
+	for (VkPresentModeKHR mode : preferred) {
+		if (std::find(present_modes.begin(), present_modes.end(), mode) != present_modes.end()) {
+			return mode;
+		}
+	}
+	// FIFO is the only mode every implementation has to support.
+	return VK_PRESENT_MODE_FIFO_KHR;
+}
+
 void Engine::DestroySwapchain() {
+    DestroySwapchainImageViews();
+	DestroyRetiredSwapchains(true);
+	vkDestroySwapchainKHR(device_, swapchain_, nullptr);
+	swapchain_ = VK_NULL_HANDLE;
+}
+
+void Engine::DestroyRetiredSwapchains(bool all) {
+	auto retired = retired_swapchains_.begin();
+	while (retired != retired_swapchains_.end()) {
+		if (all || retired->frame <= frame_number_) {
+			vkDestroySwapchainKHR(device_, retired->swapchain, nullptr);
+			retired = retired_swapchains_.erase(retired);
+		} else {
+			++retired;
+		}
+	}
+}
+
+void Engine::DestroySwapchainImageViews() {
     for (uint32_t i = 0; i < framebuffer_count_; i++) {
         vkDestroyImageView(device_, color_imageviews_[i], nullptr);
     }
-	vkDestroySwapchainKHR(device_, swapchain_, nullptr);
 }
 
-void Engine::CreateDepthImage() {
+void Engine::WaitForFrames() {
+	std::vector<VkFence> fences{};
+	for (const auto& frame : frames_) {
+		fences.push_back(frame.fence);
+	}
+	vkWaitForFences(device_, (uint32_t)fences.size(), fences.data(), VK_TRUE, UINT64_MAX);
+	completed_frames_ = frame_number_;
+}
+
+bool Engine::Resize() {
+	if (headless) {
+		if (headless_extent.width == 0 || headless_extent.height == 0) return false;
+	} else {
+		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpu_, surface_, &surface_capabilities);
+		VkExtent2D extent = surface_capabilities.currentExtent;
+		if (extent.width == 0xFFFFFFFF) {
+			auto drawSize = GetWindow().GetDrawSize();
+			extent.width = drawSize.x;
+			extent.height = drawSize.y;
+		}
+		// Minimized, keep the request pending until there is something to draw.
+		if (extent.width == 0 || extent.height == 0) return false;
+	}
+	swapchain_dirty_ = false;
+
+	// Only the graphics work of in-flight frames can reference the attachments,
+	// so waiting on the frame fences is enough.
+	WaitForFrames();
+
+	if (headless) {
+		DestroyHeadlessImages();
+		CreateHeadlessImages();
+	} else {
+		DestroySwapchainImageViews();
+		CreateSwapchain();
+	}
+
+	image_fences_ = std::make_unique<VkFence[]>(framebuffer_count_);
+	finished_buffer_ = UINT32_MAX;
+	// The backbuffer views were just recreated and may reuse old handles.
+	render_graph_.Invalidate();
+	return true;
+}
+
+void Engine::CreateHeadlessImages() {
 	VkResult res;
-	VkImageCreateInfo imageInfo = {};
-	VkFormatProperties props;
 
-    if (depth_format == VK_FORMAT_UNDEFINED) {
-        depth_format = VK_FORMAT_D16_UNORM;
-    }
+	extent_ = headless_extent;
+	framebuffer_count_ = headless_image_count;
+	color_images_ = std::make_unique<VkImage[]>(framebuffer_count_);
+	color_memories_ = std::make_unique<Allocation[]>(framebuffer_count_);
+	color_imageviews_ = std::make_unique<VkImageView[]>(framebuffer_count_);
 
-	vkGetPhysicalDeviceFormatProperties(gpu_, depth_format, &props);
-	if (props.linearTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
-		imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
-	} else if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+	for (uint32_t i = 0; i < framebuffer_count_; i++) {
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.pNext = nullptr;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.format = surface_format;
+		imageInfo.extent.width = extent_.width;
+		imageInfo.extent.height = extent_.height;
+		imageInfo.extent.depth = 1;
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-	} else {
-		assert(0);
-	}
-
-    auto drawSize = GetWindow().GetDrawSize();
-	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-	imageInfo.pNext = nullptr;
-	imageInfo.imageType = VK_IMAGE_TYPE_2D;
-	imageInfo.format = depth_format;
-	imageInfo.extent.width = drawSize.x;
-	imageInfo.extent.height = drawSize.y;
-	imageInfo.extent.depth = 1;
-	imageInfo.mipLevels = 1;
-	imageInfo.arrayLayers = 1;
-	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	imageInfo.queueFamilyIndexCount = 0;
-	imageInfo.pQueueFamilyIndices = nullptr;
-	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-	imageInfo.flags = 0;
-
-	VkMemoryAllocateInfo memAlloc = {};
-	memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memAlloc.pNext = nullptr;
-	memAlloc.allocationSize = 0;
-	memAlloc.memoryTypeIndex = 0;
-
-	VkImageViewCreateInfo viewInfo = {};
-	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-	viewInfo.pNext = nullptr;
-	viewInfo.image = VK_NULL_HANDLE;
-	viewInfo.format = depth_format;
-	viewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
-	viewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
-	viewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
-	viewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
-	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-	viewInfo.subresourceRange.baseMipLevel = 0;
-	viewInfo.subresourceRange.levelCount = 1;
-	viewInfo.subresourceRange.baseArrayLayer = 0;
-	viewInfo.subresourceRange.layerCount = 1;
-	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	viewInfo.flags = 0;
-
-	if (depth_format == VK_FORMAT_D16_UNORM_S8_UINT ||
-		depth_format == VK_FORMAT_D24_UNORM_S8_UINT ||
-		depth_format == VK_FORMAT_D32_SFLOAT_S8_UINT) {
-		viewInfo.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-	}
-
-	VkMemoryRequirements memReqs;
-
-	res = vkCreateImage(device_, &imageInfo, nullptr, &depth_image_);
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+			VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+		res = vkCreateImage(device_, &imageInfo, nullptr, &color_images_[i]);
+		assert(VK_SUCCESS == res);
+
+		AllocationInfo allocInfo{};
+		allocInfo.kind = eOptimalImage;
+		allocInfo.dedicated = true;
+		auto pass = allocator_.AllocateForImage(color_images_[i], allocInfo, color_memories_[i]);
+		assert(pass);
+
+		VkImageViewCreateInfo imageViewInfo = {};
+		imageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		imageViewInfo.format = surface_format;
+		imageViewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
+		imageViewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
+		imageViewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
+		imageViewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
+		imageViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		imageViewInfo.subresourceRange.baseMipLevel = 0;
+		imageViewInfo.subresourceRange.levelCount = 1;
+		imageViewInfo.subresourceRange.baseArrayLayer = 0;
+		imageViewInfo.subresourceRange.layerCount = 1;
+		imageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		imageViewInfo.image = color_images_[i];
+
+		res = vkCreateImageView(device_, &imageViewInfo, nullptr, &color_imageviews_[i]);
+		assert(VK_SUCCESS == res);
+	}
+
+	// Host-visible buffer that finished frames are copied into for readback.
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = (VkDeviceSize)extent_.width * extent_.height * 4;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	res = vkCreateBuffer(device_, &bufferInfo, nullptr, &readback_buffer_);
+	assert(VK_SUCCESS == res);
+
+	AllocationInfo allocInfo{};
+	allocInfo.required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	allocInfo.preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+	auto pass = allocator_.AllocateForBuffer(readback_buffer_, allocInfo, readback_memory_);
+	assert(pass);
+	current_buffer_ = framebuffer_count_ - 1;
+}
+
+void Engine::DestroyHeadlessImages() {
+	vkDestroyBuffer(device_, readback_buffer_, nullptr);
+	allocator_.Free(readback_memory_);
+	for (uint32_t i = 0; i < framebuffer_count_; i++) {
+		vkDestroyImageView(device_, color_imageviews_[i], nullptr);
+		vkDestroyImage(device_, color_images_[i], nullptr);
+		allocator_.Free(color_memories_[i]);
+	}
+}
+
+// Depth is a transient render graph texture, created with optimal tiling.
+void Engine::SelectDepthFormat() {
+	if (depth_format == VK_FORMAT_UNDEFINED) {
+		depth_format = VK_FORMAT_D16_UNORM;
+	}
+	VkFormatProperties props;
+	vkGetPhysicalDeviceFormatProperties(gpu_, depth_format, &props);
+	assert(props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+}
+
+void Engine::CreateFrames() {
+	assert(frames_in_flight > 0);
+	frames_.resize(frames_in_flight);
+	for (auto& frame : frames_) {
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		auto res = vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &frame.image_available);
+		assert(VK_SUCCESS == res);
+		res = vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &frame.render_finished);
+		assert(VK_SUCCESS == res);
+
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+		res = vkCreateFence(device_, &fenceInfo, nullptr, &frame.fence);
+		assert(VK_SUCCESS == res);
+
+		VkCommandPoolCreateInfo poolInfo = {};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		poolInfo.queueFamilyIndex = queue_indices[QueueType::eGraphics];
+		res = vkCreateCommandPool(device_, &poolInfo, nullptr, &frame.command_pool);
+		assert(VK_SUCCESS == res);
+
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = frame.command_pool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+		res = vkAllocateCommandBuffers(device_, &allocInfo, &frame.command_buffer);
+		assert(VK_SUCCESS == res);
+		res = vkAllocateCommandBuffers(device_, &allocInfo, &frame.upload_command_buffer);
+		assert(VK_SUCCESS == res);
+
+		// One pool per recording thread, the render thread included.
+		frame.secondary_pools.resize(jobs_.GetThreadCount() + 1);
+		for (auto& pool : frame.secondary_pools) {
+			res = vkCreateCommandPool(device_, &poolInfo, nullptr, &pool.command_pool);
+			assert(VK_SUCCESS == res);
+		}
+
+		frame.scratch_memory = std::make_unique<uint8_t[]>((size_t)frame_scratch_size);
+		frame.scratch.Init(frame_scratch_size);
+		frame.staging.Init(staging_size);
+		frame.uniforms.Init(uniform_size);
+	}
+	image_fences_ = std::make_unique<VkFence[]>(framebuffer_count_);
+	frame_index_ = 0;
+
+	// One persistently mapped buffer, each slot owns a staging_size window.
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = staging_size * frames_in_flight;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	auto res = vkCreateBuffer(device_, &bufferInfo, nullptr, &staging_buffer_);
 	assert(VK_SUCCESS == res);
 
-	vkGetImageMemoryRequirements(device_, depth_image_, &memReqs);
+	AllocationInfo allocInfo{};
+	allocInfo.required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	allocInfo.preferred = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	auto pass = allocator_.AllocateForBuffer(staging_buffer_, allocInfo, staging_memory_);
+	assert(pass);
+
+	// Same layout for uniforms. Device-local host-visible memory is preferred
+	// so the shaders read them without crossing the bus.
+	uniform_alignment_ = std::max<VkDeviceSize>(gpu_properties.limits.minUniformBufferOffsetAlignment, 1);
+	uniform_size = (uniform_size + uniform_alignment_ - 1) / uniform_alignment_ * uniform_alignment_;
+	bufferInfo.size = uniform_size * frames_in_flight;
+	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	res = vkCreateBuffer(device_, &bufferInfo, nullptr, &uniform_buffer_);
+	assert(VK_SUCCESS == res);
 
-	memAlloc.allocationSize = memReqs.size;
-	auto pass = GetMemoryType(memReqs.memoryTypeBits,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		memAlloc.memoryTypeIndex);
+	allocInfo.required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	allocInfo.preferred = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	pass = allocator_.AllocateForBuffer(uniform_buffer_, allocInfo, uniform_memory_);
 	assert(pass);
+}
+
+void Engine::DestroyFrames() {
+	for (auto& frame : frames_) {
+		ReleaseRetired(frame);
+		for (auto& pool : frame.secondary_pools) {
+			vkDestroyCommandPool(device_, pool.command_pool, nullptr);
+		}
+		vkDestroyCommandPool(device_, frame.command_pool, nullptr);
+		vkDestroyFence(device_, frame.fence, nullptr);
+		vkDestroySemaphore(device_, frame.render_finished, nullptr);
+		vkDestroySemaphore(device_, frame.image_available, nullptr);
+	}
+	frames_.clear();
+
+	vkDestroyBuffer(device_, staging_buffer_, nullptr);
+	allocator_.Free(staging_memory_);
+	vkDestroyBuffer(device_, uniform_buffer_, nullptr);
+	allocator_.Free(uniform_memory_);
+}
+
+void Engine::ReleaseRetired(FrameSlot& frame) {
+	for (auto& retired : frame.retired) {
+		vkDestroyBuffer(device_, retired.buffer, nullptr);
+		allocator_.Free(retired.allocation);
+	}
+	frame.retired.clear();
+}
+
+void Engine::PrepareFrameSlot() {
+	if (slot_prepared_) return;
+	auto& frame = frames_[frame_index_];
+
+	// Only blocks when the gpu is still working on the frame that last used
+	// this slot, i.e. when the cpu is frames_in_flight frames ahead.
+	vkWaitForFences(device_, 1, &frame.fence, VK_TRUE, UINT64_MAX);
+	if (frame_number_ + 1 > frames_in_flight) {
+		completed_frames_ = std::max(completed_frames_, frame_number_ + 1 - frames_in_flight);
+	}
+
+	vkResetCommandPool(device_, frame.command_pool, 0);
+	for (auto& pool : frame.secondary_pools) {
+		if (pool.used == 0) continue;
+		vkResetCommandPool(device_, pool.command_pool, 0);
+		pool.used = 0;
+	}
+	frame.upload_recording = false;
+	frame.scratch.Reset();
+	frame.staging.Reset();
+	frame.uniforms.Reset();
+	descriptor_allocator_.ResetFrame(frame_index_);
+	ReleaseRetired(frame);
+	DestroyRetiredSwapchains(false);
+	slot_prepared_ = true;
+}
+
+VkCommandBuffer Engine::GetUploadCommandBuffer() {
+	PrepareFrameSlot();
+	auto& frame = frames_[frame_index_];
+	if (frame.upload_recording) return frame.upload_command_buffer;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	auto res = vkBeginCommandBuffer(frame.upload_command_buffer, &beginInfo);
+	assert(VK_SUCCESS == res);
+
+	// Earlier frames may still read what this frame overwrites.
+	vkCmdPipelineBarrier(frame.upload_command_buffer,
+		VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+	frame.upload_recording = true;
+	return frame.upload_command_buffer;
+}
+
+uint8_t* Engine::AllocateUniform(VkDeviceSize size, uint32_t& dynamic_offset) {
+	if (!slot_prepared_) {
+		std::lock_guard<std::mutex> lock{ upload_mutex_ };
+		PrepareFrameSlot();
+	}
+	auto& frame = frames_[frame_index_];
+	uint64_t offset = frame.uniforms.Allocate(size, uniform_alignment_);
+	if (offset == LinearAllocator::kInvalidOffset) return nullptr;
+	offset += uniform_size * frame_index_;
+	dynamic_offset = (uint32_t)offset;
+	return uniform_memory_.mapped + offset;
+}
+
+void Engine::StageUpload(VkBuffer dst, VkDeviceSize offset, const void* data, VkDeviceSize size) {
+	std::lock_guard<std::mutex> lock{ upload_mutex_ };
+	VkCommandBuffer cmd = GetUploadCommandBuffer();
+	auto& frame = frames_[frame_index_];
+
+	VkBuffer src = staging_buffer_;
+	VkDeviceSize srcOffset = frame.staging.Allocate(size, allocator_.GetNonCoherentAtomSize());
+	uint8_t* mapped = nullptr;
+	if (srcOffset != LinearAllocator::kInvalidOffset) {
+		srcOffset += staging_size * frame_index_;
+		mapped = staging_memory_.mapped + srcOffset;
+		memcpy(mapped, data, (size_t)size);
+		if (!allocator_.IsCoherent(staging_memory_)) {
+			QueueFlush(staging_memory_, srcOffset, size);
+		}
+	} else {
+		// The ring is full, spill into a buffer that lives as long as the frame.
+		RetiredBuffer spill{};
+		VkBufferCreateInfo bufferInfo = {};
+		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+		bufferInfo.size = size;
+		bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		auto res = vkCreateBuffer(device_, &bufferInfo, nullptr, &spill.buffer);
+		assert(VK_SUCCESS == res);
+
+		AllocationInfo allocInfo{};
+		allocInfo.required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+		allocInfo.preferred = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		auto pass = allocator_.AllocateForBuffer(spill.buffer, allocInfo, spill.allocation);
+		assert(pass);
+
+		memcpy(spill.allocation.mapped, data, (size_t)size);
+		if (!allocator_.IsCoherent(spill.allocation)) {
+			QueueFlush(spill.allocation, 0, size);
+		}
+		src = spill.buffer;
+		srcOffset = 0;
+		frame.retired.push_back(spill);
+	}
+
+	VkBufferCopy region = {};
+	region.srcOffset = srcOffset;
+	region.dstOffset = offset;
+	region.size = size;
+	vkCmdCopyBuffer(cmd, src, dst, 1, &region);
+}
+
+void Engine::FlushMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) {
+	if (allocator_.IsCoherent(allocation)) return;
+	std::lock_guard<std::mutex> lock{ upload_mutex_ };
+	QueueFlush(allocation, offset, size);
+}
+
+void Engine::QueueFlush(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) {
+	// Ranges must be multiples of nonCoherentAtomSize; buddy ranges are
+	// aligned well beyond that, dedicated ones may have to flush to the end.
+	VkDeviceSize atom = allocator_.GetNonCoherentAtomSize();
+	VkDeviceSize begin = (allocation.offset + offset) / atom * atom;
+	VkDeviceSize end = (allocation.offset + offset + size + atom - 1) / atom * atom;
+
+	VkMappedMemoryRange range = {};
+	range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	range.memory = allocation.memory;
+	range.offset = begin;
+	range.size = end - begin;
+	if (allocation.IsDedicated() && end > allocation.size) {
+		range.size = VK_WHOLE_SIZE;
+	}
+
+	// Consecutive writes into the same memory usually extend the last range.
+	if (!pending_flushes_.empty()) {
+		auto& last = pending_flushes_.back();
+		if (last.memory == range.memory && last.size != VK_WHOLE_SIZE &&
+			range.size != VK_WHOLE_SIZE && last.offset + last.size >= range.offset &&
+			range.offset >= last.offset) {
+			last.size = std::max(last.offset + last.size, range.offset + range.size) - last.offset;
+			return;
+		}
+	}
+	pending_flushes_.push_back(range);
+}
+
+void Engine::FlushPendingRanges() {
+	std::lock_guard<std::mutex> lock{ upload_mutex_ };
+	if (pending_flushes_.empty()) return;
+	auto res = vkFlushMappedMemoryRanges(device_, (uint32_t)pending_flushes_.size(), pending_flushes_.data());
+	assert(VK_SUCCESS == res);
+	pending_flushes_.clear();
+}
+
+void Engine::DeferDestroy(VkBuffer buffer, Allocation& allocation) {
+	std::lock_guard<std::mutex> lock{ upload_mutex_ };
+	// Tie it to the frame being built, whose fence covers every earlier use.
+	PrepareFrameSlot();
+	frames_[frame_index_].retired.push_back({ buffer, allocation });
+	allocation = Allocation{};
+}
+
+void* Engine::AllocateScratch(size_t size, size_t alignment) {
+	auto& frame = frames_[frame_index_];
+	uint64_t offset = frame.scratch.Allocate(size, alignment);
+	if (offset == LinearAllocator::kInvalidOffset) return nullptr;
+	return frame.scratch_memory.get() + offset;
+}
+
+bool Engine::WaitFrame() {
+	if (frame_waited_) return true;
+	PROFILE_SCOPE("WaitFrame");
+	if (swapchain_dirty_ && !Resize()) return false;
+
+	auto& frame = frames_[frame_index_];
+
+	// The latency limiter waits for the frame submitted max_queued_frames
+	// ago, which is earlier than the slot's own previous use when it is set
+	// below frames_in_flight.
+	uint32_t queued = max_queued_frames;
+	if (queued > 0 && queued < frames_in_flight) {
+		uint32_t limit_index = (frame_index_ + frames_in_flight - queued) % frames_in_flight;
+		vkWaitForFences(device_, 1, &frames_[limit_index].fence, VK_TRUE, UINT64_MAX);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ upload_mutex_ };
+		PrepareFrameSlot();
+	}
+
+	if (headless) {
+		current_buffer_ = (current_buffer_ + 1) % framebuffer_count_;
+	} else {
+		auto res = vkAcquireNextImageKHR(device_, swapchain_, UINT64_MAX,
+			frame.image_available, VK_NULL_HANDLE, &current_buffer_);
+		if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+			if (!Resize()) return false;
+			res = vkAcquireNextImageKHR(device_, swapchain_, UINT64_MAX,
+				frame.image_available, VK_NULL_HANDLE, &current_buffer_);
+		}
+		// A suboptimal image is still presented, the swapchain is rebuilt
+		// after this frame.
+		if (res == VK_SUBOPTIMAL_KHR) swapchain_dirty_ = true;
+		if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) return false;
+	}
+
+	// The image may still be rendered by another slot when there are fewer
+	// images than frames in flight, or when they are acquired out of order.
+	VkFence& image_fence = image_fences_[current_buffer_];
+	if (image_fence != VK_NULL_HANDLE && image_fence != frame.fence) {
+		vkWaitForFences(device_, 1, &image_fence, VK_TRUE, UINT64_MAX);
+	}
+	image_fence = frame.fence;
+	vkResetFences(device_, 1, &frame.fence);
+	frame_waited_ = true;
+	return true;
+}
+
+bool Engine::BeginFrame(VkSubpassContents contents) {
+	if (!WaitFrame()) return false;
+	PROFILE_SCOPE("BeginFrame");
+	frame_waited_ = false;
+	textures_.Update();
+
+	auto& frame = frames_[frame_index_];
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	auto res = vkBeginCommandBuffer(frame.command_buffer, &beginInfo);
+	assert(VK_SUCCESS == res);
+
+	gpu_profiler_.BeginFrame(frame.command_buffer, frame_index_);
+	frame_scope_ = gpu_profiler_.BeginScope(frame.command_buffer, "Frame");
+
+	// The swapchain image is waited for at color output, which the first
+	// write to it has to wait for as well. It leaves the frame presentable,
+	// or ready for ReadbackFrame() when headless.
+	ImportState acquired{};
+	acquired.stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	ImportState finished{};
+	if (headless) {
+		finished.layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		finished.stages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		finished.access = VK_ACCESS_TRANSFER_READ_BIT;
+	} else {
+		finished.layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		finished.stages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	}
+	RenderTextureDesc colorDesc{};
+	colorDesc.format = surface_format;
+	colorDesc.extent = extent_;
+	RenderResource color = render_graph_.ImportTexture("Backbuffer", color_images_[current_buffer_],
+		color_imageviews_[current_buffer_], colorDesc, acquired, finished);
+
+	RenderTextureDesc depthDesc{};
+	depthDesc.format = depth_format;
+	depthDesc.extent = extent_;
+	RenderResource depth = render_graph_.CreateTexture("Depth", depthDesc);
+
+	VkClearValue colorClear{};
+	colorClear.color = clear_color;
+	VkClearValue depthClear{};
+	depthClear.depthStencil = { 1.0f, 0 };
+	render_graph_.AddPass("Main pass", [this](const RenderPassContext& context) { main_pass_ = context; })
+		.Write(color, eColorAttachment).Clear(color, colorClear)
+		.Write(depth, eDepthAttachment).Clear(depth, depthClear)
+		.Open(contents);
+	render_graph_.Execute(frame.command_buffer);
+	main_pass_contents_ = contents;
+	return true;
+}
+
+VkCommandBuffer Engine::GetSecondaryCommandBuffer(FrameSlot& frame) {
+	auto& pool = frame.secondary_pools[JobSystem::GetThreadIndex()];
+	if (pool.used == pool.command_buffers.size()) {
+		// Grows in batches, the buffers are kept across frames and only
+		// reset with their pool.
+		const uint32_t batch = 8;
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = pool.command_pool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = batch;
+		pool.command_buffers.resize(pool.used + batch);
+		auto res = vkAllocateCommandBuffers(device_, &allocInfo, &pool.command_buffers[pool.used]);
+		assert(VK_SUCCESS == res);
+	}
+	return pool.command_buffers[pool.used++];
+}
 
-	res = vkAllocateMemory(device_, &memAlloc, nullptr, &depth_memory_);
+void Engine::RecordParallel(uint32_t item_count, const RecordFunc& record, uint32_t chunk_size) {
+	PROFILE_SCOPE("RecordParallel");
+	assert(main_pass_contents_ == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	if (item_count == 0) return;
+	auto& frame = frames_[frame_index_];
+
+	if (chunk_size == 0) {
+		// A few chunks per thread so a slow chunk does not hold up the
+		// others, but large enough to keep the per-buffer cost negligible.
+		uint32_t target = (jobs_.GetThreadCount() + 1) * 4;
+		chunk_size = std::max(256u, (item_count + target - 1) / target);
+	}
+	uint32_t chunk_count = (item_count + chunk_size - 1) / chunk_size;
+	std::vector<VkCommandBuffer> chunks(chunk_count);
+
+	VkCommandBufferInheritanceInfo inheritanceInfo = {};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = main_pass_.render_pass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = main_pass_.framebuffer;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+		VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+	VkViewport viewport = {};
+	viewport.width = (float)extent_.width;
+	viewport.height = (float)extent_.height;
+	viewport.maxDepth = 1.0f;
+	VkRect2D scissor = {};
+	scissor.extent = extent_;
+
+	jobs_.ParallelFor(chunk_count, [&](uint32_t chunk) {
+		PROFILE_SCOPE("Record chunk");
+		VkCommandBuffer cmd = GetSecondaryCommandBuffer(frame);
+		auto res = vkBeginCommandBuffer(cmd, &beginInfo);
+		assert(VK_SUCCESS == res);
+		vkCmdSetViewport(cmd, 0, 1, &viewport);
+		vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+		uint32_t first = chunk * chunk_size;
+		record(cmd, first, std::min(chunk_size, item_count - first));
+
+		res = vkEndCommandBuffer(cmd);
+		assert(VK_SUCCESS == res);
+		chunks[chunk] = cmd;
+	});
+
+	vkCmdExecuteCommands(frame.command_buffer, chunk_count, chunks.data());
+}
+
+void Engine::EndFrame() {
+	PROFILE_SCOPE("EndFrame");
+	auto& frame = frames_[frame_index_];
+
+	render_graph_.Close(frame.command_buffer);
+	gpu_profiler_.EndScope(frame.command_buffer, frame_scope_);
+	auto res = vkEndCommandBuffer(frame.command_buffer);
+	assert(VK_SUCCESS == res);
+
+	// Uploads run ahead of the draws in the same submission.
+	VkCommandBuffer commandBuffers[2];
+	uint32_t commandBufferCount = 0;
+	{
+		std::lock_guard<std::mutex> lock{ upload_mutex_ };
+		if (frame.upload_recording) {
+			VkMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+				VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+			vkCmdPipelineBarrier(frame.upload_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 1, &barrier, 0, nullptr, 0, nullptr);
+			res = vkEndCommandBuffer(frame.upload_command_buffer);
+			assert(VK_SUCCESS == res);
+			frame.upload_recording = false;
+			commandBuffers[commandBufferCount++] = frame.upload_command_buffer;
+		}
+		slot_prepared_ = false;
+	}
+	commandBuffers[commandBufferCount++] = frame.command_buffer;
+	if (frame.uniforms.GetUsed() > 0) {
+		FlushMappedRange(uniform_memory_, uniform_size * frame_index_, frame.uniforms.GetUsed());
+	}
+	FlushPendingRanges();
+
+	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = commandBufferCount;
+	submitInfo.pCommandBuffers = commandBuffers;
+	if (!headless) {
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = &frame.image_available;
+		submitInfo.pWaitDstStageMask = &waitStage;
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &frame.render_finished;
+	}
+	res = QueueSubmit(QueueType::eGraphics, 1, &submitInfo, frame.fence);
 	assert(VK_SUCCESS == res);
 
-	res = vkBindImageMemory(device_, depth_image_, depth_memory_, 0);
+	if (headless) {
+		finished_buffer_ = current_buffer_;
+		finished_frame_ = frame_index_;
+	} else {
+		VkPresentInfoKHR presentInfo = {};
+		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+		presentInfo.waitSemaphoreCount = 1;
+		presentInfo.pWaitSemaphores = &frame.render_finished;
+		presentInfo.swapchainCount = 1;
+		presentInfo.pSwapchains = &swapchain_;
+		presentInfo.pImageIndices = &current_buffer_;
+		PROFILE_SCOPE("Present");
+		res = QueuePresent(&presentInfo);
+		if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR) {
+			swapchain_dirty_ = true;
+		}
+	}
+
+	frame_index_ = (frame_index_ + 1) % frames_in_flight;
+	++frame_number_;
+}
+
+bool Engine::ReadbackFrame(std::vector<uint8_t>& pixels) {
+	if (!headless || finished_buffer_ == UINT32_MAX) return false;
+
+	auto& frame = frames_[finished_frame_];
+	vkWaitForFences(device_, 1, &frame.fence, VK_TRUE, UINT64_MAX);
+
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = frame.command_pool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	VkCommandBuffer cmd;
+	auto res = vkAllocateCommandBuffers(device_, &allocInfo, &cmd);
 	assert(VK_SUCCESS == res);
 
-	viewInfo.image = depth_image_;
-	res = vkCreateImageView(device_, &viewInfo, NULL, &depth_imageview_);
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(cmd, &beginInfo);
+
+	VkImageMemoryBarrier imageBarrier = {};
+	imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	imageBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageBarrier.image = color_images_[finished_buffer_];
+	imageBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+	VkBufferImageCopy region = {};
+	region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	region.imageExtent = { extent_.width, extent_.height, 1 };
+	vkCmdCopyImageToBuffer(cmd, color_images_[finished_buffer_],
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback_buffer_, 1, &region);
+
+	VkBufferMemoryBarrier bufferBarrier = {};
+	bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bufferBarrier.buffer = readback_buffer_;
+	bufferBarrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferBarrier, 0, nullptr);
+	vkEndCommandBuffer(cmd);
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &cmd;
+
+	VkFenceCreateInfo fenceInfo = {};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	VkFence fence;
+	res = vkCreateFence(device_, &fenceInfo, nullptr, &fence);
 	assert(VK_SUCCESS == res);
+	res = QueueSubmit(QueueType::eGraphics, 1, &submitInfo, fence);
+	assert(VK_SUCCESS == res);
+	vkWaitForFences(device_, 1, &fence, VK_TRUE, UINT64_MAX);
+	vkDestroyFence(device_, fence, nullptr);
+	vkFreeCommandBuffers(device_, frame.command_pool, 1, &cmd);
+
+	size_t size = (size_t)extent_.width * extent_.height * 4;
+	pixels.resize(size);
+	memcpy(pixels.data(), readback_memory_.mapped, size);
+	return true;
 }
 
-void Engine::DestroyDepthImage() {
-	vkDestroyImage(device_, depth_image_, nullptr);
-	vkDestroyImageView(device_, depth_imageview_, nullptr);
-	vkFreeMemory(device_, depth_memory_, nullptr);
+
+// On-disk layout: PipelineCacheFileHeader followed by the driver blob, whose
+// own header (VkPipelineCacheHeaderVersionOne) is checked against the gpu.
+const uint32_t kPipelineCacheMagic = 0x43504256; // "VBPC"
+const uint32_t kPipelineCacheVersion = 1;
+
+struct PipelineCacheFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t data_size;
+	uint32_t checksum;
+};
+
+static uint32_t Fnv1a(const uint8_t* data, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-void Engine::CreateSemaphore() {
-    VkSemaphoreCreateInfo semaphoreInfo;
-    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    semaphoreInfo.pNext = nullptr;
-    semaphoreInfo.flags = 0;
+static bool ValidatePipelineCacheData(const std::vector<uint8_t>& file,
+	const VkPhysicalDeviceProperties& props) {
+	const size_t kVkHeaderSize = 16 + VK_UUID_SIZE;
+	if (file.size() < sizeof(PipelineCacheFileHeader) + kVkHeaderSize) return false;
+
+	PipelineCacheFileHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != kPipelineCacheMagic || header.version != kPipelineCacheVersion) return false;
+	if (header.data_size != file.size() - sizeof(header)) return false;
+
+	const uint8_t* data = file.data() + sizeof(header);
+	if (header.checksum != Fnv1a(data, header.data_size)) return false;
+
+	uint32_t vk_header[4];
+	memcpy(vk_header, data, sizeof(vk_header));
+	if (vk_header[0] < kVkHeaderSize || vk_header[0] > header.data_size) return false;
+	if (vk_header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE) return false;
+	if (vk_header[2] != props.vendorID || vk_header[3] != props.deviceID) return false;
+	return memcmp(data + sizeof(vk_header), props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void Engine::CreatePipelineCache() {
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<uint8_t> file{};
+	std::ifstream fs{ pipeline_cache_path, std::ios::binary | std::ios::ate };
+	if (fs) {
+		file.resize((size_t)fs.tellg());
+		fs.seekg(0, fs.beg);
+		fs.read((char*)file.data(), file.size());
+		if (!fs) file.clear();
+	}
+
+	bool warm = ValidatePipelineCacheData(file, gpu_properties);
+
+	VkPipelineCacheCreateInfo cacheInfo = {};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.pNext = nullptr;
+	cacheInfo.flags = 0;
+	if (warm) {
+		cacheInfo.initialDataSize = file.size() - sizeof(PipelineCacheFileHeader);
+		cacheInfo.pInitialData = file.data() + sizeof(PipelineCacheFileHeader);
+	}
 
-    auto res = vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &image_available_semaphore_);
-    assert(res == VK_SUCCESS);
+	auto res = vkCreatePipelineCache(device_, &cacheInfo, nullptr, &pipeline_cache_);
+	if (res != VK_SUCCESS && warm) {
+		// The driver may still refuse a blob that passed the header checks.
+		warm = false;
+		cacheInfo.initialDataSize = 0;
+		cacheInfo.pInitialData = nullptr;
+		res = vkCreatePipelineCache(device_, &cacheInfo, nullptr, &pipeline_cache_);
+	}
+	assert(VK_SUCCESS == res);
 
-    res = vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &render_finished_semaphore_);
-    assert(res == VK_SUCCESS);
+	auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin);
+	std::cerr << "pipeline cache: " << (warm ? "warm" : "cold") << " start, "
+		<< (warm ? cacheInfo.initialDataSize : 0) << " bytes, "
+		<< elapsed.count() << " ms" << std::endl;
 }
 
-void Engine::DestroySemaphore() {
-    vkDestroySemaphore(device_, image_available_semaphore_, nullptr);
-    vkDestroySemaphore(device_, render_finished_semaphore_, nullptr);
+void Engine::DestroyPipelineCache() {
+	size_t size = 0;
+	auto res = vkGetPipelineCacheData(device_, pipeline_cache_, &size, nullptr);
+	if (res == VK_SUCCESS && size > 0) {
+		std::vector<uint8_t> data(size);
+		res = vkGetPipelineCacheData(device_, pipeline_cache_, &size, data.data());
+		if (res == VK_SUCCESS) {
+			PipelineCacheFileHeader header;
+			header.magic = kPipelineCacheMagic;
+			header.version = kPipelineCacheVersion;
+			header.data_size = (uint32_t)size;
+			header.checksum = Fnv1a(data.data(), size);
+
+			// Write to a temporary and rename over the old file so a crash
+			// mid-write never leaves a truncated cache behind.
+			std::string tmp_path = pipeline_cache_path + ".tmp";
+			std::ofstream fs{ tmp_path, std::ios::binary | std::ios::trunc };
+			fs.write((const char*)&header, sizeof(header));
+			fs.write((const char*)data.data(), size);
+			fs.close();
+
+			std::error_code ec;
+			if (fs) {
+				std::filesystem::rename(tmp_path, pipeline_cache_path, ec);
+			}
+			if (!fs || ec) {
+				std::filesystem::remove(tmp_path, ec);
+				std::cerr << "pipeline cache: failed to write " << pipeline_cache_path << std::endl;
+			}
+		}
+	}
+	vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
 }
 
 Window& GetWindow()
@@ -510,7 +1695,7 @@ void Window::Create()
 {
     window_ = SDL_CreateWindow("DEMO",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        1280, 720, SDL_WINDOW_VULKAN | SDL_WINDOW_SHOWN);
+        1280, 720, SDL_WINDOW_VULKAN | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
     assert(window_);
 }
 
@@ -3,11 +3,24 @@
 #include <vector>
 #include <array>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 
 #include <vulkan/vulkan.h>
 #include <SDL2/SDL.h>
 #include <glm/glm.hpp>
 
+#include "descriptor_cache.h"
+#include "gpu_profiler.h"
+#include "job_system.h"
+#include "linear_allocator.h"
+#include "memory_allocator.h"
+#include "pipeline_state_cache.h"
+#include "render_graph.h"
+#include "shader_cache.h"
+#include "texture_streamer.h"
+
 class Window {
 public:
     void Create();
@@ -26,46 +39,276 @@ private:
 enum QueueType : uint32_t {
     eGraphics,
     ePresent,
+    eTransfer,
+    eCompute,
     eMaxQueue,
 };
 
+enum PresentPolicy : uint32_t {
+    eLowLatency,
+    eThroughput,
+    ePowerSave,
+};
+
+// Describes a hand-off of a resource from one queue to another. When the
+// queue families differ the release half is recorded on the source queue and
+// the acquire half on the destination queue, ordered by a semaphore.
+struct QueueTransfer {
+    QueueType src{ eGraphics };
+    QueueType dst{ eGraphics };
+    VkPipelineStageFlags src_stage{ VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT };
+    VkAccessFlags src_access{ 0 };
+    VkPipelineStageFlags dst_stage{ VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT };
+    VkAccessFlags dst_access{ 0 };
+};
+
 class Engine {
 public:
     
     void Create();
     void Destroy();
 
+    // Waits until a frame may start and acquires its image. Calling it before
+    // sampling input keeps the input-to-photon latency short, BeginFrame()
+    // calls it itself when it was skipped.
+    bool WaitFrame();
+    // Begins recording the main render pass for the acquired image.
+    // Returns false if no image could be acquired. With
+    // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS the pass may only be
+    // filled through RecordParallel().
+    bool BeginFrame(VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
+    void EndFrame();
+    // Blocks until the gpu has finished every submitted frame, call it
+    // between frames. Other queues keep running.
+    void WaitForFrames();
+
+    // Rebuilds the swapchain (or headless images) and the size dependent
+    // attachments. RequestResize() defers it to the next BeginFrame().
+    bool Resize();
+    void RequestResize() { swapchain_dirty_ = true; }
+    VkCommandBuffer GetCommandBuffer() const { return frames_[frame_index_].command_buffer; }
+    uint32_t GetFrameIndex() const { return frame_index_; }
+
+    // Splits item_count items into chunks of chunk_size and records them on
+    // the job system, each chunk into its own secondary command buffer
+    // inside the main render pass. The chunks are executed in order, so the
+    // result does not depend on which thread recorded what. 0 picks a chunk
+    // size that gives every thread a few chunks to balance the load.
+    // Secondaries inherit nothing but the render pass: record binds its own
+    // pipeline and descriptors, viewport and scissor are set to the full
+    // extent. AllocateUniform() and AllocateScratch() stay render thread
+    // only, reserve per-item data before the call.
+    typedef std::function<void(VkCommandBuffer cmd, uint32_t first, uint32_t count)> RecordFunc;
+    void RecordParallel(uint32_t item_count, const RecordFunc& record, uint32_t chunk_size = 0);
+
+    // Cpu memory valid until the current frame slot is reused, returns
+    // nullptr once the slot's frame_scratch_size is exhausted.
+    void* AllocateScratch(size_t size, size_t alignment = 16);
+
+    // Bump allocates from the current frame's window of the uniform buffer.
+    // Bind GetUniformBuffer() once as UNIFORM_BUFFER_DYNAMIC and pass the
+    // returned offset at draw time. Render thread only, like AllocateScratch,
+    // and nullptr once the slot's uniform_size is exhausted.
+    uint8_t* AllocateUniform(VkDeviceSize size, uint32_t& dynamic_offset);
+    template<typename T>
+    T* AllocateUniform(uint32_t& dynamic_offset) {
+        return reinterpret_cast<T*>(AllocateUniform(sizeof(T), dynamic_offset));
+    }
+    VkBuffer GetUniformBuffer() const { return uniform_buffer_; }
+
+    VkDescriptorSetLayout GetDescriptorSetLayout(const VkDescriptorSetLayoutBinding* bindings, uint32_t count) {
+        return descriptor_layouts_.Get(bindings, count);
+    }
+    // Sets are valid for the current frame only, identical bindings return
+    // the same set within a frame.
+    VkDescriptorSet GetDescriptorSet(VkDescriptorSetLayout layout, const DescriptorBinding* bindings, uint32_t count) {
+        return descriptor_allocator_.GetSet(frame_index_, layout, bindings, count);
+    }
+
+    // Copies data into the current frame's staging window and records a copy
+    // into dst, submitted ahead of the frame's draw commands.
+    void StageUpload(VkBuffer dst, VkDeviceSize offset, const void* data, VkDeviceSize size);
+    // Non-coherent writes are flushed in one batch right before the submit.
+    void FlushMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size);
+    // Destroys the buffer once every frame that may still use it has retired.
+    void DeferDestroy(VkBuffer buffer, Allocation& allocation);
+    // Number of the frame being recorded, counts EndFrame() calls.
+    uint64_t GetFrameNumber() const { return frame_number_; }
+    // Every frame numbered below this has finished on the gpu.
+    uint64_t GetCompletedFrames() const { return completed_frames_; }
+    // Compatible with the main pass of every frame, valid from Create() on,
+    // so pipelines can be built while loading.
+    VkRenderPass GetRenderPass() const { return main_render_pass_; }
+    VkExtent2D GetExtent() const { return extent_; }
+
+    // Headless only: copies the last finished frame as tightly packed
+    // pixels in surface_format.
+    bool ReadbackFrame(std::vector<uint8_t>& pixels);
+
+    VkDevice GetDevice() const { return device_; }
+    MemoryAllocator& GetAllocator() { return allocator_; }
+    VkQueue GetDeviceQueue(QueueType type) const { return queues[type]; }
+    uint32_t GetQueueFamily(QueueType type) const { return queue_indices[type]; }
+    bool NeedsOwnershipTransfer(QueueType src, QueueType dst) const {
+        return queue_indices[src] != queue_indices[dst];
+    }
+
+    // Queue types may alias the same VkQueue, submits are serialized per queue.
+    VkResult QueueSubmit(QueueType type, uint32_t count, const VkSubmitInfo* submits, VkFence fence);
+    VkResult QueuePresent(const VkPresentInfoKHR* present_info);
+
+    void ReleaseBuffer(VkCommandBuffer cmd, VkBuffer buffer, const QueueTransfer& transfer) const;
+    void AcquireBuffer(VkCommandBuffer cmd, VkBuffer buffer, const QueueTransfer& transfer) const;
+    void ReleaseImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range,
+        VkImageLayout old_layout, VkImageLayout new_layout, const QueueTransfer& transfer) const;
+    void AcquireImage(VkCommandBuffer cmd, VkImage image, const VkImageSubresourceRange& range,
+        VkImageLayout old_layout, VkImageLayout new_layout, const QueueTransfer& transfer) const;
+
+    PipelineStateCache& GetPipelines() { return pipelines_; }
+    ShaderModuleCache& GetShaders() { return shaders_; }
+    TextureStreamer& GetTextures() { return textures_; }
+    JobSystem& GetJobs() { return jobs_; }
+    // Times the frame and every render graph pass, the main pass included.
+    // Scopes of your own go into GetCommandBuffer() between BeginFrame()
+    // and EndFrame() when the main pass records inline. With
+    // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS they go into the
+    // secondaries instead, the primary may not record inside the pass.
+    GpuProfiler& GetGpuProfiler() { return gpu_profiler_; }
+    // Passes added before BeginFrame() are recorded ahead of the main render
+    // pass, into the frame's command buffer. BeginFrame() adds the main pass
+    // itself, over the acquired image and a transient depth buffer.
+    RenderGraph& GetRenderGraph() { return render_graph_; }
+
 private:
     VkInstance instance_{};
     VkDebugUtilsMessengerEXT debug_messenger_{};
+    // The device UUID can be queried, see CreateInstance().
+    bool device_id_supported_{ false };
     VkPhysicalDevice gpu_{};
     VkSurfaceKHR surface_{};
     VkDevice device_{};
+    MemoryAllocator allocator_{};
     std::array<uint32_t, QueueType::eMaxQueue> queue_indices;
     std::array<VkQueue, QueueType::eMaxQueue> queues{};
+    std::array<uint32_t, QueueType::eMaxQueue> queue_slots_{};
+    std::array<uint32_t, QueueType::eMaxQueue> queue_locks_{};
+    std::array<std::mutex, QueueType::eMaxQueue> queue_mutexes_{};
     VkSwapchainKHR swapchain_{};
+    bool swapchain_dirty_{ false };
+    struct RetiredSwapchain {
+        VkSwapchainKHR swapchain{};
+        // Destroyed when this frame's slot is prepared.
+        uint64_t frame{ 0 };
+    };
+    std::vector<RetiredSwapchain> retired_swapchains_{};
+    uint64_t frame_number_{ 0 };
+    uint64_t completed_frames_{ 0 };
     union {
         uint32_t framebuffer_count_{ 0 };
         uint32_t swapchain_image_count_;
     };
     uint32_t current_buffer_{ 0 };
+    uint32_t finished_buffer_{ UINT32_MAX };
+    VkExtent2D extent_{};
     std::unique_ptr<VkImage[]> color_images_{};
+    std::unique_ptr<Allocation[]> color_memories_{};
     std::unique_ptr<VkImageView[]> color_imageviews_{};
-    VkImage depth_image_{};
-    VkDeviceMemory depth_memory_{};
-    VkImageView depth_imageview_{};
-    VkSemaphore image_available_semaphore_{};
-    VkSemaphore render_finished_semaphore_{};
+    VkBuffer readback_buffer_{};
+    Allocation readback_memory_{};
+
+    struct RetiredBuffer {
+        VkBuffer buffer{};
+        Allocation allocation{};
+    };
+    struct SecondaryPool {
+        VkCommandPool command_pool{};
+        std::vector<VkCommandBuffer> command_buffers{};
+        uint32_t used{ 0 };
+    };
+    struct FrameSlot {
+        VkSemaphore image_available{};
+        VkSemaphore render_finished{};
+        VkFence fence{};
+        VkCommandPool command_pool{};
+        VkCommandBuffer command_buffer{};
+        VkCommandBuffer upload_command_buffer{};
+        bool upload_recording{ false };
+        std::unique_ptr<uint8_t[]> scratch_memory{};
+        LinearAllocator scratch{};
+        LinearAllocator staging{};
+        LinearAllocator uniforms{};
+        std::vector<RetiredBuffer> retired{};
+        // Indexed by JobSystem::GetThreadIndex(), only ever touched by
+        // that thread while recording.
+        std::vector<SecondaryPool> secondary_pools{};
+    };
+    std::vector<FrameSlot> frames_{};
+    uint32_t frame_index_{ 0 };
+    VkSubpassContents main_pass_contents_{ VK_SUBPASS_CONTENTS_INLINE };
+    // Render pass and framebuffer the graph began the main pass with.
+    RenderPassContext main_pass_{};
+    VkRenderPass main_render_pass_{};
+    uint32_t frame_scope_{ UINT32_MAX };
+    bool frame_waited_{ false };
+    bool slot_prepared_{ false };
+    VkBuffer staging_buffer_{};
+    Allocation staging_memory_{};
+    VkBuffer uniform_buffer_{};
+    Allocation uniform_memory_{};
+    VkDeviceSize uniform_alignment_{ 256 };
+    std::vector<VkMappedMemoryRange> pending_flushes_{};
+    std::mutex upload_mutex_{};
+    DescriptorLayoutCache descriptor_layouts_{};
+    DescriptorAllocator descriptor_allocator_{};
+    uint32_t finished_frame_{ 0 };
+    // Fence of the frame slot that last rendered each image.
+    std::unique_ptr<VkFence[]> image_fences_{};
+    VkPipelineCache pipeline_cache_{};
+    PipelineStateCache pipelines_{};
+    ShaderModuleCache shaders_{};
+    TextureStreamer textures_{};
+    JobSystem jobs_{};
+    GpuProfiler gpu_profiler_{};
+    RenderGraph render_graph_{};
     
 public:
+    // Renders into an owned ring of images instead of a window swapchain.
+    bool headless{ false };
+    VkExtent2D headless_extent{ 1280, 720 };
+    uint32_t headless_image_count{ 3 };
+    VkClearColorValue clear_color{ { 0.0f, 0.0f, 0.0f, 1.0f } };
+    uint32_t frames_in_flight{ 2 };
+    // Caps how many submitted frames may be queued ahead of the gpu,
+    // 0 leaves it to frames_in_flight.
+    uint32_t max_queued_frames{ 0 };
+    // Applied at swapchain (re)creation.
+    PresentPolicy present_policy{ ePowerSave };
+    std::array<float, QueueType::eMaxQueue> queue_priorities{ { 1.0f, 1.0f, 0.5f, 0.5f } };
+    VkDeviceSize frame_scratch_size{ 1 << 20 };
+    VkDeviceSize staging_size{ 8 << 20 };
+    // Per frame slot, 64k draws at the common 256 byte offset alignment.
+    VkDeviceSize uniform_size{ 16 << 20 };
+    // Job system workers for pipeline compiles, loading and parallel
+    // recording, 0 sizes it from the hardware.
+    uint32_t worker_count{ 0 };
+    // Binds every worker to its own core, leaving core 0 to the main thread.
+    bool pin_workers{ false };
+    // Timestamp queries around the frame and its passes.
+    bool gpu_profiling{ true };
+
     uint32_t queue_family_count{};
     std::unique_ptr<VkQueueFamilyProperties[]> queue_family_properties{};
     VkPhysicalDeviceProperties gpu_properties{};
     VkPhysicalDeviceMemoryProperties memory_properties{};
+    VkPhysicalDeviceFeatures enabled_features{};
     VkFormat surface_format{ VK_FORMAT_UNDEFINED };
     VkSurfaceCapabilitiesKHR surface_capabilities{};
     std::vector<VkPresentModeKHR> present_modes{};
     VkFormat depth_format{ VK_FORMAT_UNDEFINED };
+    std::string pipeline_cache_path{ "pipeline_cache.bin" };
+    // Pins the gpu by device name substring or device UUID, VULKANBRO_GPU
+    // in the environment takes precedence.
+    std::string gpu_override{};
 
 private:
     bool GetMemoryType(uint32_t typeBits, VkFlags mask, uint32_t &typeIndex);
@@ -76,35 +319,71 @@ private:
     void SetupDebugMessenger();
     void UninstallDebugMessenger();
 
+    std::vector<const char*> GetDeviceExtensions() const;
+    int64_t RateGpu(VkPhysicalDevice gpu) const;
     void GetGpuInfo();
 
     void CreateSurface();
     void DestroySurface();
+    void SelectSurfaceQueue();
+    void SelectHeadlessQueue();
 
+    void SelectAsyncQueues();
     void CreateDevice();
     void DestroyDevice();
 
     void GetQueue();
 
+    VkPresentModeKHR SelectPresentMode() const;
     void CreateSwapchain();
     void DestroySwapchain();
+    void DestroySwapchainImageViews();
+    // Destroys the swapchains replaced by Resize() once the frames that may
+    // still be presenting from them have retired, or all of them.
+    void DestroyRetiredSwapchains(bool all);
+
+    void CreateHeadlessImages();
+    void DestroyHeadlessImages();
+
+    void SelectDepthFormat();
 
-    void CreateDepthImage();
-    void DestroyDepthImage();
+    void CreateFrames();
+    void DestroyFrames();
+    // Waits for the current slot and recycles its per-frame resources, once
+    // per frame. Anything recording into the slot calls it first.
+    void PrepareFrameSlot();
+    void ReleaseRetired(FrameSlot& frame);
+    VkCommandBuffer GetUploadCommandBuffer();
+    VkCommandBuffer GetSecondaryCommandBuffer(FrameSlot& frame);
+    void QueueFlush(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size);
+    void FlushPendingRanges();
 
-    void CreateSemaphore();
-    void DestroySemaphore();
+    void CreatePipelineCache();
+    void DestroyPipelineCache();
 };
 
+// Host-visible buffers stay mapped and are written in place; the caller must
+// not overwrite ranges an in-flight frame still reads. Device-local buffers
+// are filled through the engine's per-frame staging ring.
 class Buffer {
 public:
+    void Create(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memprop);
+    void Destroy();
+
+    void Update(const void* data, VkDeviceSize size, VkDeviceSize offset = 0);
 
+    VkBuffer GetHandle() const { return buffer_; }
+    VkDeviceSize GetSize() const { return size_; }
+    uint8_t* GetMapped() const { return allocation_.mapped; }
+    const Allocation& GetAllocation() const { return allocation_; }
 
 private:
-    VkDevice device_;
-    uint32_t size_{ 0 };
+    VkDevice device_{};
+    VkDeviceSize size_{ 0 };
     VkBufferUsageFlags usage_{ 0 };
     VkMemoryPropertyFlags memprop_{ 0 };
+    VkBuffer buffer_{};
+    Allocation allocation_{};
 };
 
 Window& GetWindow();
@@ -0,0 +1,127 @@
+#include "frame_pacer.h"
+#include "cpu_profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CPU_RELAX() _mm_pause()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
+
+void FramePacer::SetTargetRate(double hz) {
+    if (hz <= 0.0) {
+        SetMode(eUncapped);
+        return;
+    }
+    period_ = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / hz));
+    SetMode(eFixedRate);
+}
+
+void FramePacer::SetMode(Mode mode) {
+    mode_ = mode;
+    deadline_ = Clock::time_point{};
+}
+
+void FramePacer::Pace() {
+    PROFILE_SCOPE("Pace");
+    bool missed = false;
+    if (mode_ == eFixedRate) {
+        auto now = Clock::now();
+        if (deadline_ == Clock::time_point{}) {
+            deadline_ = now + period_;
+        }
+        missed = now > deadline_;
+        if (now > deadline_ + period_) {
+            // More than a whole frame late, skip ahead instead of rushing
+            // several short frames to catch up.
+            deadline_ = now;
+        } else {
+            WaitUntil(deadline_);
+        }
+        deadline_ += period_;
+    }
+
+    auto now = Clock::now();
+    if (last_frame_ != Clock::time_point{}) {
+        double frame_ms = std::chrono::duration<double, std::milli>(now - last_frame_).count();
+        if (mode_ != eFixedRate) {
+            missed = false;
+        }
+        Record(frame_ms, missed);
+    }
+    last_frame_ = now;
+}
+
+void FramePacer::WaitUntil(Clock::time_point deadline) {
+    using Ms = std::chrono::duration<double, std::milli>;
+
+    for (;;) {
+        double remaining = Ms(deadline - Clock::now()).count();
+        double estimate = sleep_mean_ms_ + std::sqrt(sleep_var_);
+        if (remaining <= estimate) break;
+
+        auto begin = Clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        double observed = Ms(Clock::now() - begin).count();
+
+        // Exponentially weighted mean and variance. The weight starts out as
+        // a plain average and settles at the last ~100 sleeps, so the
+        // estimate stays bounded and keeps adapting when the scheduler
+        // changes behaviour (power plans, timer resolution).
+        if (sleep_count_ < 100) ++sleep_count_;
+        double weight = 1.0 / sleep_count_;
+        double delta = observed - sleep_mean_ms_;
+        sleep_mean_ms_ += weight * delta;
+        sleep_var_ = (1.0 - weight) * (sleep_var_ + weight * delta * delta);
+    }
+
+    while (Clock::now() < deadline) {
+        CPU_RELAX();
+    }
+}
+
+void FramePacer::Record(double frame_ms, bool missed) {
+    if (history_.size() < kHistorySize) {
+        history_.push_back((float)frame_ms);
+    } else {
+        history_[history_next_] = (float)frame_ms;
+        history_next_ = (history_next_ + 1) % kHistorySize;
+    }
+    ++frames_;
+    if (missed) ++missed_;
+    total_ms_ += frame_ms;
+    max_ms_ = std::max(max_ms_, frame_ms);
+}
+
+FramePacer::Stats FramePacer::GetStats() const {
+    Stats stats{};
+    stats.frames = frames_;
+    stats.missed = missed_;
+    stats.max_ms = max_ms_;
+    if (frames_ == 0) return stats;
+
+    stats.mean_ms = total_ms_ / frames_;
+
+    std::vector<float> sorted = history_;
+    size_t index = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    stats.p99_ms = sorted[index];
+    return stats;
+}
+
+void FramePacer::ResetStats() {
+    history_.clear();
+    history_next_ = 0;
+    frames_ = 0;
+    missed_ = 0;
+    total_ms_ = 0.0;
+    max_ms_ = 0.0;
+    last_frame_ = Clock::time_point{};
+}
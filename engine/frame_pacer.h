@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Paces the main loop against absolute deadlines on a monotonic clock.
+// Waiting sleeps while the remaining time is comfortably above the observed
+// oversleep of the OS scheduler, then spins the last stretch.
+class FramePacer {
+public:
+    enum Mode : uint32_t {
+        eFixedRate,
+        // No waiting at all, run as fast as the gpu allows.
+        eUncapped,
+        // The present mode blocks (FIFO), the pacer only measures.
+        eDisplaySynced,
+    };
+
+    struct Stats {
+        uint64_t frames{ 0 };
+        uint64_t missed{ 0 };
+        double mean_ms{ 0.0 };
+        double p99_ms{ 0.0 };
+        double max_ms{ 0.0 };
+    };
+
+    void SetTargetRate(double hz);
+    void SetMode(Mode mode);
+    Mode GetMode() const { return mode_; }
+
+    // Marks the end of a frame: waits for its deadline in eFixedRate mode
+    // and records the frame-to-frame time.
+    void Pace();
+
+    Stats GetStats() const;
+    void ResetStats();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void WaitUntil(Clock::time_point deadline);
+    void Record(double frame_ms, bool missed);
+
+    Mode mode_{ eFixedRate };
+    Clock::duration period_{ std::chrono::nanoseconds(1000000000 / 60) };
+    Clock::time_point deadline_{};
+    Clock::time_point last_frame_{};
+
+    // Running estimate of how long a 1 ms sleep really takes.
+    double sleep_mean_ms_{ 1.0 };
+    double sleep_var_{ 0.0 };
+    uint64_t sleep_count_{ 0 };
+
+    // Frame times of the most recent frames, for percentiles.
+    static const size_t kHistorySize = 1024;
+    std::vector<float> history_{};
+    size_t history_next_{ 0 };
+    uint64_t frames_{ 0 };
+    uint64_t missed_{ 0 };
+    double total_ms_{ 0.0 };
+    double max_ms_{ 0.0 };
+};
@@ -0,0 +1,227 @@
+#include "gpu_profiler.h"
+#include "chrome_trace.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <cassert>
+
+void GpuProfiler::Create(VkDevice device, uint32_t queue_family, uint32_t timestamp_bits,
+	const VkPhysicalDeviceLimits& limits, uint32_t frame_count, uint32_t max_scopes) {
+	device_ = device;
+	supported_ = timestamp_bits > 0 && limits.timestampPeriod > 0.0f;
+	if (!supported_) return;
+
+	ns_per_tick_ = limits.timestampPeriod;
+	timestamp_mask_ = timestamp_bits >= 64 ? ~0ull : (1ull << timestamp_bits) - 1;
+	max_scopes_ = max_scopes;
+
+	VkQueryPoolCreateInfo queryInfo = {};
+	queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryInfo.queryCount = max_scopes_ * 2;
+	frames_.resize(frame_count);
+	for (auto& frame : frames_) {
+		auto res = vkCreateQueryPool(device_, &queryInfo, nullptr, &frame.pool);
+		assert(VK_SUCCESS == res);
+		frame.scopes.resize(max_scopes_);
+	}
+	// Value and availability per query.
+	results_.resize((size_t)max_scopes_ * 4);
+
+	queryInfo.queryCount = 1;
+	auto res = vkCreateQueryPool(device_, &queryInfo, nullptr, &calibration_queries_);
+	assert(VK_SUCCESS == res);
+
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = queue_family;
+	res = vkCreateCommandPool(device_, &poolInfo, nullptr, &calibration_pool_);
+	assert(VK_SUCCESS == res);
+
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = calibration_pool_;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	res = vkAllocateCommandBuffers(device_, &allocInfo, &calibration_command_buffer_);
+	assert(VK_SUCCESS == res);
+
+	VkFenceCreateInfo fenceInfo = {};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	res = vkCreateFence(device_, &fenceInfo, nullptr, &calibration_fence_);
+	assert(VK_SUCCESS == res);
+}
+
+void GpuProfiler::Destroy() {
+	if (!supported_) return;
+	for (auto& frame : frames_) {
+		vkDestroyQueryPool(device_, frame.pool, nullptr);
+	}
+	frames_.clear();
+	current_ = nullptr;
+	vkDestroyQueryPool(device_, calibration_queries_, nullptr);
+	vkDestroyCommandPool(device_, calibration_pool_, nullptr);
+	vkDestroyFence(device_, calibration_fence_, nullptr);
+	captured_.clear();
+	timings_.clear();
+}
+
+void GpuProfiler::BeginFrame(VkCommandBuffer command_buffer, uint32_t slot) {
+	if (!supported_) return;
+	FrameQueries& frame = frames_[slot];
+	Resolve(frame);
+
+	frame.scope_count = 0;
+	frame.capture = capturing_;
+	vkCmdResetQueryPool(command_buffer, frame.pool, 0, max_scopes_ * 2);
+	current_ = &frame;
+	depth_ = 0;
+}
+
+uint32_t GpuProfiler::BeginScope(VkCommandBuffer command_buffer, const char* name) {
+	assert(command_buffer != secondary_pass_);
+	if (!current_ || current_->scope_count == max_scopes_) return UINT32_MAX;
+	uint32_t index = current_->scope_count++;
+	Scope& scope = current_->scopes[index];
+	scope.name = name;
+	scope.depth = depth_++;
+	scope.ended = false;
+	scope.cpu_begin_ns = current_->capture ? ChromeTrace::Now() : 0;
+	vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, current_->pool, index * 2);
+	return index;
+}
+
+void GpuProfiler::EndScope(VkCommandBuffer command_buffer, uint32_t scope) {
+	assert(command_buffer != secondary_pass_);
+	if (!current_ || scope >= current_->scope_count) return;
+	vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, current_->pool, scope * 2 + 1);
+	Scope& entry = current_->scopes[scope];
+	entry.ended = true;
+	entry.cpu_end_ns = current_->capture ? ChromeTrace::Now() : 0;
+	depth_ = entry.depth;
+}
+
+void GpuProfiler::Resolve(FrameQueries& frame) {
+	if (frame.scope_count == 0) return;
+
+	// The slot's fence has been waited on, so this only ever comes back
+	// short when a scope was never ended and its query stayed unwritten.
+	uint32_t query_count = frame.scope_count * 2;
+	auto res = vkGetQueryPoolResults(device_, frame.pool, 0, query_count,
+		sizeof(uint64_t) * 2 * query_count, results_.data(), sizeof(uint64_t) * 2,
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if (res != VK_SUCCESS && res != VK_NOT_READY) return;
+
+	auto ticks = [&](uint32_t query) { return results_[query * 2]; };
+	auto complete = [&](uint32_t scope) {
+		return frame.scopes[scope].ended && results_[scope * 4 + 1] != 0 && results_[scope * 4 + 3] != 0;
+	};
+
+	// Scopes are written in the order they began, the first complete one
+	// marks the start of the frame.
+	uint32_t first = 0;
+	while (first < frame.scope_count && !complete(first)) ++first;
+	if (first == frame.scope_count) return;
+	uint64_t origin = ticks(first * 2);
+
+	timings_.clear();
+	frame_ms_ = 0.0;
+	for (uint32_t i = first; i < frame.scope_count; ++i) {
+		if (!complete(i)) continue;
+		const Scope& scope = frame.scopes[i];
+		uint64_t begin = ticks(i * 2);
+		uint64_t end = ticks(i * 2 + 1);
+
+		GpuTiming timing{};
+		timing.name = scope.name;
+		timing.depth = scope.depth;
+		timing.begin_ms = Ticks(origin, begin) * ns_per_tick_ * 1e-6;
+		timing.duration_ms = Ticks(begin, end) * ns_per_tick_ * 1e-6;
+		frame_ms_ = std::max(frame_ms_, timing.begin_ms + timing.duration_ms);
+		timings_.push_back(std::move(timing));
+
+		if (frame.capture) {
+			CapturedScope captured{};
+			captured.name = scope.name;
+			captured.gpu_begin_ns = calibration_ns_ + (int64_t)(Ticks(calibration_ticks_, begin) * ns_per_tick_);
+			captured.gpu_end_ns = calibration_ns_ + (int64_t)(Ticks(calibration_ticks_, end) * ns_per_tick_);
+			captured.cpu_begin_ns = scope.cpu_begin_ns;
+			captured.cpu_end_ns = scope.cpu_end_ns;
+			captured_.push_back(std::move(captured));
+		}
+	}
+}
+
+void GpuProfiler::Calibrate() {
+	// Each attempt writes a timestamp and waits for it. The first one also
+	// waits out the frames still queued, the shortest round trip gives the
+	// tightest bound on when the gpu wrote its timestamp.
+	int64_t best_round_trip = INT64_MAX;
+	for (uint32_t attempt = 0; attempt < 4; ++attempt) {
+		vkResetCommandPool(device_, calibration_pool_, 0);
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		auto res = vkBeginCommandBuffer(calibration_command_buffer_, &beginInfo);
+		assert(VK_SUCCESS == res);
+		vkCmdResetQueryPool(calibration_command_buffer_, calibration_queries_, 0, 1);
+		vkCmdWriteTimestamp(calibration_command_buffer_, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			calibration_queries_, 0);
+		res = vkEndCommandBuffer(calibration_command_buffer_);
+		assert(VK_SUCCESS == res);
+
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &calibration_command_buffer_;
+		vkResetFences(device_, 1, &calibration_fence_);
+		int64_t before = ChromeTrace::Now();
+		res = GetEngine().QueueSubmit(QueueType::eGraphics, 1, &submitInfo, calibration_fence_);
+		assert(VK_SUCCESS == res);
+		vkWaitForFences(device_, 1, &calibration_fence_, VK_TRUE, UINT64_MAX);
+		int64_t after = ChromeTrace::Now();
+
+		uint64_t ticks = 0;
+		res = vkGetQueryPoolResults(device_, calibration_queries_, 0, 1, sizeof(ticks), &ticks,
+			sizeof(ticks), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+		assert(VK_SUCCESS == res);
+		if (after - before < best_round_trip) {
+			best_round_trip = after - before;
+			calibration_ticks_ = ticks & timestamp_mask_;
+			calibration_ns_ = before + (after - before) / 2;
+		}
+	}
+}
+
+void GpuProfiler::StartCapture() {
+	if (!supported_) return;
+	Calibrate();
+	captured_.clear();
+	capturing_ = true;
+}
+
+void GpuProfiler::StopCapture() {
+	if (!capturing_) return;
+	// Frames still in flight were recorded while capturing. Collect them
+	// now, oldest first, instead of when their slots come around again.
+	GetEngine().WaitForFrames();
+	size_t newest = current_ ? current_ - frames_.data() : frames_.size() - 1;
+	for (size_t i = 1; i <= frames_.size(); ++i) {
+		FrameQueries& frame = frames_[(newest + i) % frames_.size()];
+		if (!frame.capture) continue;
+		Resolve(frame);
+		frame.scope_count = 0;
+	}
+	capturing_ = false;
+}
+
+void GpuProfiler::ExportTrace(ChromeTrace& trace) const {
+	if (captured_.empty()) return;
+	trace.SetTrackName(kGpuTrack, "GPU");
+	trace.SetTrackName(kRecordTrack, "GPU command recording");
+	for (const auto& scope : captured_) {
+		trace.AddEvent(scope.name.c_str(), kGpuTrack, scope.gpu_begin_ns, scope.gpu_end_ns - scope.gpu_begin_ns);
+		trace.AddEvent(scope.name.c_str(), kRecordTrack, scope.cpu_begin_ns, scope.cpu_end_ns - scope.cpu_begin_ns);
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+class ChromeTrace;
+
+struct GpuTiming {
+    std::string name{};
+    // Nesting level, 0 for outermost scopes.
+    uint32_t depth{ 0 };
+    // Relative to the first timestamp of the frame.
+    double begin_ms{ 0.0 };
+    double duration_ms{ 0.0 };
+};
+
+// Measures gpu time of named scopes with a pair of timestamp queries each.
+// Every frame slot owns a query pool that is read back when the slot comes
+// around again, after its fence was waited on, so results lag
+// frames_in_flight frames behind and reading them never stalls.
+class GpuProfiler {
+public:
+    // timestamp_bits comes from the queue family the frames are submitted
+    // to, 0 means it has no timestamps and every call turns into a no-op.
+    void Create(VkDevice device, uint32_t queue_family, uint32_t timestamp_bits,
+        const VkPhysicalDeviceLimits& limits, uint32_t frame_count, uint32_t max_scopes = 256);
+    void Destroy();
+
+    bool IsSupported() const { return supported_; }
+
+    // Resolves what the slot measured last time around and resets its
+    // queries. Record at the start of command_buffer, outside any render
+    // pass.
+    void BeginFrame(VkCommandBuffer command_buffer, uint32_t slot);
+
+    // Scopes nest and may span render passes but must end in the command
+    // buffer they began in. Returns UINT32_MAX once the slot is out of
+    // queries, EndScope() ignores it.
+    uint32_t BeginScope(VkCommandBuffer command_buffer, const char* name);
+    void EndScope(VkCommandBuffer command_buffer, uint32_t scope);
+    // The primary command buffer currently inside a render pass begun with
+    // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS, VK_NULL_HANDLE once it
+    // ended. Scopes on it assert, they belong in the secondaries.
+    void SetSecondaryPass(VkCommandBuffer command_buffer) { secondary_pass_ = command_buffer; }
+
+    // Scopes of the latest frame the gpu finished, in the order they began.
+    const std::vector<GpuTiming>& GetTimings() const { return timings_; }
+    // Span from the first to the last timestamp of that frame.
+    double GetFrameMs() const { return frame_ms_; }
+
+    // Keeps every scope of the frames recorded until StopCapture(), along
+    // with when its commands were recorded. Starting submits a few
+    // timestamps and waits on them to map gpu ticks onto the cpu clock,
+    // stopping waits for the frames still in flight and collects them.
+    // Call both between frames.
+    void StartCapture();
+    void StopCapture();
+    bool IsCapturing() const { return capturing_; }
+    // Adds the captured scopes to trace, gpu execution and cpu recording on
+    // tracks of their own.
+    void ExportTrace(ChromeTrace& trace) const;
+
+    static constexpr uint32_t kGpuTrack = 1000;
+    static constexpr uint32_t kRecordTrack = 1001;
+
+private:
+    struct Scope {
+        std::string name{};
+        uint32_t depth{ 0 };
+        bool ended{ false };
+        int64_t cpu_begin_ns{ 0 };
+        int64_t cpu_end_ns{ 0 };
+    };
+
+    struct FrameQueries {
+        VkQueryPool pool{};
+        // Scope i owns queries 2 * i and 2 * i + 1.
+        std::vector<Scope> scopes{};
+        uint32_t scope_count{ 0 };
+        // Recorded while capturing, only those frames are kept and their
+        // ticks are known to come after the calibration.
+        bool capture{ false };
+    };
+
+    struct CapturedScope {
+        std::string name{};
+        int64_t gpu_begin_ns{ 0 };
+        int64_t gpu_end_ns{ 0 };
+        int64_t cpu_begin_ns{ 0 };
+        int64_t cpu_end_ns{ 0 };
+    };
+
+    void Resolve(FrameQueries& frame);
+    void Calibrate();
+    // Tick difference that survives the counter wrapping.
+    uint64_t Ticks(uint64_t from, uint64_t to) const { return (to - from) & timestamp_mask_; }
+
+    VkDevice device_{};
+    bool supported_{ false };
+    double ns_per_tick_{ 1.0 };
+    uint64_t timestamp_mask_{ ~0ull };
+    uint32_t max_scopes_{ 0 };
+    std::vector<FrameQueries> frames_{};
+    FrameQueries* current_{ nullptr };
+    VkCommandBuffer secondary_pass_{};
+    uint32_t depth_{ 0 };
+    std::vector<uint64_t> results_{};
+
+    std::vector<GpuTiming> timings_{};
+    double frame_ms_{ 0.0 };
+
+    // Calibration: a one-query pool timestamped from its own command buffer.
+    VkCommandPool calibration_pool_{};
+    VkCommandBuffer calibration_command_buffer_{};
+    VkQueryPool calibration_queries_{};
+    VkFence calibration_fence_{};
+    uint64_t calibration_ticks_{ 0 };
+    int64_t calibration_ns_{ 0 };
+
+    bool capturing_{ false };
+    std::vector<CapturedScope> captured_{};
+};
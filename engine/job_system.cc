@@ -0,0 +1,303 @@
+#include "job_system.h"
+#include "cpu_profiler.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CPU_RELAX() _mm_pause()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
+
+static thread_local uint32_t thread_index = 0;
+
+// Failed searches before an idle thread goes to sleep. Short enough that an
+// idle worker gives its core back within microseconds.
+static const uint32_t kSpinCount = 64;
+
+static void PinThread(std::thread& thread, uint32_t core) {
+#if defined(_WIN32)
+	SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << (core % (sizeof(DWORD_PTR) * 8)));
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % CPU_SETSIZE, &set);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+	(void)thread;
+	(void)core;
+#endif
+}
+
+bool JobSystem::WorkQueue::Push(Job* job) {
+	int64_t bottom = bottom_.load(std::memory_order_relaxed);
+	int64_t top = top_.load(std::memory_order_acquire);
+	if (bottom - top >= kCapacity) return false;
+	jobs_[bottom & (kCapacity - 1)].store(job, std::memory_order_relaxed);
+	bottom_.store(bottom + 1, std::memory_order_release);
+	return true;
+}
+
+JobSystem::Job* JobSystem::WorkQueue::Pop() {
+	int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+	bottom_.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t top = top_.load(std::memory_order_relaxed);
+
+	if (top > bottom) {
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	Job* job = jobs_[bottom & (kCapacity - 1)].load(std::memory_order_relaxed);
+	if (top == bottom) {
+		// Last job, race the thieves for it.
+		if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			job = nullptr;
+		}
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return job;
+}
+
+JobSystem::Job* JobSystem::WorkQueue::Steal() {
+	int64_t top = top_.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t bottom = bottom_.load(std::memory_order_acquire);
+	if (top >= bottom) return nullptr;
+
+	Job* job = jobs_[top & (kCapacity - 1)].load(std::memory_order_relaxed);
+	if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		return nullptr;
+	}
+	return job;
+}
+
+void JobSystem::Create(uint32_t thread_count, bool pin_threads) {
+	if (thread_count == 0) {
+		thread_count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+		thread_count = std::max(1u, thread_count);
+	}
+	stopping_ = false;
+	workers_.clear();
+	for (uint32_t i = 0; i <= thread_count; ++i) {
+		workers_.push_back(std::make_unique<Worker>());
+	}
+	for (uint32_t i = 1; i <= thread_count; ++i) {
+		threads_.emplace_back(&JobSystem::WorkerLoop, this, i);
+		if (pin_threads) PinThread(threads_.back(), i);
+	}
+}
+
+void JobSystem::Destroy() {
+	stopping_ = true;
+	WakeWorkers(true);
+	for (auto& thread : threads_) {
+		thread.join();
+	}
+	threads_.clear();
+
+	// Workers drain their own queues before leaving, only jobs injected
+	// late can be left.
+	while (Job* job = FindJob(0)) {
+		Execute(0, job);
+	}
+	workers_.clear();
+}
+
+uint32_t JobSystem::GetThreadIndex() {
+	return thread_index;
+}
+
+JobStats JobSystem::GetStats() const {
+	JobStats stats{};
+	for (const auto& worker : workers_) {
+		stats.executed += worker->executed.load(std::memory_order_relaxed);
+		stats.stolen += worker->stolen.load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+void JobSystem::Run(std::function<void()> job, JobCounter* counter, JobCounter* dependency) {
+	Job* entry = new Job{ std::move(job), counter };
+	if (counter && counter->pending_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+		counter->done_.store(false, std::memory_order_release);
+	}
+	if (dependency) {
+		std::lock_guard<std::mutex> lock{ dependency->mutex_ };
+		if (dependency->pending_.load(std::memory_order_acquire) != 0) {
+			dependency->dependents_.push_back(entry);
+			return;
+		}
+	}
+	Push(entry);
+}
+
+void JobSystem::Push(Job* job) {
+	uint32_t index = thread_index;
+	if (index == 0 || index >= workers_.size() || !workers_[index]->queue.Push(job)) {
+		std::lock_guard<std::mutex> lock{ injection_mutex_ };
+		injection_.push_back(job);
+		injection_size_.fetch_add(1, std::memory_order_release);
+	}
+	epoch_.fetch_add(1);
+	WakeWorkers(false);
+}
+
+JobSystem::Job* JobSystem::FindJob(uint32_t index) {
+	if (index != 0) {
+		if (Job* job = workers_[index]->queue.Pop()) return job;
+	}
+
+	if (injection_size_.load(std::memory_order_acquire) != 0) {
+		std::lock_guard<std::mutex> lock{ injection_mutex_ };
+		if (!injection_.empty()) {
+			Job* job = injection_.front();
+			injection_.pop_front();
+			injection_size_.fetch_sub(1, std::memory_order_relaxed);
+			return job;
+		}
+	}
+
+	// Start at a random victim so thieves spread out instead of all
+	// hammering the first worker.
+	uint32_t victims = (uint32_t)workers_.size() - 1;
+	if (victims == 0) return nullptr;
+	static thread_local uint32_t rng = 0x9E3779B9u;
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	for (uint32_t i = 0; i < victims; ++i) {
+		uint32_t victim = 1 + (rng + i) % victims;
+		if (victim == index) continue;
+		if (Job* job = workers_[victim]->queue.Steal()) {
+			workers_[index]->stolen.fetch_add(1, std::memory_order_relaxed);
+			return job;
+		}
+	}
+	return nullptr;
+}
+
+void JobSystem::Execute(uint32_t index, Job* job) {
+	job->func();
+	workers_[index]->executed.fetch_add(1, std::memory_order_relaxed);
+	JobCounter* counter = job->counter;
+	delete job;
+	if (counter) Finish(counter);
+}
+
+void JobSystem::Finish(JobCounter* counter) {
+	if (counter->pending_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+	std::vector<void*> dependents{};
+	{
+		std::lock_guard<std::mutex> lock{ counter->mutex_ };
+		dependents.swap(counter->dependents_);
+	}
+	// Last touch of the counter, a waiter may free it from here on.
+	counter->done_.store(true, std::memory_order_release);
+
+	for (void* dependent : dependents) {
+		Push(static_cast<Job*>(dependent));
+	}
+	epoch_.fetch_add(1);
+	WakeWorkers(true);
+}
+
+void JobSystem::WakeWorkers(bool all) {
+	if (sleeping_.load() == 0) return;
+	std::lock_guard<std::mutex> lock{ sleep_mutex_ };
+	if (all) wake_.notify_all();
+	else wake_.notify_one();
+}
+
+void JobSystem::Sleep(uint64_t epoch, const std::function<bool()>& done) {
+	std::unique_lock<std::mutex> lock{ sleep_mutex_ };
+	sleeping_.fetch_add(1);
+	wake_.wait(lock, [&] { return epoch_.load() != epoch || done(); });
+	sleeping_.fetch_sub(1);
+}
+
+void JobSystem::Wait(JobCounter& counter) {
+	uint32_t index = thread_index < workers_.size() ? thread_index : 0;
+	uint32_t idle = 0;
+	while (!counter.IsDone()) {
+		uint64_t epoch = epoch_.load();
+		if (Job* job = FindJob(index)) {
+			Execute(index, job);
+			idle = 0;
+			continue;
+		}
+		if (++idle < kSpinCount) {
+			CPU_RELAX();
+			continue;
+		}
+		idle = 0;
+		Sleep(epoch, [&] { return counter.IsDone(); });
+	}
+}
+
+void JobSystem::ParallelFor(uint32_t count, const std::function<void(uint32_t)>& func) {
+	struct State {
+		std::atomic<uint32_t> next{ 0 };
+		std::atomic<uint32_t> done{ 0 };
+	};
+	if (count == 0) return;
+
+	// Helpers that start after the last index was claimed only touch the
+	// shared state, which they keep alive. The caller does not wait for
+	// them to start, so it never ends up running unrelated jobs here.
+	auto state = std::make_shared<State>();
+	auto run = [state, count, &func] {
+		for (;;) {
+			uint32_t index = state->next.fetch_add(1);
+			if (index >= count) return;
+			func(index);
+			state->done.fetch_add(1, std::memory_order_release);
+		}
+	};
+
+	uint32_t helpers = std::min(count - 1, GetThreadCount());
+	for (uint32_t i = 0; i < helpers; ++i) {
+		Run(run);
+	}
+	run();
+
+	// Only indices already running elsewhere are left.
+	while (state->done.load(std::memory_order_acquire) != count) {
+		std::this_thread::yield();
+	}
+}
+
+void JobSystem::WorkerLoop(uint32_t index) {
+	thread_index = index;
+	PROFILE_THREAD("Job worker");
+	uint32_t idle = 0;
+	for (;;) {
+		uint64_t epoch = epoch_.load();
+		if (Job* job = FindJob(index)) {
+			Execute(index, job);
+			idle = 0;
+			continue;
+		}
+		if (stopping_.load()) return;
+		if (++idle < kSpinCount) {
+			CPU_RELAX();
+			continue;
+		}
+		idle = 0;
+		Sleep(epoch, [this] { return stopping_.load(); });
+	}
+}
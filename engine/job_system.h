@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobSystem;
+
+// Tracks a group of jobs. Each Run() against the counter adds one, each
+// finished job takes one off. A counter may be reused once Wait() on it has
+// returned, and must outlive every job that signals it or depends on it.
+class JobCounter {
+public:
+    bool IsDone() const { return done_.load(std::memory_order_acquire); }
+
+private:
+    friend class JobSystem;
+
+    std::atomic<uint32_t> pending_{ 0 };
+    // Set by the last finishing job as its final access to the counter, so
+    // a waiter that sees it may destroy the counter right away.
+    std::atomic<bool> done_{ true };
+    std::mutex mutex_{};
+    std::vector<void*> dependents_{};
+};
+
+struct JobStats {
+    uint64_t executed{ 0 };
+    uint64_t stolen{ 0 };
+};
+
+// Work-stealing scheduler. Every worker owns a Chase-Lev deque: it pushes
+// and pops its own jobs at the bottom without locks while idle workers
+// steal from the top. Jobs run from other threads go through a shared
+// injection queue. Threads that Wait() run jobs instead of blocking, so
+// jobs may spawn and wait on other jobs freely.
+class JobSystem {
+public:
+    // 0 picks one thread less than the hardware has, at least one. Pinning
+    // binds worker i to core i, core 0 is left to the main thread.
+    void Create(uint32_t thread_count = 0, bool pin_threads = false);
+    // Runs every job still queued before joining.
+    void Destroy();
+
+    // Schedules job. counter, if any, counts it as pending until it has
+    // run. With a dependency the job is held back until that counter is
+    // done.
+    void Run(std::function<void()> job, JobCounter* counter = nullptr, JobCounter* dependency = nullptr);
+    // Runs queued jobs on the calling thread until counter is done.
+    void Wait(JobCounter& counter);
+
+    // Runs func for every index in [0, count) and returns once all calls
+    // are done. Indices are handed out one at a time, so uneven work
+    // balances out. The caller takes part, so this is safe from inside a
+    // job.
+    void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& func);
+
+    uint32_t GetThreadCount() const { return (uint32_t)threads_.size(); }
+    // 1 to GetThreadCount() on the workers, 0 on any other thread. Lets
+    // callers keep per-thread state in a plain array.
+    static uint32_t GetThreadIndex();
+
+    JobStats GetStats() const;
+
+private:
+    struct Job {
+        std::function<void()> func{};
+        JobCounter* counter{ nullptr };
+    };
+
+    // Fixed-size Chase-Lev deque, after Le et al., "Correct and Efficient
+    // Work-Stealing for Weak Memory Models". Push fails when it is full and
+    // the job goes to the injection queue instead.
+    class WorkQueue {
+    public:
+        bool Push(Job* job);
+        Job* Pop();
+        Job* Steal();
+
+    private:
+        static constexpr int64_t kCapacity = 4096;
+
+        alignas(64) std::atomic<int64_t> top_{ 0 };
+        alignas(64) std::atomic<int64_t> bottom_{ 0 };
+        std::atomic<Job*> jobs_[kCapacity]{};
+    };
+
+    struct Worker {
+        WorkQueue queue{};
+        std::atomic<uint64_t> executed{ 0 };
+        std::atomic<uint64_t> stolen{ 0 };
+    };
+
+    void WorkerLoop(uint32_t index);
+    void Push(Job* job);
+    Job* FindJob(uint32_t index);
+    void Execute(uint32_t index, Job* job);
+    void Finish(JobCounter* counter);
+    void WakeWorkers(bool all);
+    // Sleeps until new work arrives or done returns true.
+    void Sleep(uint64_t epoch, const std::function<bool()>& done);
+
+    std::vector<std::thread> threads_{};
+    // Index 0 holds the stats of non-worker threads, its queue stays empty.
+    std::vector<std::unique_ptr<Worker>> workers_{};
+
+    std::mutex injection_mutex_{};
+    std::deque<Job*> injection_{};
+    std::atomic<uint32_t> injection_size_{ 0 };
+
+    // Bumped whenever a job is queued or a counter completes, sleepers
+    // compare it against what they saw before looking for work.
+    std::atomic<uint64_t> epoch_{ 0 };
+    std::atomic<uint32_t> sleeping_{ 0 };
+    std::mutex sleep_mutex_{};
+    std::condition_variable wake_{};
+    std::atomic<bool> stopping_{ false };
+};
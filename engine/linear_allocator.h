@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+// Bump allocator over an abstract range [0, capacity). It only hands out
+// offsets, so the same logic carves cpu scratch memory and sub-ranges of
+// gpu buffers. Everything is released at once by Reset().
+class LinearAllocator {
+public:
+    static const uint64_t kInvalidOffset = UINT64_MAX;
+
+    void Init(uint64_t capacity) {
+        capacity_ = capacity;
+        offset_ = 0;
+    }
+
+    // alignment must be a power of two.
+    uint64_t Allocate(uint64_t size, uint64_t alignment = 1) {
+        uint64_t begin = (offset_ + alignment - 1) & ~(alignment - 1);
+        if (begin + size > capacity_) return kInvalidOffset;
+        offset_ = begin + size;
+        return begin;
+    }
+
+    void Reset() { offset_ = 0; }
+
+    uint64_t GetUsed() const { return offset_; }
+    uint64_t GetCapacity() const { return capacity_; }
+
+private:
+    uint64_t capacity_{ 0 };
+    uint64_t offset_{ 0 };
+};
@@ -0,0 +1,102 @@
+#include "mapped_file.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+	if (this != &other) {
+		Close();
+		std::swap(data_, other.data_);
+		std::swap(size_, other.size_);
+#ifdef _WIN32
+		std::swap(file_, other.file_);
+		std::swap(mapping_, other.mapping_);
+#endif
+	}
+	return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const char* path) {
+	Close();
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_ = file;
+	mapping_ = mapping;
+	data_ = (const uint8_t*)data;
+	size_ = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (data_) UnmapViewOfFile(data_);
+	if (mapping_) CloseHandle((HANDLE)mapping_);
+	if (file_) CloseHandle((HANDLE)file_);
+	data_ = nullptr;
+	size_ = 0;
+	mapping_ = nullptr;
+	file_ = nullptr;
+}
+
+#else
+
+bool MappedFile::Open(const char* path) {
+	Close();
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file referenced on its own.
+	close(fd);
+	if (data == MAP_FAILED) return false;
+
+	data_ = (const uint8_t*)data;
+	size_ = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (data_) munmap((void*)data_, size_);
+	data_ = nullptr;
+	size_ = 0;
+}
+
+#endif
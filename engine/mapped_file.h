@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Read-only view of a whole file. The mapping is page aligned, so the data
+// can be handed to APIs that want aligned words without a copy.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    bool Open(const char* path);
+    void Close();
+
+    bool IsOpen() const { return data_ != nullptr; }
+    const uint8_t* GetData() const { return data_; }
+    size_t GetSize() const { return size_; }
+
+private:
+    const uint8_t* data_{ nullptr };
+    size_t size_{ 0 };
+#ifdef _WIN32
+    void* file_{ nullptr };
+    void* mapping_{ nullptr };
+#endif
+};
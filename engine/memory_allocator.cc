@@ -0,0 +1,277 @@
+#include "memory_allocator.h"
+
+#include <algorithm>
+#include <cassert>
+
+bool FindMemoryType(const VkPhysicalDeviceMemoryProperties& props, uint32_t typeBits,
+	VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, uint32_t& typeIndex) {
+	const VkMemoryPropertyFlags masks[2] = { required | preferred, required };
+	for (VkMemoryPropertyFlags mask : masks) {
+		for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+			if ((typeBits & (1u << i)) == 0) continue;
+			if ((props.memoryTypes[i].propertyFlags & mask) == mask) {
+				typeIndex = i;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static uint32_t Log2(VkDeviceSize value) {
+	uint32_t result = 0;
+	while (value > 1) {
+		value >>= 1;
+		++result;
+	}
+	return result;
+}
+
+static VkDeviceSize NextPowerOfTwo(VkDeviceSize value) {
+	VkDeviceSize result = 1;
+	while (result < value) result <<= 1;
+	return result;
+}
+
+void MemoryAllocator::Create(VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties,
+	const VkPhysicalDeviceLimits& limits) {
+	device_ = device;
+	memory_properties_ = memory_properties;
+	non_coherent_atom_size_ = std::max<VkDeviceSize>(limits.nonCoherentAtomSize, 1);
+	block_size = NextPowerOfTwo(std::max(block_size, kMinRangeSize));
+
+	pools_.resize(memory_properties_.memoryTypeCount * eMaxAllocationKind);
+	for (uint32_t i = 0; i < pools_.size(); ++i) {
+		pools_[i].memory_type = i / eMaxAllocationKind;
+	}
+}
+
+void MemoryAllocator::Destroy() {
+	for (auto& pool : pools_) {
+		for (auto& block : pool.blocks) {
+			if (!block) continue;
+			assert(block->allocation_count == 0);
+			vkFreeMemory(device_, block->memory, nullptr);
+		}
+	}
+	pools_.clear();
+	assert(dedicated_count_ == 0);
+}
+
+uint32_t MemoryAllocator::GetMaxOrder() const {
+	return Log2(block_size) - Log2(kMinRangeSize);
+}
+
+bool MemoryAllocator::IsCoherent(const Allocation& allocation) const {
+	return (memory_properties_.memoryTypes[allocation.memory_type].propertyFlags &
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+}
+
+bool MemoryAllocator::Allocate(const VkMemoryRequirements& reqs, const AllocationInfo& info, Allocation& allocation) {
+	uint32_t memory_type;
+	if (!FindMemoryType(memory_properties_, reqs.memoryTypeBits, info.required, info.preferred, memory_type)) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	// Anything above half a block would waste most of it to rounding.
+	VkDeviceSize range = NextPowerOfTwo(std::max({ reqs.size, reqs.alignment, kMinRangeSize }));
+	if (info.dedicated || range > block_size / 2) {
+		return AllocateDedicated(reqs, memory_type, allocation);
+	}
+
+	uint32_t pool_index = memory_type * eMaxAllocationKind + info.kind;
+	if (!AllocateFromPool(pool_index, Log2(range) - Log2(kMinRangeSize), allocation)) {
+		return false;
+	}
+	allocation.size = reqs.size;
+	requested_bytes_ += reqs.size;
+	return true;
+}
+
+bool MemoryAllocator::AllocateDedicated(const VkMemoryRequirements& reqs, uint32_t memory_type, Allocation& allocation) {
+	VkMemoryAllocateInfo memAlloc = {};
+	memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	memAlloc.allocationSize = reqs.size;
+	memAlloc.memoryTypeIndex = memory_type;
+
+	allocation = Allocation{};
+	if (vkAllocateMemory(device_, &memAlloc, nullptr, &allocation.memory) != VK_SUCCESS) {
+		return false;
+	}
+	if (memory_properties_.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		void* data = nullptr;
+		auto res = vkMapMemory(device_, allocation.memory, 0, VK_WHOLE_SIZE, 0, &data);
+		assert(VK_SUCCESS == res);
+		allocation.mapped = (uint8_t*)data;
+	}
+	allocation.size = reqs.size;
+	allocation.memory_type = memory_type;
+	++dedicated_count_;
+	dedicated_bytes_ += reqs.size;
+	return true;
+}
+
+MemoryAllocator::Block* MemoryAllocator::CreateBlock(Pool& pool) {
+	VkMemoryAllocateInfo memAlloc = {};
+	memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	memAlloc.allocationSize = block_size;
+	memAlloc.memoryTypeIndex = pool.memory_type;
+
+	auto block = std::make_unique<Block>();
+	if (vkAllocateMemory(device_, &memAlloc, nullptr, &block->memory) != VK_SUCCESS) {
+		return nullptr;
+	}
+	if (memory_properties_.memoryTypes[pool.memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		void* data = nullptr;
+		auto res = vkMapMemory(device_, block->memory, 0, VK_WHOLE_SIZE, 0, &data);
+		assert(VK_SUCCESS == res);
+		block->mapped = (uint8_t*)data;
+	}
+	block->free_lists.resize(GetMaxOrder() + 1);
+	block->free_lists[GetMaxOrder()].insert(0);
+
+	for (auto& slot : pool.blocks) {
+		if (!slot) {
+			slot = std::move(block);
+			return slot.get();
+		}
+	}
+	pool.blocks.push_back(std::move(block));
+	return pool.blocks.back().get();
+}
+
+bool MemoryAllocator::AllocateFromPool(uint32_t pool_index, uint32_t order, Allocation& allocation) {
+	Pool& pool = pools_[pool_index];
+	const uint32_t max_order = GetMaxOrder();
+
+	for (uint32_t pass = 0; pass < 2; ++pass) {
+		for (uint32_t b = 0; b < pool.blocks.size(); ++b) {
+			Block* block = pool.blocks[b].get();
+			if (!block) continue;
+
+			// Smallest free range that fits, split down to the wanted order.
+			uint32_t found = order;
+			while (found <= max_order && block->free_lists[found].empty()) ++found;
+			if (found > max_order) continue;
+
+			VkDeviceSize offset = *block->free_lists[found].begin();
+			block->free_lists[found].erase(block->free_lists[found].begin());
+			while (found > order) {
+				--found;
+				block->free_lists[found].insert(offset + (kMinRangeSize << found));
+			}
+
+			++block->allocation_count;
+			allocation = Allocation{};
+			allocation.memory = block->memory;
+			allocation.offset = offset;
+			allocation.mapped = block->mapped ? block->mapped + offset : nullptr;
+			allocation.memory_type = pool.memory_type;
+			allocation.pool = pool_index;
+			allocation.block = b;
+			allocation.order = order;
+			return true;
+		}
+		if (pass == 0 && !CreateBlock(pool)) return false;
+	}
+	return false;
+}
+
+void MemoryAllocator::Free(Allocation& allocation) {
+	if (allocation.memory == VK_NULL_HANDLE) return;
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	if (allocation.IsDedicated()) {
+		vkFreeMemory(device_, allocation.memory, nullptr);
+		--dedicated_count_;
+		dedicated_bytes_ -= allocation.size;
+		allocation = Allocation{};
+		return;
+	}
+
+	Pool& pool = pools_[allocation.pool];
+	Block* block = pool.blocks[allocation.block].get();
+	const uint32_t max_order = GetMaxOrder();
+
+	// Merge with the buddy for as long as it is free too.
+	VkDeviceSize offset = allocation.offset;
+	uint32_t order = allocation.order;
+	while (order < max_order) {
+		VkDeviceSize buddy = offset ^ (kMinRangeSize << order);
+		auto it = block->free_lists[order].find(buddy);
+		if (it == block->free_lists[order].end()) break;
+		block->free_lists[order].erase(it);
+		offset = std::min(offset, buddy);
+		++order;
+	}
+	block->free_lists[order].insert(offset);
+
+	requested_bytes_ -= allocation.size;
+	--block->allocation_count;
+
+	// Give empty blocks back, but keep one per pool around to avoid
+	// thrashing vkAllocateMemory when a pool hovers around a block boundary.
+	if (block->allocation_count == 0) {
+		uint32_t live = 0;
+		for (const auto& other : pool.blocks) {
+			if (other) ++live;
+		}
+		if (live > 1) {
+			vkFreeMemory(device_, block->memory, nullptr);
+			pool.blocks[allocation.block].reset();
+		}
+	}
+	allocation = Allocation{};
+}
+
+bool MemoryAllocator::AllocateForBuffer(VkBuffer buffer, const AllocationInfo& info, Allocation& allocation) {
+	VkMemoryRequirements reqs;
+	vkGetBufferMemoryRequirements(device_, buffer, &reqs);
+	if (!Allocate(reqs, info, allocation)) return false;
+	auto res = vkBindBufferMemory(device_, buffer, allocation.memory, allocation.offset);
+	assert(VK_SUCCESS == res);
+	return true;
+}
+
+bool MemoryAllocator::AllocateForImage(VkImage image, const AllocationInfo& info, Allocation& allocation) {
+	VkMemoryRequirements reqs;
+	vkGetImageMemoryRequirements(device_, image, &reqs);
+	if (!Allocate(reqs, info, allocation)) return false;
+	auto res = vkBindImageMemory(device_, image, allocation.memory, allocation.offset);
+	assert(VK_SUCCESS == res);
+	return true;
+}
+
+MemoryStats MemoryAllocator::GetStats() const {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	MemoryStats stats{};
+	stats.dedicated_count = dedicated_count_;
+	stats.dedicated_bytes = dedicated_bytes_;
+	stats.requested_bytes = requested_bytes_;
+	stats.allocation_count = dedicated_count_;
+
+	VkDeviceSize free_bytes = 0;
+	for (const auto& pool : pools_) {
+		for (const auto& block : pool.blocks) {
+			if (!block) continue;
+			++stats.block_count;
+			stats.reserved_bytes += block_size;
+			stats.allocation_count += block->allocation_count;
+			for (uint32_t order = 0; order < block->free_lists.size(); ++order) {
+				const auto& list = block->free_lists[order];
+				if (list.empty()) continue;
+				VkDeviceSize range = kMinRangeSize << order;
+				free_bytes += range * list.size();
+				stats.largest_free_bytes = std::max(stats.largest_free_bytes, range);
+			}
+		}
+	}
+	stats.allocated_bytes = stats.reserved_bytes - free_bytes;
+	if (free_bytes > 0) {
+		stats.fragmentation = 1.0f - (float)((double)stats.largest_free_bytes / (double)free_bytes);
+	}
+	return stats;
+}
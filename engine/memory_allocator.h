@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Picks a memory type that has all required flags, trying required|preferred
+// first.
+bool FindMemoryType(const VkPhysicalDeviceMemoryProperties& props, uint32_t typeBits,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, uint32_t& typeIndex);
+
+// Buffers and linear images never share a block with optimal images, which
+// keeps bufferImageGranularity out of the sub-allocation math.
+enum AllocationKind : uint32_t {
+    eLinearResource,
+    eOptimalImage,
+    eMaxAllocationKind,
+};
+
+struct AllocationInfo {
+    VkMemoryPropertyFlags required{ VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT };
+    VkMemoryPropertyFlags preferred{ 0 };
+    AllocationKind kind{ eLinearResource };
+    // Forces a VkDeviceMemory of its own, used for large attachments.
+    bool dedicated{ false };
+};
+
+struct Allocation {
+    VkDeviceMemory memory{};
+    VkDeviceSize offset{ 0 };
+    VkDeviceSize size{ 0 };
+    // Host-visible blocks stay mapped for their whole lifetime.
+    uint8_t* mapped{ nullptr };
+    uint32_t memory_type{ UINT32_MAX };
+    uint32_t pool{ UINT32_MAX };
+    uint32_t block{ UINT32_MAX };
+    uint32_t order{ 0 };
+
+    bool IsDedicated() const { return block == UINT32_MAX; }
+};
+
+struct MemoryStats {
+    uint32_t block_count{ 0 };
+    uint32_t dedicated_count{ 0 };
+    uint32_t allocation_count{ 0 };
+    VkDeviceSize reserved_bytes{ 0 };
+    VkDeviceSize allocated_bytes{ 0 };
+    VkDeviceSize requested_bytes{ 0 };
+    VkDeviceSize dedicated_bytes{ 0 };
+    VkDeviceSize largest_free_bytes{ 0 };
+    // 1 - largest free range / total free bytes, 0 when all free memory is
+    // one contiguous range.
+    float fragmentation{ 0.0f };
+};
+
+// Grabs large blocks per memory type and sub-allocates them with a buddy
+// scheme, so thousands of resources cost a handful of vkAllocateMemory calls.
+// Buddy ranges are aligned to their own size, which covers every alignment
+// up to the block size.
+class MemoryAllocator {
+public:
+    void Create(VkDevice device, const VkPhysicalDeviceMemoryProperties& memory_properties,
+        const VkPhysicalDeviceLimits& limits);
+    void Destroy();
+
+    bool Allocate(const VkMemoryRequirements& reqs, const AllocationInfo& info, Allocation& allocation);
+    void Free(Allocation& allocation);
+
+    // Allocate and bind in one go.
+    bool AllocateForBuffer(VkBuffer buffer, const AllocationInfo& info, Allocation& allocation);
+    bool AllocateForImage(VkImage image, const AllocationInfo& info, Allocation& allocation);
+
+    const VkPhysicalDeviceMemoryProperties& GetMemoryProperties() const { return memory_properties_; }
+    VkDeviceSize GetNonCoherentAtomSize() const { return non_coherent_atom_size_; }
+    bool IsCoherent(const Allocation& allocation) const;
+
+    MemoryStats GetStats() const;
+
+    VkDeviceSize block_size{ 64ull << 20 };
+
+private:
+    static constexpr VkDeviceSize kMinRangeSize = 256;
+
+    struct Block {
+        VkDeviceMemory memory{};
+        uint8_t* mapped{ nullptr };
+        // Free range offsets per order, order 0 is kMinRangeSize.
+        std::vector<std::set<VkDeviceSize>> free_lists{};
+        uint32_t allocation_count{ 0 };
+    };
+
+    struct Pool {
+        uint32_t memory_type{ 0 };
+        std::vector<std::unique_ptr<Block>> blocks{};
+    };
+
+    bool AllocateDedicated(const VkMemoryRequirements& reqs, uint32_t memory_type, Allocation& allocation);
+    bool AllocateFromPool(uint32_t pool_index, uint32_t order, Allocation& allocation);
+    Block* CreateBlock(Pool& pool);
+    uint32_t GetMaxOrder() const;
+
+    VkDevice device_{};
+    VkPhysicalDeviceMemoryProperties memory_properties_{};
+    VkDeviceSize non_coherent_atom_size_{ 1 };
+    std::vector<Pool> pools_{};
+    mutable std::mutex mutex_{};
+
+    uint32_t dedicated_count_{ 0 };
+    VkDeviceSize dedicated_bytes_{ 0 };
+    VkDeviceSize requested_bytes_{ 0 };
+};
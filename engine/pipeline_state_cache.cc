@@ -0,0 +1,314 @@
+#include "pipeline_state_cache.h"
+#include "cpu_profiler.h"
+#include "job_system.h"
+
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+
+template<typename T>
+static void Append(std::string& bytes, const T& value) {
+	bytes.append((const char*)&value, sizeof(T));
+}
+
+// Short, stable name for a key in logs.
+static uint64_t HashKey(const std::string& key) {
+	uint64_t hash = 14695981039346656037ull;
+	for (char c : key) {
+		hash ^= (uint8_t)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::string PipelineStateCache::Serialize(const PipelineState& state) {
+	// Field by field, struct padding must not end up in the key.
+	std::string bytes;
+	bytes.reserve(256);
+	Append(bytes, state.vertex_shader);
+	Append(bytes, state.fragment_shader);
+	Append(bytes, (uint32_t)state.vertex_bindings.size());
+	for (const auto& binding : state.vertex_bindings) {
+		Append(bytes, binding.binding);
+		Append(bytes, binding.stride);
+		Append(bytes, binding.inputRate);
+	}
+	Append(bytes, (uint32_t)state.vertex_attributes.size());
+	for (const auto& attribute : state.vertex_attributes) {
+		Append(bytes, attribute.location);
+		Append(bytes, attribute.binding);
+		Append(bytes, attribute.format);
+		Append(bytes, attribute.offset);
+	}
+	Append(bytes, state.topology);
+	Append(bytes, state.polygon_mode);
+	Append(bytes, state.cull_mode);
+	Append(bytes, state.front_face);
+	Append(bytes, state.depth_test);
+	Append(bytes, state.depth_write);
+	Append(bytes, state.depth_compare);
+	Append(bytes, state.blend_enable);
+	if (state.blend_enable) {
+		Append(bytes, state.src_color_blend);
+		Append(bytes, state.dst_color_blend);
+		Append(bytes, state.color_blend_op);
+		Append(bytes, state.src_alpha_blend);
+		Append(bytes, state.dst_alpha_blend);
+		Append(bytes, state.alpha_blend_op);
+	}
+	Append(bytes, state.color_write_mask);
+	Append(bytes, state.layout);
+	Append(bytes, state.render_pass);
+	Append(bytes, state.subpass);
+	return bytes;
+}
+
+void PipelineStateCache::Create(VkDevice device, VkPipelineCache pipeline_cache, JobSystem* jobs) {
+	device_ = device;
+	pipeline_cache_ = pipeline_cache;
+	jobs_ = jobs;
+
+	// Every worker starts out with what was loaded from disk, otherwise a
+	// warm start would only be warm for whatever merges came back later.
+	size_t size = 0;
+	auto res = vkGetPipelineCacheData(device_, pipeline_cache_, &size, nullptr);
+	assert(VK_SUCCESS == res);
+	std::vector<uint8_t> data(size);
+	if (size > 0) {
+		res = vkGetPipelineCacheData(device_, pipeline_cache_, &size, data.data());
+		assert(VK_SUCCESS == res);
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo = {};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = size;
+	cacheInfo.pInitialData = data.data();
+	worker_caches_.resize(jobs_->GetThreadCount() + 1);
+	worker_dirty_.assign(worker_caches_.size(), 0);
+	for (auto& cache : worker_caches_) {
+		res = vkCreatePipelineCache(device_, &cacheInfo, nullptr, &cache);
+		assert(VK_SUCCESS == res);
+	}
+}
+
+void PipelineStateCache::Destroy() {
+	jobs_->Wait(jobs_running_);
+	{
+		// GetBlocking() may still be compiling on another thread.
+		std::unique_lock<std::mutex> lock{ mutex_ };
+		compiled_.wait(lock, [this] { return pending_count_ == 0; });
+		for (auto& pair : entries_) {
+			vkDestroyPipeline(device_, pair.second.pipeline, nullptr);
+		}
+		entries_.clear();
+	}
+
+	// The last compile has usually merged already, this catches the rest.
+	MergeWhenIdle();
+	std::lock_guard<std::mutex> merge_lock{ merge_mutex_ };
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	for (auto cache : worker_caches_) {
+		vkDestroyPipelineCache(device_, cache, nullptr);
+	}
+	worker_caches_.clear();
+	worker_dirty_.clear();
+}
+
+void PipelineStateCache::MergeWhenIdle() {
+	std::lock_guard<std::mutex> merge_lock{ merge_mutex_ };
+	std::vector<VkPipelineCache> sources{};
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		if (pending_count_ > 0) return;
+		for (size_t i = 0; i < worker_caches_.size(); ++i) {
+			if (!worker_dirty_[i]) continue;
+			worker_dirty_[i] = 0;
+			sources.push_back(worker_caches_[i]);
+		}
+	}
+	if (sources.empty()) return;
+
+	// Compiles that start meanwhile may still add to the sources, which
+	// the driver allows. They get merged again after the next compile.
+	PROFILE_SCOPE("Merge pipeline caches");
+	auto res = vkMergePipelineCaches(device_, pipeline_cache_, (uint32_t)sources.size(), sources.data());
+	assert(VK_SUCCESS == res);
+}
+
+VkPipeline PipelineStateCache::Compile(const PipelineState& state) {
+	PROFILE_SCOPE("Compile pipeline");
+	VkPipelineShaderStageCreateInfo stages[2] = {};
+	stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	stages[0].module = state.vertex_shader;
+	stages[0].pName = "main";
+	stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	stages[1].module = state.fragment_shader;
+	stages[1].pName = "main";
+
+	VkPipelineVertexInputStateCreateInfo vertexInput = {};
+	vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInput.vertexBindingDescriptionCount = (uint32_t)state.vertex_bindings.size();
+	vertexInput.pVertexBindingDescriptions = state.vertex_bindings.data();
+	vertexInput.vertexAttributeDescriptionCount = (uint32_t)state.vertex_attributes.size();
+	vertexInput.pVertexAttributeDescriptions = state.vertex_attributes.data();
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = state.topology;
+
+	VkPipelineViewportStateCreateInfo viewport = {};
+	viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewport.viewportCount = 1;
+	viewport.scissorCount = 1;
+
+	VkPipelineRasterizationStateCreateInfo rasterization = {};
+	rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterization.polygonMode = state.polygon_mode;
+	rasterization.cullMode = state.cull_mode;
+	rasterization.frontFace = state.front_face;
+	rasterization.lineWidth = 1.0f;
+
+	VkPipelineMultisampleStateCreateInfo multisample = {};
+	multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = state.depth_test;
+	depthStencil.depthWriteEnable = state.depth_write;
+	depthStencil.depthCompareOp = state.depth_compare;
+
+	VkPipelineColorBlendAttachmentState blendAttachment = {};
+	blendAttachment.blendEnable = state.blend_enable;
+	blendAttachment.srcColorBlendFactor = state.src_color_blend;
+	blendAttachment.dstColorBlendFactor = state.dst_color_blend;
+	blendAttachment.colorBlendOp = state.color_blend_op;
+	blendAttachment.srcAlphaBlendFactor = state.src_alpha_blend;
+	blendAttachment.dstAlphaBlendFactor = state.dst_alpha_blend;
+	blendAttachment.alphaBlendOp = state.alpha_blend_op;
+	blendAttachment.colorWriteMask = state.color_write_mask;
+
+	VkPipelineColorBlendStateCreateInfo colorBlend = {};
+	colorBlend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlend.attachmentCount = 1;
+	colorBlend.pAttachments = &blendAttachment;
+
+	const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamic = {};
+	dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamic.dynamicStateCount = 2;
+	dynamic.pDynamicStates = dynamicStates;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = state.fragment_shader ? 2 : 1;
+	pipelineInfo.pStages = stages;
+	pipelineInfo.pVertexInputState = &vertexInput;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewport;
+	pipelineInfo.pRasterizationState = &rasterization;
+	pipelineInfo.pMultisampleState = &multisample;
+	pipelineInfo.pDepthStencilState = &depthStencil;
+	pipelineInfo.pColorBlendState = &colorBlend;
+	pipelineInfo.pDynamicState = &dynamic;
+	pipelineInfo.layout = state.layout;
+	pipelineInfo.renderPass = state.render_pass;
+	pipelineInfo.subpass = state.subpass;
+
+	uint32_t index = JobSystem::GetThreadIndex();
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	auto res = vkCreateGraphicsPipelines(device_, worker_caches_[index], 1, &pipelineInfo, nullptr, &pipeline);
+	if (res != VK_SUCCESS) {
+		// Formatted up front, std::hex on std::cerr would race other workers.
+		char name[17];
+		snprintf(name, sizeof(name), "%016llx", (unsigned long long)HashKey(Serialize(state)));
+		std::cerr << "pipeline: compile failed with " << res << " for state " << name << std::endl;
+		return VK_NULL_HANDLE;
+	}
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		worker_dirty_[index] = 1;
+	}
+	return pipeline;
+}
+
+PipelineStateCache::Entry& PipelineStateCache::Lookup(const PipelineState& state, bool schedule) {
+	std::string key = Serialize(state);
+	auto it = entries_.find(key);
+	if (it != entries_.end()) return it->second;
+
+	Entry& entry = entries_[key];
+	if (!schedule) return entry;
+
+	entry.pending = true;
+	++pending_count_;
+	jobs_->Run([this, key, state] {
+		VkPipeline pipeline = Compile(state);
+		{
+			std::lock_guard<std::mutex> lock{ mutex_ };
+			Finish(key, pipeline);
+			--pending_count_;
+		}
+		compiled_.notify_all();
+		MergeWhenIdle();
+	}, &jobs_running_);
+	return entry;
+}
+
+VkPipeline PipelineStateCache::Get(const PipelineState& state, VkPipeline fallback) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	Entry& entry = Lookup(state, true);
+	return entry.pipeline ? entry.pipeline : fallback;
+}
+
+VkPipeline PipelineStateCache::GetBlocking(const PipelineState& state) {
+	std::unique_lock<std::mutex> lock{ mutex_ };
+	Entry* entry = &Lookup(state, false);
+	if (entry->pipeline) return entry->pipeline;
+
+	std::string key = Serialize(state);
+	if (entry->pending) {
+		compiled_.wait(lock, [&] {
+			auto it = entries_.find(key);
+			return it == entries_.end() || !it->second.pending;
+		});
+		auto it = entries_.find(key);
+		return it != entries_.end() ? it->second.pipeline : VK_NULL_HANDLE;
+	}
+
+	// Nobody is compiling it, do it here instead of waiting on the queue.
+	entry->pending = true;
+	++pending_count_;
+	lock.unlock();
+	VkPipeline pipeline = Compile(state);
+	lock.lock();
+	Finish(key, pipeline);
+	--pending_count_;
+	compiled_.notify_all();
+	lock.unlock();
+	MergeWhenIdle();
+	return pipeline;
+}
+
+void PipelineStateCache::Finish(const std::string& key, VkPipeline pipeline) {
+	// A failed compile leaves nothing behind, the next request tries again.
+	if (pipeline == VK_NULL_HANDLE) {
+		entries_.erase(key);
+		return;
+	}
+	Entry& entry = entries_[key];
+	entry.pipeline = pipeline;
+	entry.pending = false;
+}
+
+void PipelineStateCache::Prefetch(const PipelineState& state) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	Lookup(state, true);
+}
+
+uint32_t PipelineStateCache::GetPendingCount() {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	return pending_count_;
+}
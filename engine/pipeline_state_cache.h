@@ -0,0 +1,113 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "job_system.h"
+
+// Everything that goes into a graphics pipeline. Viewport and scissor are
+// always dynamic so pipelines survive a resize.
+struct PipelineState {
+    // Modules must stay alive until the pipeline has been compiled.
+    VkShaderModule vertex_shader{};
+    VkShaderModule fragment_shader{};
+    std::vector<VkVertexInputBindingDescription> vertex_bindings{};
+    std::vector<VkVertexInputAttributeDescription> vertex_attributes{};
+    VkPrimitiveTopology topology{ VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST };
+
+    VkPolygonMode polygon_mode{ VK_POLYGON_MODE_FILL };
+    VkCullModeFlags cull_mode{ VK_CULL_MODE_BACK_BIT };
+    VkFrontFace front_face{ VK_FRONT_FACE_COUNTER_CLOCKWISE };
+
+    bool depth_test{ true };
+    bool depth_write{ true };
+    VkCompareOp depth_compare{ VK_COMPARE_OP_LESS_OR_EQUAL };
+
+    bool blend_enable{ false };
+    VkBlendFactor src_color_blend{ VK_BLEND_FACTOR_SRC_ALPHA };
+    VkBlendFactor dst_color_blend{ VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA };
+    VkBlendOp color_blend_op{ VK_BLEND_OP_ADD };
+    VkBlendFactor src_alpha_blend{ VK_BLEND_FACTOR_ONE };
+    VkBlendFactor dst_alpha_blend{ VK_BLEND_FACTOR_ZERO };
+    VkBlendOp alpha_blend_op{ VK_BLEND_OP_ADD };
+    VkColorComponentFlags color_write_mask{ 0xF };
+
+    VkPipelineLayout layout{};
+    // Compatible render passes share pipelines, but the handle is what gets
+    // hashed, so keep one render pass per attachment setup.
+    VkRenderPass render_pass{};
+    uint32_t subpass{ 0 };
+};
+
+// Maps full pipeline state to VkPipelines. A miss queues the compile on the
+// job system and hands back the caller's fallback until it is done, so new
+// materials never stall the render thread.
+//
+// Every job thread compiles into a cache of its own, seeded from the shared
+// one, so workers never contend on it. Whenever the last compile in flight
+// finishes, what the workers added is merged back into the shared cache,
+// which is what gets written to disk.
+class PipelineStateCache {
+public:
+    // Nothing else may use pipeline_cache while this owns it.
+    void Create(VkDevice device, VkPipelineCache pipeline_cache, JobSystem* jobs);
+    // Waits for compiles in flight, merges the worker caches back and
+    // destroys every pipeline.
+    void Destroy();
+
+    // Returns fallback while the pipeline is not ready yet. Failed compiles
+    // are logged and not cached, the next request compiles again.
+    VkPipeline Get(const PipelineState& state, VkPipeline fallback = VK_NULL_HANDLE);
+    // Compiles on the calling thread on a miss, or waits for a pending compile.
+    // VK_NULL_HANDLE when the compile failed.
+    VkPipeline GetBlocking(const PipelineState& state);
+    // Queues the compile ahead of first use, e.g. while loading a level.
+    void Prefetch(const PipelineState& state);
+
+    uint32_t GetPendingCount();
+
+private:
+    struct Entry {
+        VkPipeline pipeline{};
+        bool pending{ false };
+    };
+
+    static std::string Serialize(const PipelineState& state);
+    // Into the calling thread's cache, marking it for the next merge.
+    // Logs the state's key hash and returns VK_NULL_HANDLE on failure.
+    VkPipeline Compile(const PipelineState& state);
+    // Stores a finished compile or drops the entry of a failed one, mutex_
+    // is held.
+    void Finish(const std::string& key, VkPipeline pipeline);
+    // Returns the entry, scheduling a compile when it is new. mutex_ is held.
+    Entry& Lookup(const PipelineState& state, bool schedule);
+    // Called after every compile, does nothing while others are in flight.
+    void MergeWhenIdle();
+
+    VkDevice device_{};
+    VkPipelineCache pipeline_cache_{};
+    JobSystem* jobs_{ nullptr };
+
+    // Indexed by JobSystem::GetThreadIndex(), 0 is shared by every thread
+    // outside the job system. Drivers synchronize concurrent compiles into
+    // one cache, only merging needs the destination to itself.
+    std::vector<VkPipelineCache> worker_caches_{};
+    std::vector<uint8_t> worker_dirty_{};
+    // Serializes merges into pipeline_cache_, taken before mutex_.
+    std::mutex merge_mutex_{};
+
+    // Keyed by the serialized state, which doubles as the equality check.
+    std::unordered_map<std::string, Entry> entries_{};
+    uint32_t pending_count_{ 0 };
+    // Compile jobs until they have returned, merge included. pending_count_
+    // drops earlier, so it alone cannot tell when this may be destroyed.
+    JobCounter jobs_running_{};
+    std::mutex mutex_{};
+    std::condition_variable compiled_{};
+};
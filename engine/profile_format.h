@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Cpu profile capture written by CpuProfiler::WriteBinary(), converted to a
+// Chrome trace by tools/ProfileConvert.cpp:
+//
+//   ProfileHeader
+//   string_count strings: varint length, bytes
+//   thread_count threads: varint name string, varint event count, events
+//
+// Events of a thread are sorted by begin. Each is three varints: its name
+// string, begin minus the previous event's begin (origin_ticks for the
+// first) and duration, both in ticks. Nested scopes mostly differ by small
+// deltas, so a typical event takes 4 to 6 bytes.
+
+static const uint32_t kProfileMagic = 0x46504256; // 'VBPF'
+static const uint32_t kProfileVersion = 1;
+
+struct ProfileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t string_count;
+    uint32_t thread_count;
+    // Maps ticks onto steady_clock nanoseconds:
+    // ns = origin_ns + (ticks - origin_ticks) * ns_per_tick
+    double ns_per_tick;
+    uint64_t origin_ticks;
+    int64_t origin_ns;
+    // Events lost to full ring buffers.
+    uint64_t dropped;
+};
+
+// LEB128, 7 bits per byte with the high bit marking more to come.
+inline void WriteProfileVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+inline bool ReadProfileVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64 && data < end; shift += 7) {
+        uint8_t byte = *data++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
@@ -0,0 +1,930 @@
+#include "render_graph.h"
+#include "cpu_profiler.h"
+#include "gpu_profiler.h"
+
+#include <algorithm>
+#include <cassert>
+
+struct UsageInfo {
+	// 0 for shader access, whose stages depend on the pass.
+	VkPipelineStageFlags stages;
+	VkAccessFlags read_access;
+	VkAccessFlags write_access;
+	VkImageLayout read_layout;
+	VkImageLayout write_layout;
+	VkImageUsageFlags image_usage;
+	VkBufferUsageFlags buffer_usage;
+};
+
+static const UsageInfo kUsageInfo[eMaxResourceUsage] = {
+	// eColorAttachment
+	{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT,
+		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 0 },
+	// eDepthAttachment
+	{ VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, 0 },
+	// eShaderRead
+	{ 0, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+		VK_IMAGE_USAGE_SAMPLED_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT },
+	// eStorage
+	{ 0, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+		VK_IMAGE_USAGE_STORAGE_BIT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT },
+	// eTransferSrc
+	{ VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_BUFFER_USAGE_TRANSFER_SRC_BIT },
+	// eTransferDst
+	{ VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT, VK_BUFFER_USAGE_TRANSFER_DST_BIT },
+	// eVertexBuffer
+	{ VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, 0,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_UNDEFINED, 0, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT },
+	// eIndexBuffer
+	{ VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT, 0,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_UNDEFINED, 0, VK_BUFFER_USAGE_INDEX_BUFFER_BIT },
+	// eUniformBuffer
+	{ 0, VK_ACCESS_UNIFORM_READ_BIT, 0,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_UNDEFINED, 0, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT },
+	// eIndirectBuffer
+	{ VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT, 0,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_UNDEFINED, 0, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT },
+};
+
+static const VkAccessFlags kWriteAccess = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+	VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT |
+	VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+static bool IsDepthFormat(VkFormat format) {
+	switch (format) {
+	case VK_FORMAT_D16_UNORM:
+	case VK_FORMAT_X8_D24_UNORM_PACK32:
+	case VK_FORMAT_D32_SFLOAT:
+	case VK_FORMAT_D16_UNORM_S8_UINT:
+	case VK_FORMAT_D24_UNORM_S8_UINT:
+	case VK_FORMAT_D32_SFLOAT_S8_UINT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool HasStencil(VkFormat format) {
+	return format == VK_FORMAT_D16_UNORM_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT ||
+		format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_S8_UINT;
+}
+
+static VkImageAspectFlags GetAspect(VkFormat format) {
+	if (format == VK_FORMAT_S8_UINT) return VK_IMAGE_ASPECT_STENCIL_BIT;
+	if (!IsDepthFormat(format)) return VK_IMAGE_ASPECT_COLOR_BIT;
+	VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+	if (HasStencil(format)) aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+	return aspect;
+}
+
+// Two uses of one image in one pass need a layout that works for both.
+static VkImageLayout MergeLayouts(VkImageLayout a, VkImageLayout b) {
+	if (a == VK_IMAGE_LAYOUT_UNDEFINED || a == b) return b;
+	if (b == VK_IMAGE_LAYOUT_UNDEFINED) return a;
+	auto read_only = [](VkImageLayout layout) {
+		return layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL ||
+			layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	};
+	if (read_only(a) && read_only(b)) return VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	return VK_IMAGE_LAYOUT_GENERAL;
+}
+
+static VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+template<typename T>
+static void Append(std::string& key, const T& value) {
+	key.append((const char*)&value, sizeof(value));
+}
+
+VkImage RenderPassContext::GetImage(RenderResource resource) const {
+	return graph->GetImage(resource);
+}
+
+VkImageView RenderPassContext::GetImageView(RenderResource resource) const {
+	return graph->GetImageView(resource);
+}
+
+VkBuffer RenderPassContext::GetBuffer(RenderResource resource) const {
+	return graph->GetBuffer(resource);
+}
+
+RenderPassBuilder& RenderPassBuilder::Read(RenderResource resource, ResourceUsage usage) {
+	assert(resource < graph_->resources_.size());
+	auto& pass = graph_->passes_[pass_];
+	RenderGraph::Access access{};
+	access.resource = resource;
+	access.usage = usage;
+	pass.accesses.push_back(access);
+	if (usage == eColorAttachment || usage == eDepthAttachment) pass.raster = true;
+	return *this;
+}
+
+RenderPassBuilder& RenderPassBuilder::Write(RenderResource resource, ResourceUsage usage) {
+	Read(resource, usage);
+	assert(kUsageInfo[usage].write_access != 0);
+	graph_->passes_[pass_].accesses.back().write = true;
+	return *this;
+}
+
+RenderPassBuilder& RenderPassBuilder::Clear(RenderResource resource, const VkClearValue& value) {
+	for (auto& access : graph_->passes_[pass_].accesses) {
+		if (access.resource != resource || !access.write) continue;
+		assert(access.usage == eColorAttachment || access.usage == eDepthAttachment);
+		access.clear = true;
+		access.clear_value = value;
+		return *this;
+	}
+	assert(!"Clear() needs a Write() of the attachment first");
+	return *this;
+}
+
+RenderPassBuilder& RenderPassBuilder::SideEffects() {
+	graph_->passes_[pass_].side_effects = true;
+	return *this;
+}
+
+RenderPassBuilder& RenderPassBuilder::Open(VkSubpassContents contents) {
+	auto& pass = graph_->passes_[pass_];
+	pass.open = true;
+	pass.contents = contents;
+	return *this;
+}
+
+void RenderGraph::Create(VkDevice device, MemoryAllocator* allocator, uint32_t frame_count,
+	GpuProfiler* profiler) {
+	device_ = device;
+	allocator_ = allocator;
+	profiler_ = profiler;
+	frame_count_ = std::max(frame_count, 1u);
+}
+
+void RenderGraph::Destroy() {
+	Invalidate();
+	for (auto& framebuffer : retired_framebuffers_) {
+		vkDestroyFramebuffer(device_, framebuffer.first, nullptr);
+	}
+	retired_framebuffers_.clear();
+	DestroyPhysical(physical_);
+	for (auto& set : retired_) {
+		DestroyPhysical(set);
+	}
+	retired_.clear();
+	physical_key_.clear();
+	for (auto& entry : render_passes_) {
+		vkDestroyRenderPass(device_, entry.second, nullptr);
+	}
+	render_passes_.clear();
+	passes_.clear();
+	resources_.clear();
+}
+
+RenderResource RenderGraph::CreateTexture(const char* name, const RenderTextureDesc& desc) {
+	Resource resource{};
+	resource.name = name;
+	resource.image = true;
+	resource.texture = desc;
+	resources_.push_back(resource);
+	return (RenderResource)resources_.size() - 1;
+}
+
+RenderResource RenderGraph::CreateBuffer(const char* name, const RenderBufferDesc& desc) {
+	Resource resource{};
+	resource.name = name;
+	resource.buffer = desc;
+	resources_.push_back(resource);
+	return (RenderResource)resources_.size() - 1;
+}
+
+RenderResource RenderGraph::ImportTexture(const char* name, VkImage image, VkImageView view,
+	const RenderTextureDesc& desc, const ImportState& initial, const ImportState& final) {
+	Resource resource{};
+	resource.name = name;
+	resource.image = true;
+	resource.imported = true;
+	resource.texture = desc;
+	resource.image_handle = image;
+	resource.view_handle = view;
+	resource.initial = initial;
+	resource.final = final;
+	resources_.push_back(resource);
+	return (RenderResource)resources_.size() - 1;
+}
+
+RenderResource RenderGraph::ImportBuffer(const char* name, VkBuffer buffer, VkDeviceSize size,
+	const ImportState& initial, const ImportState& final) {
+	Resource resource{};
+	resource.name = name;
+	resource.imported = true;
+	resource.buffer.size = size;
+	resource.buffer_handle = buffer;
+	resource.initial = initial;
+	resource.final = final;
+	resources_.push_back(resource);
+	return (RenderResource)resources_.size() - 1;
+}
+
+RenderPassBuilder RenderGraph::AddPass(const char* name, RenderPassFunc execute) {
+	assert(!open_);
+	Pass pass{};
+	pass.name = name;
+	pass.execute = std::move(execute);
+	passes_.push_back(std::move(pass));
+	return RenderPassBuilder{ this, (uint32_t)passes_.size() - 1 };
+}
+
+void RenderGraph::Invalidate() {
+	for (auto& entry : framebuffers_) {
+		retired_framebuffers_.push_back({ entry.second.framebuffer, executions_ + frame_count_ });
+	}
+	framebuffers_.clear();
+}
+
+void RenderGraph::Cull(std::vector<uint32_t>& alive) {
+	// Walk backwards from the results, a pass survives when something
+	// later needs what it writes.
+	std::vector<bool> needed(resources_.size(), false);
+	std::vector<bool> keep(passes_.size(), false);
+	for (uint32_t i = (uint32_t)passes_.size(); i-- > 0;) {
+		const Pass& pass = passes_[i];
+		bool used = pass.side_effects;
+		for (const auto& access : pass.accesses) {
+			if (access.write && (needed[access.resource] || resources_[access.resource].imported)) {
+				used = true;
+			}
+		}
+		if (!used) continue;
+		keep[i] = true;
+
+		// A cleared attachment does not depend on what was there before,
+		// any other write may only update part of the resource.
+		for (const auto& access : pass.accesses) {
+			if (access.clear) needed[access.resource] = false;
+		}
+		for (const auto& access : pass.accesses) {
+			if (!access.clear) needed[access.resource] = true;
+		}
+	}
+
+	alive.clear();
+	for (uint32_t i = 0; i < passes_.size(); ++i) {
+		if (keep[i]) alive.push_back(i);
+	}
+}
+
+std::string RenderGraph::Serialize() const {
+	std::string key{};
+	for (const auto& resource : resources_) {
+		if (resource.physical == UINT32_MAX) continue;
+		Append(key, resource.image);
+		Append(key, resource.first_pass);
+		Append(key, resource.last_pass);
+		if (resource.image) {
+			Append(key, resource.texture.format);
+			Append(key, resource.texture.extent);
+			Append(key, resource.image_usage);
+		} else {
+			Append(key, resource.buffer.size);
+			Append(key, resource.buffer_usage);
+		}
+	}
+	return key;
+}
+
+void RenderGraph::BuildPhysical() {
+	PhysicalSet& set = physical_;
+	std::vector<std::pair<uint32_t, uint32_t>> lifetimes{};
+	for (const auto& resource : resources_) {
+		if (resource.physical == UINT32_MAX) continue;
+		if (set.resources.size() <= resource.physical) {
+			set.resources.resize(resource.physical + 1);
+			lifetimes.resize(resource.physical + 1);
+		}
+		Physical& physical = set.resources[resource.physical];
+		lifetimes[resource.physical] = { resource.first_pass, resource.last_pass };
+
+		if (resource.image) {
+			VkImageCreateInfo imageInfo = {};
+			imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+			imageInfo.imageType = VK_IMAGE_TYPE_2D;
+			imageInfo.format = resource.texture.format;
+			imageInfo.extent = { resource.texture.extent.width, resource.texture.extent.height, 1 };
+			imageInfo.mipLevels = 1;
+			imageInfo.arrayLayers = 1;
+			imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+			imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+			imageInfo.usage = resource.image_usage;
+			imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+			imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			auto res = vkCreateImage(device_, &imageInfo, nullptr, &physical.image);
+			assert(VK_SUCCESS == res);
+			vkGetImageMemoryRequirements(device_, physical.image, &physical.reqs);
+			physical.kind = eOptimalImage;
+		} else {
+			VkBufferCreateInfo bufferInfo = {};
+			bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+			bufferInfo.size = resource.buffer.size;
+			bufferInfo.usage = resource.buffer_usage;
+			bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+			auto res = vkCreateBuffer(device_, &bufferInfo, nullptr, &physical.buffer);
+			assert(VK_SUCCESS == res);
+			vkGetBufferMemoryRequirements(device_, physical.buffer, &physical.reqs);
+			physical.kind = eLinearResource;
+		}
+		set.unaliased_bytes += physical.reqs.size;
+	}
+
+	auto overlaps = [&](uint32_t a, uint32_t b) {
+		return lifetimes[a].first <= lifetimes[b].second && lifetimes[b].first <= lifetimes[a].second;
+	};
+
+	// Largest first, each resource goes to the lowest offset where it does
+	// not collide with anything placed before it that is alive at the same
+	// time. Buffers and images get separate heaps, as everywhere else.
+	for (uint32_t kind = 0; kind < eMaxAllocationKind; ++kind) {
+		std::vector<uint32_t> order{};
+		for (uint32_t i = 0; i < set.resources.size(); ++i) {
+			if (set.resources[i].kind == kind) order.push_back(i);
+		}
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+			return set.resources[a].reqs.size > set.resources[b].reqs.size;
+		});
+
+		std::vector<uint32_t> placed{};
+		VkMemoryRequirements heap = { 0, 1, ~0u };
+		for (uint32_t index : order) {
+			Physical& physical = set.resources[index];
+			if ((heap.memoryTypeBits & physical.reqs.memoryTypeBits) == 0) {
+				AllocationInfo info{};
+				info.kind = physical.kind;
+				bool allocated = physical.image ?
+					allocator_->AllocateForImage(physical.image, info, physical.own) :
+					allocator_->AllocateForBuffer(physical.buffer, info, physical.own);
+				assert(allocated);
+				set.bytes += physical.reqs.size;
+				continue;
+			}
+
+			std::vector<VkDeviceSize> candidates{ 0 };
+			for (uint32_t other : placed) {
+				if (!overlaps(index, other)) continue;
+				const Physical& placed_physical = set.resources[other];
+				candidates.push_back(AlignUp(placed_physical.offset + placed_physical.reqs.size,
+					physical.reqs.alignment));
+			}
+			std::sort(candidates.begin(), candidates.end());
+			for (VkDeviceSize offset : candidates) {
+				bool fits = true;
+				for (uint32_t other : placed) {
+					const Physical& placed_physical = set.resources[other];
+					if (overlaps(index, other) && offset < placed_physical.offset + placed_physical.reqs.size &&
+						placed_physical.offset < offset + physical.reqs.size) {
+						fits = false;
+						break;
+					}
+				}
+				if (fits) {
+					physical.offset = offset;
+					break;
+				}
+			}
+
+			heap.size = std::max(heap.size, physical.offset + physical.reqs.size);
+			heap.alignment = std::max(heap.alignment, physical.reqs.alignment);
+			heap.memoryTypeBits &= physical.reqs.memoryTypeBits;
+			placed.push_back(index);
+		}
+		if (placed.empty()) continue;
+
+		AllocationInfo info{};
+		info.kind = (AllocationKind)kind;
+		Allocation& allocation = set.heaps[kind];
+		bool allocated = allocator_->Allocate(heap, info, allocation);
+		assert(allocated);
+		set.bytes += heap.size;
+
+		for (uint32_t index : placed) {
+			Physical& physical = set.resources[index];
+			VkDeviceSize offset = allocation.offset + physical.offset;
+			auto res = physical.image ?
+				vkBindImageMemory(device_, physical.image, allocation.memory, offset) :
+				vkBindBufferMemory(device_, physical.buffer, allocation.memory, offset);
+			assert(VK_SUCCESS == res);
+
+			for (uint32_t other : placed) {
+				const Physical& placed_physical = set.resources[other];
+				if (other != index && physical.offset < placed_physical.offset + placed_physical.reqs.size &&
+					placed_physical.offset < physical.offset + physical.reqs.size) {
+					physical.aliases.push_back(other);
+				}
+			}
+		}
+	}
+
+	for (const auto& resource : resources_) {
+		if (resource.physical == UINT32_MAX || !resource.image) continue;
+		Physical& physical = set.resources[resource.physical];
+
+		// Sampling needs a single aspect, attachments want all of them.
+		VkImageAspectFlags aspect = GetAspect(resource.texture.format);
+		if ((resource.image_usage & VK_IMAGE_USAGE_SAMPLED_BIT) && (aspect & VK_IMAGE_ASPECT_DEPTH_BIT)) {
+			aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+		}
+
+		VkImageViewCreateInfo viewInfo = {};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = physical.image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = resource.texture.format;
+		viewInfo.subresourceRange = { aspect, 0, 1, 0, 1 };
+		auto res = vkCreateImageView(device_, &viewInfo, nullptr, &physical.view);
+		assert(VK_SUCCESS == res);
+	}
+}
+
+void RenderGraph::DestroyPhysical(PhysicalSet& set) {
+	for (auto& physical : set.resources) {
+		if (physical.view) vkDestroyImageView(device_, physical.view, nullptr);
+		if (physical.image) vkDestroyImage(device_, physical.image, nullptr);
+		if (physical.buffer) vkDestroyBuffer(device_, physical.buffer, nullptr);
+		allocator_->Free(physical.own);
+	}
+	for (auto& heap : set.heaps) {
+		allocator_->Free(heap);
+	}
+	set = PhysicalSet{};
+}
+
+void RenderGraph::RetireOld() {
+	// Anything last used frame_count executions ago has finished on the gpu,
+	// the engine waits for that frame's fence before reusing its slot.
+	for (auto it = framebuffers_.begin(); it != framebuffers_.end();) {
+		if (it->second.last_used + frame_count_ <= executions_) {
+			vkDestroyFramebuffer(device_, it->second.framebuffer, nullptr);
+			it = framebuffers_.erase(it);
+		} else {
+			++it;
+		}
+	}
+	for (size_t i = 0; i < retired_framebuffers_.size();) {
+		if (retired_framebuffers_[i].second <= executions_) {
+			vkDestroyFramebuffer(device_, retired_framebuffers_[i].first, nullptr);
+			retired_framebuffers_[i] = retired_framebuffers_.back();
+			retired_framebuffers_.pop_back();
+		} else {
+			++i;
+		}
+	}
+	for (size_t i = 0; i < retired_.size();) {
+		if (retired_[i].retire_at <= executions_) {
+			DestroyPhysical(retired_[i]);
+			retired_[i] = std::move(retired_.back());
+			retired_.pop_back();
+		} else {
+			++i;
+		}
+	}
+}
+
+RenderGraph::SyncState& RenderGraph::GetState(RenderResource resource) {
+	const Resource& r = resources_[resource];
+	if (r.imported) return imported_states_[resource];
+	return physical_.resources[r.physical].state;
+}
+
+VkImage RenderGraph::GetImage(RenderResource resource) const {
+	const Resource& r = resources_[resource];
+	if (r.imported) return r.image_handle;
+	return r.physical == UINT32_MAX ? VK_NULL_HANDLE : physical_.resources[r.physical].image;
+}
+
+VkImageView RenderGraph::GetImageView(RenderResource resource) const {
+	const Resource& r = resources_[resource];
+	if (r.imported) return r.view_handle;
+	return r.physical == UINT32_MAX ? VK_NULL_HANDLE : physical_.resources[r.physical].view;
+}
+
+VkBuffer RenderGraph::GetBuffer(RenderResource resource) const {
+	const Resource& r = resources_[resource];
+	if (r.imported) return r.buffer_handle;
+	return r.physical == UINT32_MAX ? VK_NULL_HANDLE : physical_.resources[r.physical].buffer;
+}
+
+void RenderGraph::MergeUses(const Pass& pass, std::vector<Use>& uses) const {
+	const VkPipelineStageFlags shader_stages = pass.raster ?
+		VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT :
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+	uses.clear();
+	for (const auto& access : pass.accesses) {
+		const UsageInfo& info = kUsageInfo[access.usage];
+		Use* use = nullptr;
+		for (auto& existing : uses) {
+			if (existing.resource == access.resource) use = &existing;
+		}
+		if (!use) {
+			uses.push_back(Use{});
+			use = &uses.back();
+			use->resource = access.resource;
+		}
+		use->stages |= info.stages ? info.stages : shader_stages;
+		use->access |= access.write ? info.write_access : info.read_access;
+		if (resources_[access.resource].image) {
+			use->layout = MergeLayouts(use->layout, access.write ? info.write_layout : info.read_layout);
+		}
+		use->write |= access.write;
+		use->attachment |= access.usage == eColorAttachment || access.usage == eDepthAttachment;
+		if (access.clear) {
+			use->clear = true;
+			use->clear_value = access.clear_value;
+		}
+	}
+}
+
+void RenderGraph::Transition(RenderResource resource, SyncState& state, VkPipelineStageFlags stages,
+	VkAccessFlags access, VkImageLayout layout, bool write, Barriers& barriers) {
+	const Resource& r = resources_[resource];
+	bool layout_change = r.image && state.layout != layout;
+
+	// Writes wait for every earlier access, reads only for the last write,
+	// and only if it has not been made visible to them yet.
+	VkPipelineStageFlags src_stages = 0;
+	VkAccessFlags src_access = 0;
+	if (layout_change || write) {
+		src_stages = state.write_stages | state.read_stages;
+		src_access = state.write_access;
+	} else if (state.write_stages != 0 &&
+		((stages & ~state.visible_stages) != 0 || (access & ~state.visible_access) != 0)) {
+		src_stages = state.write_stages;
+		src_access = state.write_access;
+	}
+
+	if (layout_change) {
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.srcAccessMask = src_access;
+		barrier.dstAccessMask = access;
+		barrier.oldLayout = state.layout;
+		barrier.newLayout = layout;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = GetImage(resource);
+		barrier.subresourceRange = { GetAspect(r.texture.format), 0, VK_REMAINING_MIP_LEVELS,
+			0, VK_REMAINING_ARRAY_LAYERS };
+		barriers.images.push_back(barrier);
+		barriers.src_stages |= src_stages;
+		barriers.dst_stages |= stages;
+	} else if (src_stages != 0) {
+		// Buffers and images that keep their layout share one global barrier.
+		barriers.memory.srcAccessMask |= src_access;
+		barriers.memory.dstAccessMask |= access;
+		barriers.src_stages |= src_stages;
+		barriers.dst_stages |= stages;
+	}
+
+	if (write) {
+		state.write_stages = stages;
+		state.write_access = access & kWriteAccess;
+		state.read_stages = 0;
+		state.visible_stages = 0;
+		state.visible_access = 0;
+	} else if (layout_change) {
+		// The transition is a write this reader has already waited for.
+		state.write_stages = stages;
+		state.write_access = 0;
+		state.read_stages = stages;
+		state.visible_stages = stages;
+		state.visible_access = access;
+	} else {
+		state.read_stages |= stages;
+		if (src_stages != 0) {
+			state.visible_stages |= stages;
+			state.visible_access |= access;
+		}
+	}
+	state.layout = r.image ? layout : VK_IMAGE_LAYOUT_UNDEFINED;
+}
+
+void RenderGraph::FlushBarriers(VkCommandBuffer command_buffer, Barriers& barriers) {
+	if (barriers.dst_stages == 0) return;
+	VkMemoryBarrier* memory = nullptr;
+	if (barriers.memory.srcAccessMask != 0) {
+		barriers.memory.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		memory = &barriers.memory;
+	}
+	VkPipelineStageFlags src_stages = barriers.src_stages;
+	if (src_stages == 0) src_stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	vkCmdPipelineBarrier(command_buffer, src_stages, barriers.dst_stages, 0,
+		memory ? 1 : 0, memory, 0, nullptr, (uint32_t)barriers.images.size(), barriers.images.data());
+	++stats_.barrier_count;
+	stats_.image_barrier_count += (uint32_t)barriers.images.size();
+	barriers = Barriers{};
+}
+
+VkRenderPass RenderGraph::GetCompatibleRenderPass(const VkFormat* color_formats, uint32_t color_count,
+	VkFormat depth_format) {
+	// Compatibility only looks at formats and sample counts, the rest is
+	// whatever the graph would pick for an attachment that is only written.
+	std::vector<VkAttachmentDescription> attachments(color_count + (depth_format != VK_FORMAT_UNDEFINED ? 1 : 0));
+	for (uint32_t i = 0; i < attachments.size(); ++i) {
+		VkAttachmentDescription& attachment = attachments[i];
+		bool depth = i == color_count;
+		attachment.format = depth ? depth_format : color_formats[i];
+		attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachment.initialLayout = depth ?
+			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		attachment.finalLayout = attachment.initialLayout;
+	}
+	return GetRenderPass(attachments, color_count, depth_format != VK_FORMAT_UNDEFINED);
+}
+
+VkRenderPass RenderGraph::GetRenderPass(const std::vector<VkAttachmentDescription>& attachments,
+	uint32_t color_count, bool has_depth) {
+	std::string key{};
+	for (const auto& attachment : attachments) {
+		Append(key, attachment);
+	}
+	Append(key, color_count);
+	auto it = render_passes_.find(key);
+	if (it != render_passes_.end()) return it->second;
+
+	// Layouts are set up by the graph's own barriers, the render pass keeps
+	// every attachment in the layout it is used in.
+	std::vector<VkAttachmentReference> references(attachments.size());
+	for (uint32_t i = 0; i < attachments.size(); ++i) {
+		references[i] = { i, attachments[i].initialLayout };
+	}
+
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = color_count;
+	subpass.pColorAttachments = references.data();
+	subpass.pDepthStencilAttachment = has_depth ? &references[color_count] : nullptr;
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = (uint32_t)attachments.size();
+	renderPassInfo.pAttachments = attachments.data();
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+
+	VkRenderPass render_pass;
+	auto res = vkCreateRenderPass(device_, &renderPassInfo, nullptr, &render_pass);
+	assert(VK_SUCCESS == res);
+	render_passes_.emplace(std::move(key), render_pass);
+	return render_pass;
+}
+
+void RenderGraph::BeginRaster(const Pass& pass, const std::vector<Use>& uses, RenderPassContext& context) {
+	// Color attachments in declaration order, then depth.
+	std::vector<const Use*> ordered{};
+	const Use* depth = nullptr;
+	for (const auto& use : uses) {
+		if (!use.attachment) continue;
+		if (IsDepthFormat(resources_[use.resource].texture.format)) {
+			assert(!depth);
+			depth = &use;
+		} else {
+			ordered.push_back(&use);
+		}
+	}
+	uint32_t color_count = (uint32_t)ordered.size();
+	if (depth) ordered.push_back(depth);
+	assert(!ordered.empty());
+
+	std::vector<VkAttachmentDescription> attachments(ordered.size());
+	std::vector<VkImageView> views(ordered.size());
+	std::vector<VkClearValue> clear_values(ordered.size());
+	VkExtent2D extent = resources_[ordered[0]->resource].texture.extent;
+	for (uint32_t i = 0; i < ordered.size(); ++i) {
+		const Use& use = *ordered[i];
+		const Resource& resource = resources_[use.resource];
+		assert(resource.texture.extent.width == extent.width && resource.texture.extent.height == extent.height);
+
+		VkAttachmentDescription& attachment = attachments[i];
+		attachment.format = resource.texture.format;
+		attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		attachment.loadOp = use.load_op;
+		attachment.storeOp = use.store_op;
+		bool stencil = HasStencil(resource.texture.format);
+		attachment.stencilLoadOp = stencil ? use.load_op : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachment.stencilStoreOp = stencil ? use.store_op : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachment.initialLayout = use.layout;
+		attachment.finalLayout = use.layout;
+
+		views[i] = GetImageView(use.resource);
+		assert(views[i] != VK_NULL_HANDLE);
+		clear_values[i] = use.clear_value;
+	}
+	VkRenderPass render_pass = GetRenderPass(attachments, color_count, depth != nullptr);
+
+	std::string key{};
+	Append(key, render_pass);
+	Append(key, extent);
+	for (VkImageView view : views) {
+		Append(key, view);
+	}
+	Framebuffer& framebuffer = framebuffers_[key];
+	if (framebuffer.framebuffer == VK_NULL_HANDLE) {
+		VkFramebufferCreateInfo framebufferInfo = {};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = render_pass;
+		framebufferInfo.attachmentCount = (uint32_t)views.size();
+		framebufferInfo.pAttachments = views.data();
+		framebufferInfo.width = extent.width;
+		framebufferInfo.height = extent.height;
+		framebufferInfo.layers = 1;
+		auto res = vkCreateFramebuffer(device_, &framebufferInfo, nullptr, &framebuffer.framebuffer);
+		assert(VK_SUCCESS == res);
+	}
+	framebuffer.last_used = executions_;
+
+	VkRenderPassBeginInfo passInfo = {};
+	passInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	passInfo.renderPass = render_pass;
+	passInfo.framebuffer = framebuffer.framebuffer;
+	passInfo.renderArea.extent = extent;
+	passInfo.clearValueCount = (uint32_t)clear_values.size();
+	passInfo.pClearValues = clear_values.data();
+	vkCmdBeginRenderPass(context.command_buffer, &passInfo, pass.contents);
+
+	context.render_pass = render_pass;
+	context.framebuffer = framebuffer.framebuffer;
+	context.extent = extent;
+}
+
+void RenderGraph::Execute(VkCommandBuffer command_buffer) {
+	PROFILE_SCOPE("RenderGraph::Execute");
+	assert(!open_);
+	++executions_;
+	RetireOld();
+
+	stats_ = RenderGraphStats{};
+	stats_.pass_count = (uint32_t)passes_.size();
+	std::vector<uint32_t> alive{};
+	Cull(alive);
+	stats_.culled_pass_count = stats_.pass_count - (uint32_t)alive.size();
+
+	// Lifetimes and usage over the passes that survived.
+	for (uint32_t a = 0; a < alive.size(); ++a) {
+		const Pass& pass = passes_[alive[a]];
+		for (const auto& access : pass.accesses) {
+			Resource& resource = resources_[access.resource];
+			resource.first_pass = std::min(resource.first_pass, a);
+			resource.last_pass = std::max(resource.last_pass, a);
+			resource.image_usage |= kUsageInfo[access.usage].image_usage;
+			resource.buffer_usage |= kUsageInfo[access.usage].buffer_usage;
+		}
+	}
+	uint32_t physical_count = 0;
+	for (auto& resource : resources_) {
+		if (resource.imported || resource.first_pass == UINT32_MAX) continue;
+		resource.image_usage |= resource.texture.usage;
+		resource.buffer_usage |= resource.buffer.usage;
+		resource.physical = physical_count++;
+	}
+
+	std::string key = Serialize();
+	if (key != physical_key_) {
+		if (!physical_.resources.empty()) {
+			physical_.retire_at = executions_ + frame_count_;
+			retired_.push_back(std::move(physical_));
+			physical_ = PhysicalSet{};
+		}
+		physical_key_ = std::move(key);
+		BuildPhysical();
+	}
+	stats_.transient_bytes = physical_.bytes;
+	stats_.unaliased_bytes = physical_.unaliased_bytes;
+
+	imported_states_.assign(resources_.size(), SyncState{});
+	std::vector<bool> defined(resources_.size(), false);
+	for (uint32_t i = 0; i < resources_.size(); ++i) {
+		const Resource& resource = resources_[i];
+		if (!resource.imported) continue;
+		SyncState& state = imported_states_[i];
+		state.layout = resource.initial.layout;
+		if (resource.initial.access & kWriteAccess) {
+			state.write_stages = resource.initial.stages;
+			state.write_access = resource.initial.access & kWriteAccess;
+		} else {
+			state.read_stages = resource.initial.stages;
+		}
+		defined[i] = !resource.image || resource.initial.layout != VK_IMAGE_LAYOUT_UNDEFINED;
+	}
+
+	Barriers barriers{};
+	std::vector<Use> uses{};
+	for (uint32_t a = 0; a < alive.size(); ++a) {
+		const Pass& pass = passes_[alive[a]];
+		MergeUses(pass, uses);
+		// The barriers ahead of a pass count towards it.
+		uint32_t scope = profiler_ ? profiler_->BeginScope(command_buffer, pass.name.c_str()) : UINT32_MAX;
+
+		for (auto& use : uses) {
+			const Resource& resource = resources_[use.resource];
+			SyncState& state = GetState(use.resource);
+
+			if (!resource.imported && resource.first_pass == a) {
+				// The memory may have been used by an alias earlier in this
+				// frame or by anything sharing it last frame, wait for all of
+				// them before taking it over.
+				const Physical& physical = physical_.resources[resource.physical];
+				for (uint32_t alias : physical.aliases) {
+					const SyncState& other = physical_.resources[alias].state;
+					state.write_stages |= other.write_stages | other.read_stages;
+					state.write_access |= other.write_access;
+				}
+				state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+				state.visible_stages = 0;
+				state.visible_access = 0;
+			}
+
+			if (use.attachment) {
+				if (use.clear) use.load_op = VK_ATTACHMENT_LOAD_OP_CLEAR;
+				else if (defined[use.resource]) use.load_op = VK_ATTACHMENT_LOAD_OP_LOAD;
+				bool read_later = resource.imported || resource.last_pass > a;
+				use.store_op = read_later ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+				// Whatever was there is thrown away, skip preserving it.
+				if (use.load_op != VK_ATTACHMENT_LOAD_OP_LOAD) state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			}
+
+			Transition(use.resource, state, use.stages, use.access, use.layout, use.write, barriers);
+			if (use.write) defined[use.resource] = true;
+		}
+		FlushBarriers(command_buffer, barriers);
+
+		RenderPassContext context{};
+		context.command_buffer = command_buffer;
+		context.graph = this;
+		if (pass.raster) {
+			BeginRaster(pass, uses, context);
+			if (profiler_ && pass.contents == VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS) {
+				profiler_->SetSecondaryPass(command_buffer);
+			}
+		}
+		if (pass.execute) pass.execute(context);
+		if (pass.open) {
+			assert(pass.raster && a + 1 == alive.size());
+			open_ = true;
+			open_scope_ = scope;
+			return;
+		}
+		if (pass.raster) {
+			vkCmdEndRenderPass(command_buffer);
+		}
+		if (profiler_) {
+			profiler_->SetSecondaryPass(VK_NULL_HANDLE);
+			profiler_->EndScope(command_buffer, scope);
+		}
+	}
+	Finish(command_buffer);
+}
+
+void RenderGraph::Close(VkCommandBuffer command_buffer) {
+	if (open_) {
+		vkCmdEndRenderPass(command_buffer);
+		if (profiler_) {
+			profiler_->SetSecondaryPass(VK_NULL_HANDLE);
+			profiler_->EndScope(command_buffer, open_scope_);
+		}
+		open_ = false;
+	}
+	Finish(command_buffer);
+}
+
+void RenderGraph::Finish(VkCommandBuffer command_buffer) {
+	Barriers barriers{};
+
+	// Leave imported resources the way the rest of the frame expects them.
+	for (uint32_t i = 0; i < resources_.size(); ++i) {
+		const Resource& resource = resources_[i];
+		if (!resource.imported || resource.final.stages == 0) continue;
+		SyncState& state = imported_states_[i];
+		VkImageLayout layout = resource.final.layout != VK_IMAGE_LAYOUT_UNDEFINED ?
+			resource.final.layout : state.layout;
+		Transition(i, state, resource.final.stages, resource.final.access, layout, false, barriers);
+	}
+	FlushBarriers(command_buffer, barriers);
+
+	passes_.clear();
+	resources_.clear();
+}
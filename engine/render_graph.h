@@ -0,0 +1,302 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "memory_allocator.h"
+
+class GpuProfiler;
+
+// Index into the resources declared for the current frame.
+typedef uint32_t RenderResource;
+constexpr RenderResource kInvalidResource = UINT32_MAX;
+
+// How a pass touches a resource. Shader stages follow the pass: passes with
+// attachments are raster passes and read in the vertex and fragment stages,
+// the others run compute or transfer work.
+enum ResourceUsage : uint32_t {
+    eColorAttachment,
+    // Read-only depth testing when declared with Read().
+    eDepthAttachment,
+    // Sampled image or storage buffer.
+    eShaderRead,
+    // Storage image or storage buffer.
+    eStorage,
+    eTransferSrc,
+    eTransferDst,
+    eVertexBuffer,
+    eIndexBuffer,
+    eUniformBuffer,
+    eIndirectBuffer,
+    eMaxResourceUsage,
+};
+
+struct RenderTextureDesc {
+    VkFormat format{ VK_FORMAT_UNDEFINED };
+    VkExtent2D extent{};
+    // Added to the usage the graph derives from the passes.
+    VkImageUsageFlags usage{ 0 };
+};
+
+struct RenderBufferDesc {
+    VkDeviceSize size{ 0 };
+    VkBufferUsageFlags usage{ 0 };
+};
+
+// Synchronization state of an imported resource, where it comes from or
+// where it has to be left. A final state without stages leaves the resource
+// the way the last pass used it.
+struct ImportState {
+    VkImageLayout layout{ VK_IMAGE_LAYOUT_UNDEFINED };
+    VkPipelineStageFlags stages{ 0 };
+    VkAccessFlags access{ 0 };
+};
+
+struct RenderGraphStats {
+    uint32_t pass_count{ 0 };
+    uint32_t culled_pass_count{ 0 };
+    uint32_t barrier_count{ 0 };
+    uint32_t image_barrier_count{ 0 };
+    // Memory backing the transient resources, and what it would take
+    // without aliasing.
+    VkDeviceSize transient_bytes{ 0 };
+    VkDeviceSize unaliased_bytes{ 0 };
+};
+
+class RenderGraph;
+
+// Handed to the execute callback of a pass. Raster passes are recorded
+// inside their render pass, with viewport and scissor left to the callback.
+struct RenderPassContext {
+    VkCommandBuffer command_buffer{};
+    // VK_NULL_HANDLE for passes without attachments.
+    VkRenderPass render_pass{};
+    VkFramebuffer framebuffer{};
+    VkExtent2D extent{};
+    const RenderGraph* graph{ nullptr };
+
+    VkImage GetImage(RenderResource resource) const;
+    VkImageView GetImageView(RenderResource resource) const;
+    VkBuffer GetBuffer(RenderResource resource) const;
+};
+
+typedef std::function<void(const RenderPassContext&)> RenderPassFunc;
+
+class RenderPassBuilder {
+public:
+    RenderPassBuilder& Read(RenderResource resource, ResourceUsage usage);
+    RenderPassBuilder& Write(RenderResource resource, ResourceUsage usage);
+    // Clears an attachment written by this pass instead of loading it.
+    RenderPassBuilder& Clear(RenderResource resource, const VkClearValue& value);
+    // Keeps the pass even when nothing reads what it writes.
+    RenderPassBuilder& SideEffects();
+    // Leaves the render pass of this raster pass open when Execute()
+    // returns, the caller records into it until Close(). Only the last pass
+    // may be open. With secondary command buffers they inherit the render
+    // pass and framebuffer handed to the execute callback.
+    RenderPassBuilder& Open(VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
+
+private:
+    friend class RenderGraph;
+    RenderPassBuilder(RenderGraph* graph, uint32_t pass) : graph_(graph), pass_(pass) {}
+
+    RenderGraph* graph_;
+    uint32_t pass_;
+};
+
+// Frame graph of passes that declare what they read and write. Execute()
+// drops passes whose results are never used, puts the minimal barriers and
+// layout transitions between the rest, and places transient resources whose
+// lifetimes do not overlap on the same memory.
+//
+// The description is rebuilt every frame and consumed by Execute(). The
+// physical resources behind it are kept for as long as the transient
+// resources and their lifetimes stay the same, so a steady frame allocates
+// nothing. Transient contents do not survive the frame.
+class RenderGraph {
+public:
+    // frame_count is the number of frames that may be in flight, retired
+    // resources are destroyed after that many executions. With a profiler
+    // every pass is timed as a scope of its own name.
+    void Create(VkDevice device, MemoryAllocator* allocator, uint32_t frame_count,
+        GpuProfiler* profiler = nullptr);
+    void Destroy();
+
+    RenderResource CreateTexture(const char* name, const RenderTextureDesc& desc);
+    RenderResource CreateBuffer(const char* name, const RenderBufferDesc& desc);
+    // Writes to imported resources are the results of the graph. The view
+    // may be VK_NULL_HANDLE when the image is never used as an attachment.
+    RenderResource ImportTexture(const char* name, VkImage image, VkImageView view,
+        const RenderTextureDesc& desc, const ImportState& initial, const ImportState& final);
+    RenderResource ImportBuffer(const char* name, VkBuffer buffer, VkDeviceSize size,
+        const ImportState& initial, const ImportState& final);
+
+    // Passes execute in the order they are added.
+    RenderPassBuilder AddPass(const char* name, RenderPassFunc execute);
+
+    // Compatible with every raster pass writing attachments of these formats
+    // in this order, color first. Pipelines and secondary command buffers
+    // can be built against it before the graph has ever executed. Lives
+    // until Destroy().
+    VkRenderPass GetCompatibleRenderPass(const VkFormat* color_formats, uint32_t color_count,
+        VkFormat depth_format = VK_FORMAT_UNDEFINED);
+
+    void Execute(VkCommandBuffer command_buffer);
+    // Ends the pass left open by Execute() and leaves the imported resources
+    // in their final state. Does nothing when Execute() had no open pass.
+    void Close(VkCommandBuffer command_buffer);
+
+    // Drops cached framebuffers, needed once an imported view is destroyed
+    // since a new view may come back with the same handle.
+    void Invalidate();
+
+    const RenderGraphStats& GetStats() const { return stats_; }
+
+private:
+    friend class RenderPassBuilder;
+    friend struct RenderPassContext;
+
+    struct Access {
+        RenderResource resource{ kInvalidResource };
+        ResourceUsage usage{ eShaderRead };
+        bool write{ false };
+        bool clear{ false };
+        VkClearValue clear_value{};
+    };
+
+    struct Pass {
+        std::string name{};
+        RenderPassFunc execute{};
+        std::vector<Access> accesses{};
+        bool side_effects{ false };
+        bool raster{ false };
+        bool open{ false };
+        VkSubpassContents contents{ VK_SUBPASS_CONTENTS_INLINE };
+    };
+
+    struct Resource {
+        std::string name{};
+        bool image{ false };
+        bool imported{ false };
+        RenderTextureDesc texture{};
+        RenderBufferDesc buffer{};
+        VkImage image_handle{};
+        VkImageView view_handle{};
+        VkBuffer buffer_handle{};
+        ImportState initial{};
+        ImportState final{};
+        // Range of alive passes using it, filled in by Execute().
+        uint32_t first_pass{ UINT32_MAX };
+        uint32_t last_pass{ 0 };
+        VkImageUsageFlags image_usage{ 0 };
+        VkBufferUsageFlags buffer_usage{ 0 };
+        uint32_t physical{ UINT32_MAX };
+    };
+
+    // Every access of a pass to one resource merged into one.
+    struct Use {
+        RenderResource resource{ kInvalidResource };
+        VkPipelineStageFlags stages{ 0 };
+        VkAccessFlags access{ 0 };
+        VkImageLayout layout{ VK_IMAGE_LAYOUT_UNDEFINED };
+        bool write{ false };
+        bool attachment{ false };
+        bool clear{ false };
+        VkClearValue clear_value{};
+        VkAttachmentLoadOp load_op{ VK_ATTACHMENT_LOAD_OP_DONT_CARE };
+        VkAttachmentStoreOp store_op{ VK_ATTACHMENT_STORE_OP_DONT_CARE };
+    };
+
+    struct SyncState {
+        VkImageLayout layout{ VK_IMAGE_LAYOUT_UNDEFINED };
+        VkPipelineStageFlags write_stages{ 0 };
+        VkAccessFlags write_access{ 0 };
+        VkPipelineStageFlags read_stages{ 0 };
+        // Stages and access types the last write has been made visible to.
+        VkPipelineStageFlags visible_stages{ 0 };
+        VkAccessFlags visible_access{ 0 };
+    };
+
+    struct Physical {
+        VkImage image{};
+        VkImageView view{};
+        VkBuffer buffer{};
+        VkMemoryRequirements reqs{};
+        AllocationKind kind{ eLinearResource };
+        VkDeviceSize offset{ 0 };
+        // Placed in its own allocation when no shared heap fits it.
+        Allocation own{};
+        // Other physical resources sharing some of its memory.
+        std::vector<uint32_t> aliases{};
+        SyncState state{};
+    };
+
+    struct PhysicalSet {
+        std::vector<Physical> resources{};
+        Allocation heaps[eMaxAllocationKind]{};
+        VkDeviceSize bytes{ 0 };
+        VkDeviceSize unaliased_bytes{ 0 };
+        uint64_t retire_at{ 0 };
+    };
+
+    struct Framebuffer {
+        VkFramebuffer framebuffer{};
+        uint64_t last_used{ 0 };
+    };
+
+    struct Barriers {
+        VkPipelineStageFlags src_stages{ 0 };
+        VkPipelineStageFlags dst_stages{ 0 };
+        VkMemoryBarrier memory{};
+        std::vector<VkImageMemoryBarrier> images{};
+    };
+
+    void Cull(std::vector<uint32_t>& alive);
+    std::string Serialize() const;
+    void BuildPhysical();
+    void DestroyPhysical(PhysicalSet& set);
+    void RetireOld();
+
+    void Transition(RenderResource resource, SyncState& state, VkPipelineStageFlags stages,
+        VkAccessFlags access, VkImageLayout layout, bool write, Barriers& barriers);
+    void FlushBarriers(VkCommandBuffer command_buffer, Barriers& barriers);
+    void MergeUses(const Pass& pass, std::vector<Use>& uses) const;
+    SyncState& GetState(RenderResource resource);
+    void BeginRaster(const Pass& pass, const std::vector<Use>& uses, RenderPassContext& context);
+    // Final transitions of imported resources, then clears the description.
+    void Finish(VkCommandBuffer command_buffer);
+    VkRenderPass GetRenderPass(const std::vector<VkAttachmentDescription>& attachments,
+        uint32_t color_count, bool has_depth);
+
+    VkImage GetImage(RenderResource resource) const;
+    VkImageView GetImageView(RenderResource resource) const;
+    VkBuffer GetBuffer(RenderResource resource) const;
+
+    VkDevice device_{};
+    MemoryAllocator* allocator_{ nullptr };
+    GpuProfiler* profiler_{ nullptr };
+    uint32_t frame_count_{ 1 };
+    uint64_t executions_{ 0 };
+
+    std::vector<Pass> passes_{};
+    std::vector<Resource> resources_{};
+    std::vector<SyncState> imported_states_{};
+    // Scope of the pass Execute() left open, UINT32_MAX without a profiler.
+    bool open_{ false };
+    uint32_t open_scope_{ UINT32_MAX };
+
+    std::string physical_key_{};
+    PhysicalSet physical_{};
+    std::vector<PhysicalSet> retired_{};
+
+    std::unordered_map<std::string, VkRenderPass> render_passes_{};
+    std::unordered_map<std::string, Framebuffer> framebuffers_{};
+    std::vector<std::pair<VkFramebuffer, uint64_t>> retired_framebuffers_{};
+
+    RenderGraphStats stats_{};
+};
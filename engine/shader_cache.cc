@@ -0,0 +1,86 @@
+#include "shader_cache.h"
+#include "mapped_file.h"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+static const uint32_t kSpirvMagic = 0x07230203;
+
+static uint64_t HashWords(const uint32_t* words, size_t count) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < count; ++i) {
+		hash ^= words[i];
+		hash *= 1099511628211ull;
+	}
+	return hash ^ count;
+}
+
+void ShaderModuleCache::Create(VkDevice device) {
+	device_ = device;
+}
+
+void ShaderModuleCache::Destroy() {
+	for (auto& pair : modules_) {
+		vkDestroyShaderModule(device_, pair.second.module, nullptr);
+	}
+	modules_.clear();
+	paths_.clear();
+}
+
+bool ShaderModuleCache::ValidateSpirv(const uint32_t* code, size_t size) {
+	// Header is magic, version, generator, bound and schema.
+	if (size < 5 * sizeof(uint32_t) || size % sizeof(uint32_t) != 0) return false;
+	if (code[0] != kSpirvMagic) return false;
+	uint32_t major = (code[1] >> 16) & 0xFF;
+	uint32_t minor = (code[1] >> 8) & 0xFF;
+	return major == 1 && minor <= 6;
+}
+
+VkShaderModule ShaderModuleCache::Load(const std::string& path) {
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		auto it = paths_.find(path);
+		if (it != paths_.end()) return it->second;
+	}
+
+	MappedFile file;
+	if (!file.Open(path.c_str())) {
+		std::cerr << "shader: cannot open " << path << std::endl;
+		return VK_NULL_HANDLE;
+	}
+	const uint32_t* code = (const uint32_t*)file.GetData();
+	if (!ValidateSpirv(code, file.GetSize())) {
+		std::cerr << "shader: " << path << " is not valid SPIR-V" << std::endl;
+		return VK_NULL_HANDLE;
+	}
+
+	VkShaderModule module = Get(code, file.GetSize());
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	paths_[path] = module;
+	return module;
+}
+
+VkShaderModule ShaderModuleCache::Get(const uint32_t* code, size_t size) {
+	if (!ValidateSpirv(code, size)) return VK_NULL_HANDLE;
+	size_t count = size / sizeof(uint32_t);
+	uint64_t hash = HashWords(code, count);
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	auto range = modules_.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		const auto& cached = it->second.code;
+		if (cached.size() == count && memcmp(cached.data(), code, size) == 0) return it->second.module;
+	}
+
+	VkShaderModuleCreateInfo moduleInfo = {};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = size;
+	moduleInfo.pCode = code;
+
+	VkShaderModule module = VK_NULL_HANDLE;
+	auto res = vkCreateShaderModule(device_, &moduleInfo, nullptr, &module);
+	assert(VK_SUCCESS == res);
+	modules_.emplace(hash, Module{ std::vector<uint32_t>(code, code + count), module });
+	return module;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Creates each VkShaderModule once per distinct SPIR-V content and shares it
+// between every pipeline that asks for it. Modules live until Destroy().
+class ShaderModuleCache {
+public:
+    void Create(VkDevice device);
+    void Destroy();
+
+    // Maps the file and feeds it to the driver without copying, returns
+    // VK_NULL_HANDLE when it is missing or not valid SPIR-V.
+    VkShaderModule Load(const std::string& path);
+    // size in bytes, code must be 4 byte aligned.
+    VkShaderModule Get(const uint32_t* code, size_t size);
+
+    static bool ValidateSpirv(const uint32_t* code, size_t size);
+
+private:
+    struct Module {
+        // Compared on a hash hit so a collision cannot hand out another
+        // shader's module.
+        std::vector<uint32_t> code{};
+        VkShaderModule module{};
+    };
+
+    VkDevice device_{};
+    std::unordered_map<std::string, VkShaderModule> paths_{};
+    std::unordered_multimap<uint64_t, Module> modules_{};
+    std::mutex mutex_{};
+};
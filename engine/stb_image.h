@@ -398,6 +398,14 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+// as above, but shrinks the image by 'scale' (1, 2, 4 or 8) on each axis,
+// rounding the size up. JPEGs are decoded at the reduced size with smaller
+// IDCTs; other formats are decoded in full and box-filtered.
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+#endif
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
@@ -456,9 +464,42 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 // on most compilers (and ALL modern mainstream compilers) this is threadsafe
 STBIDEF const char *stbi_failure_reason  (void);
 
-// free the loaded image -- this is just free()
+// free the loaded image -- this is just free(), or nothing for arena memory
 STBIDEF void     stbi_image_free      (void *retval_from_stbi_load);
 
+// a block of caller memory that decoding draws from instead of the heap, so
+// loaders on many threads don't contend in malloc. set it on a thread, load,
+// release the results on that same thread (or don't), then reset it for the
+// next image. allocations that don't fit spill to STBI_MALLOC and are counted
+// in 'overflow', a hint for how much bigger the block should be.
+typedef struct
+{
+   unsigned char *base;
+   size_t size;
+   size_t used;
+   size_t last;     // offset of the newest allocation, which can grow in place
+   size_t overflow; // bytes that went to the heap since the last reset
+   unsigned char *output;
+   size_t output_size;
+   int output_used;
+} stbi_arena;
+
+STBIDEF void stbi_arena_init (stbi_arena *arena, void *memory, size_t size);
+STBIDEF void stbi_arena_reset(stbi_arena *arena);
+
+// optional block for the decoded image itself, e.g. mapped upload memory,
+// cleared by the next reset. 'size' is the image in bytes, the block needs
+// one more since the jpeg loader allocates a spare byte. the first
+// allocation of that size is placed there, which is the returned image
+// whenever the loader writes req_comp channels out directly. compare the
+// result against 'memory': if it differs the image landed elsewhere and
+// still has to be copied.
+STBIDEF void stbi_arena_set_output(stbi_arena *arena, void *memory, size_t size);
+
+// applies to the calling thread only, NULL goes back to the heap. like
+// stbi_set_flip_vertically_on_load_thread, needs thread-local support.
+STBIDEF void stbi_set_arena_thread(stbi_arena *arena);
+
 // get image dimensions & components without fully decoding
 STBIDEF int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
@@ -491,6 +532,20 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 // calling it will fail to link if your compiler doesn't
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// swap red and blue in 3- and 4-channel results, so req_comp=4 yields BGRA
+// ready for a B8G8R8A8 surface. the JPEG decoder writes BGR directly,
+// other formats are swizzled after decoding.
+STBIDEF void stbi_set_bgr_on_load(int flag_true_if_should_bgr);
+STBIDEF void stbi_set_bgr_on_load_thread(int flag_true_if_should_bgr);
+
+// lets the JPEG decoder split baseline scans at their restart markers and
+// decode the segments concurrently. func must call task(task_data, i) for
+// every i in [0,count), possibly from several threads at once, and return
+// once all of them have finished. only images decoded from memory are split;
+// NULL (the default) decodes serially.
+typedef void stbi_parallel_for_func(void *user, int count, void (*task)(void *task_data, int index), void *task_data);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *func, void *user);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -741,6 +796,42 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 is only used by the JPEG decoder and is detected at runtime, so the
+// kernels are compiled for it per function rather than for the whole file.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG) && \
+    ((defined(_MSC_VER) && _MSC_VER >= 1700) || (defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))))
+#define STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info,1);
+   // OSXSAVE and AVX, then check the OS saves the ymm registers
+   if ((info[2] & (3 << 27)) != (3 << 27)) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info,7,0);
+   return (info[1] >> 5) & 1;
+}
+#else
+#include <cpuid.h>
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+static int stbi__avx2_available(void)
+{
+   unsigned int a,b,c,d,lo,hi;
+   if (!__get_cpuid(1,&a,&b,&c,&d)) return 0;
+   if ((c & (3u << 27)) != (3u << 27)) return 0;
+   __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+   if ((lo & 6) != 6) return 0;
+   if (__get_cpuid_max(0,0) < 7) return 0;
+   __cpuid_count(7,0,a,b,c,d);
+   return (b >> 5) & 1;
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -781,6 +872,8 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   int scale_shift; // requested downscale, 1 << scale_shift per axis
 } stbi__context;
 
 
@@ -794,6 +887,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->scale_shift = 0;
 }
 
 // initialize a callback-based context
@@ -805,6 +899,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->scale_shift = 0;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
 }
@@ -867,6 +962,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int scale_shift; // downscale the loader already applied
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -945,9 +1041,123 @@ static int stbi__err(const char *str)
 }
 #endif
 
+STBIDEF void stbi_arena_init(stbi_arena *arena, void *memory, size_t size)
+{
+   arena->base = (unsigned char *) memory;
+   arena->size = size;
+   stbi_arena_reset(arena);
+}
+
+STBIDEF void stbi_arena_reset(stbi_arena *arena)
+{
+   arena->used = 0;
+   arena->last = 0;
+   arena->overflow = 0;
+   arena->output = NULL;
+   arena->output_size = 0;
+   arena->output_used = 0;
+}
+
+STBIDEF void stbi_arena_set_output(stbi_arena *arena, void *memory, size_t size)
+{
+   arena->output = (unsigned char *) memory;
+   arena->output_size = size;
+   arena->output_used = 0;
+}
+
+#define STBI__ARENA_ALIGN  16 // enough for the SIMD paths
+
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL stbi_arena *stbi__arena;
+
+STBIDEF void stbi_set_arena_thread(stbi_arena *arena)
+{
+   stbi__arena = arena;
+}
+
+static int stbi__in_arena(void *p)
+{
+   stbi_arena *a = stbi__arena;
+   return a && (unsigned char *) p >= a->base && (unsigned char *) p < a->base + a->size;
+}
+
+static int stbi__in_output(void *p)
+{
+   stbi_arena *a = stbi__arena;
+   return a && a->output && (unsigned char *) p == a->output;
+}
+
+static void *stbi__arena_alloc(size_t size)
+{
+   stbi_arena *a = stbi__arena;
+   size_t need = (size + STBI__ARENA_ALIGN-1) & ~(size_t) (STBI__ARENA_ALIGN-1);
+   if (a->output && !a->output_used && (size == a->output_size || size == a->output_size + 1)) {
+      a->output_used = 1;
+      return a->output;
+   }
+   if (need >= size && a->size - a->used >= need) {
+      a->last = a->used;
+      a->used += need;
+      return a->base + a->last;
+   }
+   a->overflow += size;
+   return NULL;
+}
+#endif
+
 static void *stbi__malloc(size_t size)
 {
-    return STBI_MALLOC(size);
+#ifdef STBI_THREAD_LOCAL
+   if (stbi__arena) {
+      void *p = stbi__arena_alloc(size);
+      if (p) return p;
+   }
+#endif
+   return STBI_MALLOC(size);
+}
+
+static void stbi__free(void *p)
+{
+#ifdef STBI_THREAD_LOCAL
+   if (stbi__in_output(p)) return; // owned by the caller
+   if (stbi__in_arena(p)) {
+      // only the newest allocation can be handed back before a reset
+      stbi_arena *a = stbi__arena;
+      if ((unsigned char *) p == a->base + a->last)
+         a->last = a->used = (unsigned char *) p - a->base;
+      return;
+   }
+#endif
+   STBI_FREE(p);
+}
+
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+#ifdef STBI_THREAD_LOCAL
+   if (stbi__in_output(p)) {
+      // can't grow, move out and leave the block to the caller
+      void *q = stbi__malloc(newsz);
+      if (q) memcpy(q, p, oldsz < newsz ? oldsz : newsz);
+      return q;
+   }
+   if (stbi__in_arena(p)) {
+      stbi_arena *a = stbi__arena;
+      void *q;
+      if ((unsigned char *) p == a->base + a->last) {
+         size_t need = (newsz + STBI__ARENA_ALIGN-1) & ~(size_t) (STBI__ARENA_ALIGN-1);
+         if (need >= newsz && a->size - a->last >= need) {
+            a->used = a->last + need;
+            return p;
+         }
+      }
+      q = stbi__malloc(newsz);
+      if (q) memcpy(q, p, oldsz < newsz ? oldsz : newsz);
+      return q;
+   }
+   if (p == NULL) return stbi__malloc(newsz);
+#endif
+   STBI_NOTUSED(oldsz);
+   return STBI_REALLOC_SIZED(p, oldsz, newsz);
 }
 
 // stb_image uses ints pervasively, including for offset calculations.
@@ -1046,7 +1256,7 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
-   STBI_FREE(retval_from_stbi_load);
+   stbi__free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_LINEAR
@@ -1080,11 +1290,43 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+static int stbi__bgr_on_load_global = 0;
+
+STBIDEF void stbi_set_bgr_on_load(int flag_true_if_should_bgr)
+{
+   stbi__bgr_on_load_global = flag_true_if_should_bgr;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__bgr_on_load  stbi__bgr_on_load_global
+#else
+static STBI_THREAD_LOCAL int stbi__bgr_on_load_local, stbi__bgr_on_load_set;
+
+STBIDEF void stbi_set_bgr_on_load_thread(int flag_true_if_should_bgr)
+{
+   stbi__bgr_on_load_local = flag_true_if_should_bgr;
+   stbi__bgr_on_load_set = 1;
+}
+
+#define stbi__bgr_on_load  (stbi__bgr_on_load_set         \
+                             ? stbi__bgr_on_load_local    \
+                             : stbi__bgr_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
+static stbi_parallel_for_func *stbi__parallel_for = NULL;
+static void *stbi__parallel_for_user = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *func, void *user)
+{
+   stbi__parallel_for = func;
+   stbi__parallel_for_user = user;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
-   ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
+   ri->channel_order = STBI_ORDER_RGB; // loaders that honor stbi__bgr_on_load themselves report STBI_ORDER_BGR
    ri->num_channels = 0;
 
    #ifndef STBI_NO_JPEG
@@ -1139,7 +1381,7 @@ static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
@@ -1155,7 +1397,7 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
@@ -1183,6 +1425,54 @@ static void stbi__vertical_flip(void *image, int w, int h, int bytes_per_pixel)
    }
 }
 
+// swaps the first and third channel of every pixel in place
+static void stbi__swap_red_blue(void *image, int w, int h, int channels, int bytes_per_channel)
+{
+   size_t i, count = (size_t)w * h;
+   size_t stride = (size_t)channels * bytes_per_channel;
+   stbi_uc *p = (stbi_uc *)image;
+   stbi_uc temp[4];
+
+   if (channels < 3) return;
+   for (i = 0; i < count; ++i, p += stride) {
+      memcpy(temp, p, bytes_per_channel);
+      memcpy(p, p + 2*bytes_per_channel, bytes_per_channel);
+      memcpy(p + 2*bytes_per_channel, temp, bytes_per_channel);
+   }
+}
+
+// box-filters the image down by 1 << shift on each axis, rounding the size up
+static stbi_uc *stbi__downsample(stbi_uc *orig, int *x, int *y, int channels, int shift)
+{
+   int w = (*x + (1 << shift) - 1) >> shift;
+   int h = (*y + (1 << shift) - 1) >> shift;
+   int i,j,k,xx,yy;
+   stbi_uc *out = (stbi_uc *) stbi__malloc_mad3(w, h, channels, 0);
+   if (out == NULL) {
+      stbi__free(orig);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
+
+   for (j=0; j < h; ++j) {
+      int y0 = j << shift, y1 = y0 + (1 << shift) < *y ? y0 + (1 << shift) : *y;
+      for (i=0; i < w; ++i) {
+         int x0 = i << shift, x1 = x0 + (1 << shift) < *x ? x0 + (1 << shift) : *x;
+         unsigned int n = (x1 - x0) * (y1 - y0);
+         for (k=0; k < channels; ++k) {
+            unsigned int sum = 0;
+            for (yy=y0; yy < y1; ++yy)
+               for (xx=x0; xx < x1; ++xx)
+                  sum += orig[((size_t) yy * *x + xx) * channels + k];
+            out[((size_t) j * w + i) * channels + k] = (stbi_uc) ((sum + n/2) / n);
+         }
+      }
+   }
+   stbi__free(orig);
+   *x = w;
+   *y = h;
+   return out;
+}
+
 #ifndef STBI_NO_GIF
 static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int bytes_per_pixel)
 {
@@ -1215,6 +1505,14 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
+   if (s->scale_shift > ri.scale_shift) {
+      result = stbi__downsample((stbi_uc *) result, x, y, req_comp ? req_comp : *comp, s->scale_shift);
+      if (result == NULL) return NULL;
+   }
+
+   if (stbi__bgr_on_load && ri.channel_order != STBI_ORDER_BGR)
+      stbi__swap_red_blue(result, *x, *y, req_comp ? req_comp : *comp, sizeof(stbi_uc));
+
    if (stbi__vertically_flip_on_load) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
@@ -1242,6 +1540,9 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
+   if (stbi__bgr_on_load && ri.channel_order != STBI_ORDER_BGR)
+      stbi__swap_red_blue(result, *x, *y, req_comp ? req_comp : *comp, sizeof(stbi__uint16));
+
    if (stbi__vertically_flip_on_load) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
@@ -1253,6 +1554,8 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
 #if !defined(STBI_NO_HDR) && !defined(STBI_NO_LINEAR)
 static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
 {
+   if (stbi__bgr_on_load && result != NULL)
+      stbi__swap_red_blue(result, *x, *y, req_comp ? req_comp : *comp, sizeof(float));
    if (stbi__vertically_flip_on_load && result != NULL) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
@@ -1380,6 +1683,45 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+static int stbi__scale_shift(int scale)
+{
+   switch (scale) {
+      case 1: return 0;
+      case 2: return 1;
+      case 4: return 2;
+      case 8: return 3;
+      default: return -1;
+   }
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   int shift = stbi__scale_shift(scale);
+   if (shift < 0) return stbi__errpuc("bad scale", "Scale must be 1, 2, 4 or 8");
+   stbi__start_mem(&s,buffer,len);
+   s.scale_shift = shift;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   FILE *f;
+   unsigned char *result;
+   stbi__context s;
+   int shift = stbi__scale_shift(scale);
+   if (shift < 0) return stbi__errpuc("bad scale", "Scale must be 1, 2, 4 or 8");
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.scale_shift = shift;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+#endif
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1701,7 +2043,7 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
@@ -1726,12 +2068,12 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
          STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
          STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
          STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+         default: STBI_ASSERT(0); stbi__free(data); stbi__free(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
       }
       #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1758,7 +2100,7 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
@@ -1783,12 +2125,12 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
          STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
          STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
          STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+         default: STBI_ASSERT(0); stbi__free(data); stbi__free(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
       }
       #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1800,7 +2142,7 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
    float *output;
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1813,7 +2155,7 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
          output[i*comp + n] = data[i*comp + n]/255.0f;
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1826,7 +2168,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
    stbi_uc *output;
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1843,7 +2185,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1929,13 +2271,15 @@ typedef struct
    int            jfif;
    int            app14_color_transform; // Adobe APP14 tag
    int            rgb;
+   int            bgr; // write B,G,R instead of R,G,B
+   int            idct_size; // edge of a decoded block, 8 unless scaled
 
    int scan_n, order[4];
    int restart_interval, todo;
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
-   void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+   void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step, int bgr);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
 
@@ -2630,6 +2974,179 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// same arithmetic as stbi__idct_simd, so still bit-identical to the generic
+// C version. rows stay 8x16-bit in xmm registers, the 32-bit intermediates
+// of a whole row fit one ymm register instead of an _l/_h pair.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   // interleave x/y into one register: low half elems 0..3, high half 4..7
+   #define dct_zip(out, x,y) \
+      __m256i out = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), _mm_unpackhi_epi16((x),(y)), 1)
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      dct_zip(c0##xy, x,y); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
+
+   // 32-bit to 16-bit with signed saturation, same as _mm_packs_epi32 per half
+   #define dct_pack(x) \
+      _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256((x), 1))
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         __m256i sum = _mm256_add_epi32(abiased, b); \
+         __m256i dif = _mm256_sub_epi32(abiased, b); \
+         out0 = dct_pack(_mm256_srai_epi32(sum, s)); \
+         out1 = dct_pack(_mm256_srai_epi32(dif, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         __m256i x0 = _mm256_add_epi32(t0e, t3e); \
+         __m256i x3 = _mm256_sub_epi32(t0e, t3e); \
+         __m256i x1 = _mm256_add_epi32(t1e, t2e); \
+         __m256i x2 = _mm256_sub_epi32(t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         __m256i x4 = _mm256_add_epi32(y0o, y4o); \
+         __m256i x5 = _mm256_add_epi32(y1o, y5o); \
+         __m256i x6 = _mm256_add_epi32(y2o, y5o); \
+         __m256i x7 = _mm256_add_epi32(y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_zip
+#undef dct_rot
+#undef dct_widen
+#undef dct_pack
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2872,67 +3389,202 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+// number of MCUs in the current scan; a non-interleaved scan has one per block
+static int stbi__jpeg_mcu_count(stbi__jpeg *z)
 {
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode baseline MCUs [first,last) of the current scan
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int last)
+{
+   int m;
+   STBI_SIMD_ALIGN(short, data[64]);
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int ha = z->img_comp[n].ha;
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      int i = first % w, j = first / w;
+      for (m=first; m < last; ++m) {
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*z->idct_size, z->img_comp[n].w2, data);
+         if (++i == w) { i = 0; ++j; }
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
+      }
+   } else { // interleaved
+      int i = first % z->img_mcu_x, j = first / z->img_mcu_x;
+      int k,x,y;
+      for (m=first; m < last; ++m) {
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*z->idct_size;
+                  int y2 = (j*z->img_comp[n].v + y)*z->idct_size;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
                }
             }
          }
-         return 1;
+         if (++i == z->img_mcu_x) { i = 0; ++j; }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
+         }
       }
+   }
+   return 1;
+}
+
+// parallel decoding of restart intervals
+//
+// every restart marker resets the huffman bit buffer and the DC predictors,
+// so the entropy-coded data between two markers decodes on its own into a
+// disjoint set of MCUs. the markers are found with a quick byte scan, then
+// groups of segments are handed to stbi__parallel_for, each with a private
+// copy of the decoder state.
+
+#ifndef STBI_JPEG_PARALLEL_MIN_PIXELS
+#define STBI_JPEG_PARALLEL_MIN_PIXELS  (1 << 18)   // smaller images aren't worth the dispatch
+#endif
+#define STBI__JPEG_MAX_TASKS           64
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **segments; // start of each segment, plus the end of the scan
+   int segment_count;
+   int segments_per_task;
+   int mcu_count;
+   int *ok;
+} stbi__jpeg_parallel;
+
+// finds the segment starts of the scan at the current read position. fails
+// unless there are exactly 'expected' segments with markers in sequence.
+static int stbi__jpeg_find_segments(stbi__jpeg *z, int expected, stbi_uc **segments, stbi_uc **scan_end)
+{
+   stbi_uc *p = z->s->img_buffer, *end = z->s->img_buffer_end;
+   int count = 0;
+   segments[count++] = p;
+   *scan_end = end;
+   while (p < end) {
+      p = (stbi_uc *) memchr(p, 0xff, (size_t) (end - p));
+      if (p == NULL) break;
+      ++p;
+      while (p < end && *p == 0xff) ++p; // fill bytes
+      if (p == end) break;
+      if (*p == 0) { ++p; continue; } // stuffed zero
+      if (!STBI__RESTART(*p)) {
+         // any other marker ends the scan; leave its last 0xff to be read
+         *scan_end = p - 1;
+         break;
+      }
+      if (count == expected || *p != 0xd0 + ((count-1) & 7)) return 0;
+      segments[count++] = ++p;
+   }
+   return count == expected;
+}
+
+static void stbi__jpeg_decode_segments(void *task_data, int index)
+{
+   stbi__jpeg_parallel *p = (stbi__jpeg_parallel *) task_data;
+   int first = index * p->segments_per_task;
+   int last = first + p->segments_per_task < p->segment_count ? first + p->segments_per_task : p->segment_count;
+   int ri = p->z->restart_interval;
+   int k, ok = 1;
+   stbi__context s = *p->z->s;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (z == NULL) { p->ok[index] = 0; return; }
+
+   memcpy(z, p->z, sizeof(stbi__jpeg));
+   z->s = &s;
+   for (k=first; k < last && ok; ++k) {
+      // the segment includes its trailing restart marker, as in a serial decode
+      s.img_buffer = p->segments[k];
+      s.img_buffer_end = p->segments[k+1];
+      stbi__jpeg_reset(z);
+      ok = stbi__jpeg_decode_mcus(z, k*ri, k+1 < p->segment_count ? (k+1)*ri : p->mcu_count);
+   }
+   stbi__free(z);
+   p->ok[index] = ok;
+}
+
+// returns 0 if the scan has to be decoded serially, else 1 with the decode
+// status in *result
+static int stbi__jpeg_decode_parallel(stbi__jpeg *z, int *result)
+{
+   stbi__jpeg_parallel p;
+   stbi_uc *scan_end;
+   int i, task_count;
+
+   if (stbi__parallel_for == NULL || z->restart_interval == 0 || z->s->read_from_callbacks) return 0;
+   if ((double) z->s->img_x * z->s->img_y < STBI_JPEG_PARALLEL_MIN_PIXELS) return 0;
+
+   p.z = z;
+   p.mcu_count = stbi__jpeg_mcu_count(z);
+   p.segment_count = (p.mcu_count + z->restart_interval - 1) / z->restart_interval;
+   if (p.segment_count < 2) return 0;
+
+   p.segments = (stbi_uc **) stbi__malloc_mad2(p.segment_count + 1, sizeof(stbi_uc *), 0);
+   if (p.segments == NULL) return 0;
+   if (!stbi__jpeg_find_segments(z, p.segment_count, p.segments, &scan_end)) {
+      stbi__free(p.segments);
+      return 0;
+   }
+   p.segments[p.segment_count] = scan_end;
+
+   // several segments per task keeps the per-task decoder copy negligible
+   p.segments_per_task = (p.segment_count + STBI__JPEG_MAX_TASKS - 1) / STBI__JPEG_MAX_TASKS;
+   task_count = (p.segment_count + p.segments_per_task - 1) / p.segments_per_task;
+   p.ok = (int *) stbi__malloc_mad2(task_count, sizeof(int), 0);
+   if (p.ok == NULL) {
+      stbi__free(p.segments);
+      return 0;
+   }
+
+   stbi__parallel_for(stbi__parallel_for_user, task_count, stbi__jpeg_decode_segments, &p);
+
+   *result = 1;
+   for (i=0; i < task_count; ++i)
+      if (!p.ok[i]) *result = stbi__err("bad huffman code","Corrupt JPEG");
+   stbi__free(p.ok);
+   stbi__free(p.segments);
+
+   // continue after the scan as if it had been decoded serially
+   z->s->img_buffer = scan_end;
+   z->marker = STBI__MARKER_none;
+   return 1;
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   stbi__jpeg_reset(z);
+   if (!z->progressive) {
+      int result;
+      if (stbi__jpeg_decode_parallel(z, &result)) return result;
+      return stbi__jpeg_decode_mcus(z, 0, stbi__jpeg_mcu_count(z));
    } else {
       if (z->scan_n == 1) {
          int i,j;
@@ -3015,7 +3667,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+(z->img_comp[n].w2*j+i)*z->idct_size, z->img_comp[n].w2, data);
             }
          }
       }
@@ -3169,17 +3821,17 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
@@ -3247,8 +3899,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // scaled decoding shrinks every block, and with it the planes
+      z->img_comp[i].w2 = (z->img_mcu_x * z->img_comp[i].h * 8) >> s->scale_shift;
+      z->img_comp[i].h2 = (z->img_mcu_y * z->img_comp[i].v * 8) >> s->scale_shift;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3258,10 +3911,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 64, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3542,6 +4194,72 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // same filter as stbi__resample_row_hv_2_simd, 16 pixels at a time
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+      // byte shifts stay within 128-bit lanes, so carry the element that
+      // crosses the lane boundary over with a lane permute.
+      __m256i lo_up = _mm256_permute2x128_si256(curr, curr, 0x08); // [0, curr.lo]
+      __m256i hi_dn = _mm256_permute2x128_si256(curr, curr, 0x81); // [curr.hi, 0]
+      __m256i prv0  = _mm256_alignr_epi8(curr, lo_up, 14);
+      __m256i nxt0  = _mm256_alignr_epi8(hi_dn, curr, 2);
+      __m256i prev  = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next  = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // per-lane interleave and pack leaves the 32 outputs in order
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -3556,9 +4274,9 @@ static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_
 // this is a reduced-precision calculation of YCbCr-to-RGB introduced
 // to make sure the code produces the same results in both SIMD and scalar
 #define stbi__float2fixed(x)  (((int) ((x) * 4096.0f + 0.5f)) << 8)
-static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step)
+static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step, int bgr)
 {
-   int i;
+   int i, ro = bgr ? 2 : 0, bo = 2 - ro;
    for (i=0; i < count; ++i) {
       int y_fixed = (y[i] << 20) + (1<<19); // rounding
       int r,g,b;
@@ -3573,18 +4291,18 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
       if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
       if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
-      out[0] = (stbi_uc)r;
+      out[ro] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
-      out[2] = (stbi_uc)b;
+      out[bo] = (stbi_uc)b;
       out[3] = 255;
       out += step;
    }
 }
 
 #if defined(STBI_SSE2) || defined(STBI_NEON)
-static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step, int bgr)
 {
-   int i = 0;
+   int i = 0, ro = bgr ? 2 : 0, bo = 2 - ro;
 
 #ifdef STBI_SSE2
    // step == 3 is pretty ugly on the final interleave, and i'm not convinced
@@ -3630,7 +4348,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
          __m128i gw = _mm_srai_epi16(gws, 4);
 
          // back to byte, set up for transpose
-         __m128i brb = _mm_packus_epi16(rw, bw);
+         __m128i brb = bgr ? _mm_packus_epi16(bw, rw) : _mm_packus_epi16(rw, bw);
          __m128i gxb = _mm_packus_epi16(gw, xw);
 
          // transpose to interleave channels
@@ -3681,9 +4399,9 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 
          // undo scaling, round, convert to byte
          uint8x8x4_t o;
-         o.val[0] = vqrshrun_n_s16(rws, 4);
-         o.val[1] = vqrshrun_n_s16(gws, 4);
-         o.val[2] = vqrshrun_n_s16(bws, 4);
+         o.val[ro] = vqrshrun_n_s16(rws, 4);
+         o.val[1]  = vqrshrun_n_s16(gws, 4);
+         o.val[bo] = vqrshrun_n_s16(bws, 4);
          o.val[3] = vdup_n_u8(255);
 
          // store, interleaving r/g/b/a
@@ -3707,15 +4425,143 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
       if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
       if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
-      out[0] = (stbi_uc)r;
+      out[ro] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
-      out[2] = (stbi_uc)b;
+      out[bo] = (stbi_uc)b;
       out[3] = 255;
       out += step;
    }
 }
 #endif
 
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step, int bgr)
+{
+   // same fixed-point math as the SSE2 path, 16 pixels at a time
+   int i = 0;
+
+   if (step == 4) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // load
+         __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // widen to short with the byte in the high half, as the SSE2 unpack does
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = bgr ? _mm256_packus_epi16(bw, rw) : _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose within each lane, giving pixels 0-3|8-11 and 4-7|12-15
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+
+   if (i < count)
+      stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step, bgr);
+}
+#endif
+
+// reduced IDCTs for scaled decoding. each output sample is the average of
+// the samples it covers in the full 8x8 IDCT, taken straight from the
+// coefficients: row X of a table holds, for each frequency u, the mean of
+// its basis function over that sample's span, with the 1/sqrt(2) DC term
+// and half the 1/4 normalization folded in.
+static const float stbi__idct_mean4[4*8] =
+{
+   0.35355339f, 0.45306372f, 0.32664074f, 0.15909482f, 0.0f, -0.10630376f, -0.13529903f, -0.09011998f,
+   0.35355339f, 0.18766514f, -0.32664074f, -0.38408888f, 0.0f, 0.25663998f, 0.13529903f, -0.03732892f,
+   0.35355339f, -0.18766514f, -0.32664074f, 0.38408888f, 0.0f, -0.25663998f, 0.13529903f, 0.03732892f,
+   0.35355339f, -0.45306372f, 0.32664074f, -0.15909482f, 0.0f, 0.10630376f, -0.13529903f, 0.09011998f,
+};
+
+static const float stbi__idct_mean2[2*8] =
+{
+   0.35355339f, 0.32036443f, 0.0f, -0.11249703f, 0.0f, 0.07516811f, 0.0f, -0.06372445f,
+   0.35355339f, -0.32036443f, 0.0f, 0.11249703f, 0.0f, -0.07516811f, 0.0f, 0.06372445f,
+};
+
+stbi_inline static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], const float *mean, int n)
+{
+   float tmp[4][8];
+   int u,v,x,y;
+
+   // columns
+   for (y=0; y < n; ++y) {
+      for (u=0; u < 8; ++u) {
+         float sum = 0.0f;
+         for (v=0; v < 8; ++v)
+            sum += mean[y*8+v] * data[v*8+u];
+         tmp[y][u] = sum;
+      }
+   }
+   // rows, adding the level shift and rounding
+   for (y=0; y < n; ++y, out += out_stride) {
+      for (x=0; x < n; ++x) {
+         float sum = 128.5f;
+         for (u=0; u < 8; ++u)
+            sum += mean[x*8+u] * tmp[y][u];
+         out[x] = stbi__clamp((int) sum);
+      }
+   }
+}
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_mean4, 4);
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_mean2, 2);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   // the block mean is the DC term alone
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
@@ -3731,11 +4577,24 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->idct_size = 8 >> j->s->scale_shift;
+   if (j->idct_size == 4) j->idct_block_kernel = stbi__idct_block_4x4;
+   if (j->idct_size == 2) j->idct_block_kernel = stbi__idct_block_2x2;
+   if (j->idct_size == 1) j->idct_block_kernel = stbi__idct_block_1x1;
 }
 
 // clean up the temporary component buffers
@@ -3763,7 +4622,7 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
 
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
-   int n, decode_n, is_rgb;
+   int n, decode_n, is_rgb, ro, bo;
    z->s->img_n = 0; // make stbi__cleanup_jpeg safe
 
    // validate req_comp
@@ -3772,6 +4631,17 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // the planes were decoded at the reduced size, shrink the image to match
+   if (z->s->scale_shift) {
+      int c, shift = z->s->scale_shift, round = (1 << shift) - 1;
+      z->s->img_x = (z->s->img_x + round) >> shift;
+      z->s->img_y = (z->s->img_y + round) >> shift;
+      for (c=0; c < z->s->img_n; ++c) {
+         z->img_comp[c].x = (z->img_comp[c].x + round) >> shift;
+         z->img_comp[c].y = (z->img_comp[c].y + round) >> shift;
+      }
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3782,6 +4652,10 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    else
       decode_n = z->s->img_n;
 
+   // offsets of red and blue in each output pixel
+   ro = z->bgr ? 2 : 0;
+   bo = 2 - ro;
+
    // resample and color-convert
    {
       int k;
@@ -3839,27 +4713,27 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             if (z->s->img_n == 3) {
                if (is_rgb) {
                   for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
+                     out[ro] = y[i];
                      out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
+                     out[bo] = coutput[2][i];
                      out[3] = 255;
                      out += n;
                   }
                } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n, z->bgr);
                }
             } else if (z->s->img_n == 4) {
                if (z->app14_color_transform == 0) { // CMYK
                   for (i=0; i < z->s->img_x; ++i) {
                      stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                     out[ro] = stbi__blinn_8x8(coutput[0][i], m);
                      out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                     out[bo] = stbi__blinn_8x8(coutput[2][i], m);
                      out[3] = 255;
                      out += n;
                   }
                } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n, z->bgr);
                   for (i=0; i < z->s->img_x; ++i) {
                      stbi_uc m = coutput[3][i];
                      out[0] = stbi__blinn_8x8(255 - out[0], m);
@@ -3868,7 +4742,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
                      out += n;
                   }
                } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n, z->bgr);
                }
             } else
                for (i=0; i < z->s->img_x; ++i) {
@@ -3924,11 +4798,13 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
 {
    unsigned char* result;
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
+   j->bgr = stbi__bgr_on_load;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   if (result && j->bgr) ri->channel_order = STBI_ORDER_BGR;
+   if (result) ri->scale_shift = s->scale_shift;
+   stbi__free(j);
    return result;
 }
 
@@ -3940,7 +4816,7 @@ static int stbi__jpeg_test(stbi__context *s)
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__free(j);
    return r;
 }
 
@@ -3962,7 +4838,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
    return result;
 }
 #endif
@@ -4159,7 +5035,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4395,7 +5271,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4416,7 +5292,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4443,7 +5319,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4771,7 +5647,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
          if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+            stbi__free(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
@@ -4782,7 +5658,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4871,7 +5747,7 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
+   stbi__free(a->out);
    a->out = temp_out;
 
    STBI_NOTUSED(len);
@@ -5041,7 +5917,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__realloc_sized(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -5059,7 +5935,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
             z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
+            stbi__free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
@@ -5085,7 +5961,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__free(z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5138,9 +6014,9 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__free(p->expanded); p->expanded = NULL;
+   stbi__free(p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -5417,7 +6293,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5429,7 +6305,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
@@ -5486,13 +6362,13 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
          if (easy) {
@@ -5760,7 +6636,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       if ( tga_indexed)
       {
          if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("bad palette", "Corrupt TGA");
          }
 
@@ -5769,7 +6645,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5780,8 +6656,8 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
@@ -5862,7 +6738,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
@@ -6054,7 +6930,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6345,7 +7221,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6458,13 +7334,13 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
@@ -6793,11 +7669,11 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized( out, out_size, layers * stride );
                if (NULL == tmp) {
-                  STBI_FREE(g.out);
-                  STBI_FREE(g.history);
-                  STBI_FREE(g.background);
+                  stbi__free(g.out);
+                  stbi__free(g.history);
+                  stbi__free(g.background);
                   return stbi__errpuc("outofmem", "Out of memory");
                }
                else {
@@ -6806,7 +7682,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  *delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  *delays = (int*) stbi__realloc_sized( *delays, delays_size, sizeof(int) * layers );
                   delays_size = layers * sizeof(int);
                }
             } else {
@@ -6829,9 +7705,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g.out);
+      stbi__free(g.history);
+      stbi__free(g.background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
@@ -6863,12 +7739,12 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
          u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(g.out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g.history);
+   stbi__free(g.background);
 
    return u;
 }
@@ -7041,16 +7917,16 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data, rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
             scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
@@ -7064,12 +7940,12 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = value;
                } else {
                   // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
                   for (z = 0; z < count; ++z)
                      scanline[i++ * 4 + k] = stbi__get8(s);
                }
@@ -7079,7 +7955,7 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
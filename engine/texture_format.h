@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+
+// Cooked texture container written by tools/TextureCooker.cpp:
+//
+//   CookedTextureHeader
+//   CookedMipLevel[mip_levels]
+//   payload, every level at a 16 byte aligned offset
+//
+// Levels are stored in the exact layout vkCmdCopyBufferToImage expects, so
+// loading is one memcpy of the payload into staging.
+
+static const uint32_t kCookedTextureMagic = 0x58544256; // 'VBTX'
+static const uint32_t kCookedTextureVersion = 1;
+
+enum CookedFormat : uint32_t {
+    eCookedRGBA8,
+    eCookedBC1,
+    eCookedBC3,
+    eCookedBC7,
+};
+
+enum CookedFlags : uint32_t {
+    eCookedSrgb = 1u << 0,
+};
+
+struct CookedTextureHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t flags;
+    uint32_t width;
+    uint32_t height;
+    uint32_t mip_levels;
+    uint32_t reserved;
+    // Offset of the payload from the start of the file.
+    uint64_t data_offset;
+    uint64_t data_size;
+};
+
+struct CookedMipLevel {
+    // Relative to data_offset.
+    uint64_t offset;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Bytes per 4x4 block, or per pixel for eCookedRGBA8.
+inline uint32_t GetCookedBlockBytes(uint32_t format) {
+    switch (format) {
+    case eCookedBC1: return 8;
+    case eCookedBC3: return 16;
+    case eCookedBC7: return 16;
+    default: return 4;
+    }
+}
+
+inline bool IsCookedCompressed(uint32_t format) {
+    return format != eCookedRGBA8;
+}
+
+inline uint64_t GetCookedLevelSize(uint32_t format, uint32_t width, uint32_t height) {
+    if (!IsCookedCompressed(format)) return (uint64_t)width * height * 4;
+    return (uint64_t)((width + 3) / 4) * ((height + 3) / 4) * GetCookedBlockBytes(format);
+}
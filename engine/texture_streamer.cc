@@ -0,0 +1,579 @@
+#include "texture_streamer.h"
+#include "cpu_profiler.h"
+#include "engine.h"
+#include "job_system.h"
+#include "stb_image.h"
+#include "texture_format.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+// Lets stb_image decode restart intervals of large JPEGs on the pool.
+static void StbiParallelFor(void* user, int count, void (*task)(void* task_data, int index), void* task_data) {
+	static_cast<JobSystem*>(user)->ParallelFor((uint32_t)count, [=](uint32_t index) { task(task_data, (int)index); });
+}
+
+// Per-worker scratch for stb_image. It grows to what the largest decode so
+// far needed, so steady-state loads stay off the shared heap.
+struct DecodeArena {
+	std::unique_ptr<uint8_t[]> memory{};
+	stbi_arena arena{};
+};
+static constexpr size_t kMaxDecodeArena = 256u << 20;
+
+static DecodeArena& BeginDecode() {
+	static thread_local DecodeArena scratch;
+	stbi_set_arena_thread(&scratch.arena);
+	return scratch;
+}
+
+static void EndDecode(DecodeArena& scratch) {
+	stbi_set_arena_thread(nullptr);
+	size_t wanted = std::min(scratch.arena.size + scratch.arena.overflow, kMaxDecodeArena);
+	if (wanted > scratch.arena.size) {
+		scratch.memory.reset(new uint8_t[wanted]);
+		stbi_arena_init(&scratch.arena, scratch.memory.get(), wanted);
+	}
+	stbi_arena_reset(&scratch.arena);
+}
+
+void TextureStreamer::Create(JobSystem* jobs) {
+	device_ = GetEngine().GetDevice();
+	jobs_ = jobs;
+	stbi_set_parallel_for(&StbiParallelFor, jobs_);
+
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = GetEngine().GetQueueFamily(eTransfer);
+	auto res = vkCreateCommandPool(device_, &poolInfo, nullptr, &transfer_pool_);
+	assert(VK_SUCCESS == res);
+
+	poolInfo.queueFamilyIndex = GetEngine().GetQueueFamily(eGraphics);
+	res = vkCreateCommandPool(device_, &poolInfo, nullptr, &graphics_pool_);
+	assert(VK_SUCCESS == res);
+}
+
+void TextureStreamer::Destroy() {
+	{
+		std::unique_lock<std::mutex> lock{ mutex_ };
+		idle_.wait(lock, [this] { return decoding_ == 0; });
+	}
+	stbi_set_parallel_for(nullptr, nullptr);
+	RetireBatches(true);
+	RetireTextures(true);
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	for (auto& job : decoded_) {
+		DestroyStaging(*job);
+	}
+	decoded_.clear();
+	waiting_.clear();
+	finished_.clear();
+	for (auto& handle : textures_) {
+		DestroyTexture(handle->texture);
+		handle->state.store(eTextureFailed, std::memory_order_release);
+	}
+	textures_.clear();
+	bytes_in_flight_ = 0;
+	resident_bytes_ = 0;
+
+	vkDestroyCommandPool(device_, graphics_pool_, nullptr);
+	vkDestroyCommandPool(device_, transfer_pool_, nullptr);
+}
+
+TextureHandle TextureStreamer::Load(const std::string& path, Callback on_ready) {
+	auto job = std::make_unique<Job>();
+	job->handle = std::make_shared<TextureRequest>();
+	job->handle->path = path;
+	job->on_ready = std::move(on_ready);
+	TextureHandle handle = job->handle;
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	textures_.push_back(handle);
+	Dispatch(std::move(job), &TextureStreamer::Probe);
+	return handle;
+}
+
+void TextureStreamer::Dispatch(std::unique_ptr<Job> job, void (TextureStreamer::*step)(std::unique_ptr<Job>)) {
+	// std::function needs a copyable callable, so the job travels as a raw
+	// pointer.
+	++decoding_;
+	Job* raw = job.release();
+	jobs_->Run([this, raw, step] { (this->*step)(std::unique_ptr<Job>(raw)); });
+}
+
+bool TextureStreamer::Admit(VkDeviceSize bytes) {
+	if (bytes_in_flight_ > 0 && bytes_in_flight_ + bytes > budget) return false;
+	VkDeviceSize committed = resident_bytes_ + bytes_in_flight_;
+	if (resident_budget > 0 && committed > 0 && committed + bytes > resident_budget) return false;
+	bytes_in_flight_ += bytes;
+	return true;
+}
+
+void TextureStreamer::Release(const TextureHandle& handle) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	auto it = std::find(textures_.begin(), textures_.end(), handle);
+	if (it == textures_.end()) return;
+	*it = std::move(textures_.back());
+	textures_.pop_back();
+
+	// Pending loads are picked up again in Update().
+	handle->released = true;
+	if (handle->IsReady()) {
+		retired_.push_back({ handle->texture, GetEngine().GetFrameNumber() });
+		handle->texture = Texture{};
+		handle->state.store(eTextureFailed, std::memory_order_release);
+	}
+}
+
+void TextureStreamer::RetireTextures(bool all) {
+	uint64_t completed = GetEngine().GetCompletedFrames();
+	VkDeviceSize freed = 0;
+	for (size_t i = 0; i < retired_.size();) {
+		if (!all && retired_[i].frame >= completed) {
+			++i;
+			continue;
+		}
+		freed += retired_[i].texture.memory.size;
+		DestroyTexture(retired_[i].texture);
+		retired_[i] = retired_.back();
+		retired_.pop_back();
+	}
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	resident_bytes_ -= freed;
+}
+
+static bool IsCookedPath(const std::string& path) {
+	static const char kExtension[] = ".vbtx";
+	const size_t length = sizeof(kExtension) - 1;
+	return path.size() >= length && path.compare(path.size() - length, length, kExtension) == 0;
+}
+
+static VkFormat GetCookedVkFormat(uint32_t format, bool srgb) {
+	switch (format) {
+	case eCookedBC1: return srgb ? VK_FORMAT_BC1_RGBA_SRGB_BLOCK : VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+	case eCookedBC3: return srgb ? VK_FORMAT_BC3_SRGB_BLOCK : VK_FORMAT_BC3_UNORM_BLOCK;
+	case eCookedBC7: return srgb ? VK_FORMAT_BC7_SRGB_BLOCK : VK_FORMAT_BC7_UNORM_BLOCK;
+	default: return srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+	}
+}
+
+void TextureStreamer::Probe(std::unique_ptr<Job> job) {
+	PROFILE_SCOPE("Probe texture");
+	// Only the header is read here, the budget is known before any pixel
+	// memory is touched.
+	if (!job->file.Open(job->handle->path.c_str())) {
+		Finish(std::move(job), eTextureFailed);
+		return;
+	}
+	if (IsCookedPath(job->handle->path)) {
+		if (!ProbeCooked(*job)) {
+			Finish(std::move(job), eTextureFailed);
+			return;
+		}
+	} else {
+		int width, height, components;
+		if (job->file.GetSize() > INT_MAX ||
+			!stbi_info_from_memory(job->file.GetData(), (int)job->file.GetSize(), &width, &height, &components)) {
+			Finish(std::move(job), eTextureFailed);
+			return;
+		}
+		job->bytes = (VkDeviceSize)width * height * 4;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		// Parked jobs keep their place, later ones must not overtake them.
+		if (!waiting_.empty() || !Admit(job->bytes)) {
+			waiting_.push_back(std::move(job));
+			--decoding_;
+			idle_.notify_all();
+			return;
+		}
+	}
+	Decode(std::move(job));
+}
+
+bool TextureStreamer::ProbeCooked(Job& job) {
+	const uint8_t* data = job.file.GetData();
+	size_t size = job.file.GetSize();
+	if (size < sizeof(CookedTextureHeader)) return false;
+
+	const auto* header = (const CookedTextureHeader*)data;
+	if (header->magic != kCookedTextureMagic || header->version != kCookedTextureVersion ||
+		header->format > eCookedBC7 || header->width == 0 || header->height == 0) {
+		return false;
+	}
+	// No more levels than the full chain down to 1x1.
+	uint32_t maxLevels = 1;
+	while (maxLevels < 32 && (std::max(header->width, header->height) >> maxLevels) > 0) ++maxLevels;
+	if (header->mip_levels == 0 || header->mip_levels > maxLevels) return false;
+
+	uint64_t tableEnd = sizeof(CookedTextureHeader) + sizeof(CookedMipLevel) * (uint64_t)header->mip_levels;
+	if (tableEnd > header->data_offset || header->data_offset > size ||
+		header->data_size > size - header->data_offset) {
+		return false;
+	}
+
+	// Every level must have the extent of its place in the chain and the
+	// bytes to fill it, otherwise its copy would read past the level or
+	// the staging buffer, or write outside the image.
+	const auto* levels = (const CookedMipLevel*)(data + sizeof(CookedTextureHeader));
+	for (uint32_t i = 0; i < header->mip_levels; ++i) {
+		const CookedMipLevel& level = levels[i];
+		if (level.width != std::max(1u, header->width >> i) || level.height != std::max(1u, header->height >> i)) {
+			return false;
+		}
+		if (level.size < GetCookedLevelSize(header->format, level.width, level.height)) return false;
+		// Copy offsets must be multiples of the block size.
+		if (level.offset % 16 != 0 || level.offset > header->data_size ||
+			level.size > header->data_size - level.offset) {
+			return false;
+		}
+	}
+	if (IsCookedCompressed(header->format) && !GetEngine().enabled_features.textureCompressionBC) {
+		std::cerr << "texture: " << job.handle->path << " is block compressed, the gpu has no BC support" << std::endl;
+		return false;
+	}
+	job.bytes = header->data_size;
+	return true;
+}
+
+void TextureStreamer::DecodeCooked(Job& job) {
+	const uint8_t* data = job.file.GetData();
+	const auto* header = (const CookedTextureHeader*)data;
+	const auto* levels = (const CookedMipLevel*)(data + sizeof(CookedTextureHeader));
+
+	// Already in the layout the copy wants.
+	CreateStaging(job, header->data_size);
+	memcpy(job.staging_memory.mapped, data + header->data_offset, (size_t)header->data_size);
+
+	CreateImage(job, header->width, header->height,
+		GetCookedVkFormat(header->format, (header->flags & eCookedSrgb) != 0), header->mip_levels);
+	for (uint32_t i = 0; i < header->mip_levels; ++i) {
+		VkBufferImageCopy region = {};
+		region.bufferOffset = levels[i].offset;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = i;
+		region.imageSubresource.layerCount = 1;
+		region.imageExtent = { levels[i].width, levels[i].height, 1 };
+		job.regions.push_back(region);
+	}
+}
+
+void TextureStreamer::Decode(std::unique_ptr<Job> job) {
+	PROFILE_SCOPE("Decode texture");
+	if (IsCookedPath(job->handle->path)) {
+		DecodeCooked(*job);
+	} else {
+		// Probe already knows the decoded size, so the image itself goes
+		// straight into staging and only the intermediates use the arena.
+		VkDeviceSize size = job->bytes;
+		CreateStaging(*job, size + 1);
+		uint8_t* staging = job->staging_memory.mapped;
+
+		int width, height, components;
+		DecodeArena& scratch = BeginDecode();
+		stbi_arena_set_output(&scratch.arena, staging, (size_t)size);
+		stbi_uc* pixels = stbi_load_from_memory(job->file.GetData(), (int)job->file.GetSize(),
+			&width, &height, &components, 4);
+		if (!pixels || (VkDeviceSize)width * height * 4 != size) {
+			stbi_image_free(pixels);
+			EndDecode(scratch);
+			DestroyStaging(*job);
+			Finish(std::move(job), eTextureFailed);
+			return;
+		}
+		// Loaders that convert channels in a separate pass end up elsewhere.
+		if (pixels != staging) {
+			memcpy(staging, pixels, (size_t)size);
+			stbi_image_free(pixels);
+		}
+		EndDecode(scratch);
+
+		CreateImage(*job, (uint32_t)width, (uint32_t)height, VK_FORMAT_R8G8B8A8_SRGB, 1);
+		VkBufferImageCopy region = {};
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.layerCount = 1;
+		region.imageExtent = { (uint32_t)width, (uint32_t)height, 1 };
+		job->regions.push_back(region);
+	}
+	job->file.Close();
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	decoded_.push_back(std::move(job));
+	--decoding_;
+	idle_.notify_all();
+}
+
+void TextureStreamer::CreateStaging(Job& job, VkDeviceSize size) {
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	auto res = vkCreateBuffer(device_, &bufferInfo, nullptr, &job.staging);
+	assert(VK_SUCCESS == res);
+
+	// Every implementation has a host-visible coherent type, which saves
+	// flushing from worker threads. Decoders read back rows they wrote, so
+	// prefer memory that is not write-combined.
+	AllocationInfo allocInfo{};
+	allocInfo.required = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	allocInfo.preferred = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+	auto pass = GetEngine().GetAllocator().AllocateForBuffer(job.staging, allocInfo, job.staging_memory);
+	assert(pass);
+}
+
+void TextureStreamer::DestroyStaging(Job& job) {
+	vkDestroyBuffer(device_, job.staging, nullptr);
+	GetEngine().GetAllocator().Free(job.staging_memory);
+	job.staging = VK_NULL_HANDLE;
+}
+
+void TextureStreamer::CreateImage(Job& job, uint32_t width, uint32_t height, VkFormat format, uint32_t mip_levels) {
+	Texture& texture = job.handle->texture;
+	texture.format = format;
+	texture.extent = { width, height };
+	texture.mip_levels = mip_levels;
+
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = format;
+	imageInfo.extent = { width, height, 1 };
+	imageInfo.mipLevels = mip_levels;
+	imageInfo.arrayLayers = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	auto res = vkCreateImage(device_, &imageInfo, nullptr, &texture.image);
+	assert(VK_SUCCESS == res);
+
+	AllocationInfo allocInfo{};
+	allocInfo.kind = eOptimalImage;
+	auto pass = GetEngine().GetAllocator().AllocateForImage(texture.image, allocInfo, texture.memory);
+	assert(pass);
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = texture.image;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = mip_levels;
+	viewInfo.subresourceRange.layerCount = 1;
+	res = vkCreateImageView(device_, &viewInfo, nullptr, &texture.view);
+	assert(VK_SUCCESS == res);
+}
+
+void TextureStreamer::DestroyTexture(Texture& texture) {
+	vkDestroyImageView(device_, texture.view, nullptr);
+	vkDestroyImage(device_, texture.image, nullptr);
+	GetEngine().GetAllocator().Free(texture.memory);
+	texture = Texture{};
+}
+
+void TextureStreamer::Finish(std::unique_ptr<Job> job, TextureState state) {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	// Failures happen on the pool, successes after the upload retired.
+	if (state == eTextureFailed) {
+		--decoding_;
+		idle_.notify_all();
+	}
+	bytes_in_flight_ -= job->bytes;
+	job->bytes = 0;
+	job->result = state;
+	finished_.push_back(std::move(job));
+}
+
+void TextureStreamer::SubmitBatch(std::vector<std::unique_ptr<Job>> jobs) {
+	Engine& engine = GetEngine();
+	bool ownership = engine.NeedsOwnershipTransfer(eTransfer, eGraphics);
+
+	Batch batch;
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = transfer_pool_;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	auto res = vkAllocateCommandBuffers(device_, &allocInfo, &batch.transfer_cmd);
+	assert(VK_SUCCESS == res);
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	res = vkBeginCommandBuffer(batch.transfer_cmd, &beginInfo);
+	assert(VK_SUCCESS == res);
+
+	QueueTransfer transfer{};
+	transfer.src = eTransfer;
+	transfer.dst = eGraphics;
+	transfer.src_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	transfer.src_access = VK_ACCESS_TRANSFER_WRITE_BIT;
+	transfer.dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	transfer.dst_access = VK_ACCESS_SHADER_READ_BIT;
+
+	for (auto& job : jobs) {
+		const Texture& texture = job->handle->texture;
+		VkImageSubresourceRange range = {};
+		range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		range.levelCount = texture.mip_levels;
+		range.layerCount = 1;
+
+		VkImageMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = texture.image;
+		barrier.subresourceRange = range;
+		vkCmdPipelineBarrier(batch.transfer_cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		vkCmdCopyBufferToImage(batch.transfer_cmd, job->staging, texture.image,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)job->regions.size(), job->regions.data());
+
+		engine.ReleaseImage(batch.transfer_cmd, texture.image, range, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, transfer);
+	}
+	res = vkEndCommandBuffer(batch.transfer_cmd);
+	assert(VK_SUCCESS == res);
+
+	VkFenceCreateInfo fenceInfo = {};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	res = vkCreateFence(device_, &fenceInfo, nullptr, &batch.fence);
+	assert(VK_SUCCESS == res);
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.transfer_cmd;
+
+	if (!ownership) {
+		res = engine.QueueSubmit(eTransfer, 1, &submitInfo, batch.fence);
+		assert(VK_SUCCESS == res);
+	} else {
+		// The acquire half runs on the graphics queue once the copies are done.
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		res = vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &batch.semaphore);
+		assert(VK_SUCCESS == res);
+
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &batch.semaphore;
+		res = engine.QueueSubmit(eTransfer, 1, &submitInfo, VK_NULL_HANDLE);
+		assert(VK_SUCCESS == res);
+
+		allocInfo.commandPool = graphics_pool_;
+		res = vkAllocateCommandBuffers(device_, &allocInfo, &batch.acquire_cmd);
+		assert(VK_SUCCESS == res);
+		res = vkBeginCommandBuffer(batch.acquire_cmd, &beginInfo);
+		assert(VK_SUCCESS == res);
+		for (auto& job : jobs) {
+			const Texture& texture = job->handle->texture;
+			VkImageSubresourceRange range = {};
+			range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			range.levelCount = texture.mip_levels;
+			range.layerCount = 1;
+			engine.AcquireImage(batch.acquire_cmd, texture.image, range, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, transfer);
+		}
+		res = vkEndCommandBuffer(batch.acquire_cmd);
+		assert(VK_SUCCESS == res);
+
+		VkPipelineStageFlags waitStage = transfer.dst_stage;
+		VkSubmitInfo acquireInfo = {};
+		acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		acquireInfo.waitSemaphoreCount = 1;
+		acquireInfo.pWaitSemaphores = &batch.semaphore;
+		acquireInfo.pWaitDstStageMask = &waitStage;
+		acquireInfo.commandBufferCount = 1;
+		acquireInfo.pCommandBuffers = &batch.acquire_cmd;
+		res = engine.QueueSubmit(eGraphics, 1, &acquireInfo, batch.fence);
+		assert(VK_SUCCESS == res);
+	}
+
+	batch.jobs = std::move(jobs);
+	batches_.push_back(std::move(batch));
+}
+
+void TextureStreamer::RetireBatches(bool wait) {
+	for (size_t i = 0; i < batches_.size();) {
+		Batch& batch = batches_[i];
+		if (wait) {
+			vkWaitForFences(device_, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+		} else if (vkGetFenceStatus(device_, batch.fence) != VK_SUCCESS) {
+			++i;
+			continue;
+		}
+
+		vkFreeCommandBuffers(device_, transfer_pool_, 1, &batch.transfer_cmd);
+		if (batch.acquire_cmd) vkFreeCommandBuffers(device_, graphics_pool_, 1, &batch.acquire_cmd);
+		vkDestroySemaphore(device_, batch.semaphore, nullptr);
+		vkDestroyFence(device_, batch.fence, nullptr);
+		for (auto& job : batch.jobs) {
+			DestroyStaging(*job);
+			Finish(std::move(job), eTextureReady);
+		}
+		batches_.erase(batches_.begin() + i);
+	}
+}
+
+void TextureStreamer::Update() {
+	RetireBatches(false);
+	RetireTextures(false);
+
+	std::vector<std::unique_ptr<Job>> decoded;
+	std::vector<std::unique_ptr<Job>> finished;
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		decoded.swap(decoded_);
+		finished.swap(finished_);
+
+		// Budget returned by finished jobs lets parked ones go.
+		while (!waiting_.empty() && Admit(waiting_.front()->bytes)) {
+			auto job = std::move(waiting_.front());
+			waiting_.pop_front();
+			Dispatch(std::move(job), &TextureStreamer::Decode);
+		}
+	}
+
+	if (!decoded.empty()) SubmitBatch(std::move(decoded));
+
+	for (auto& job : finished) {
+		TextureRequest& request = *job->handle;
+		// Released while loading, nothing can have sampled it yet.
+		if (request.released) {
+			DestroyTexture(request.texture);
+			request.state.store(eTextureFailed, std::memory_order_release);
+			continue;
+		}
+		if (job->result == eTextureFailed) {
+			DestroyTexture(request.texture);
+		} else {
+			std::lock_guard<std::mutex> lock{ mutex_ };
+			resident_bytes_ += request.texture.memory.size;
+		}
+		request.state.store(job->result, std::memory_order_release);
+		if (job->on_ready) job->on_ready(job->handle);
+	}
+}
+
+VkDeviceSize TextureStreamer::GetResidentBytes() {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	return resident_bytes_;
+}
+
+uint32_t TextureStreamer::GetPendingCount() {
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	return decoding_ + (uint32_t)(waiting_.size() + decoded_.size() + finished_.size()) + (uint32_t)batches_.size();
+}
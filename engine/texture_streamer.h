@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "mapped_file.h"
+#include "memory_allocator.h"
+
+class JobSystem;
+
+struct Texture {
+    VkImage image{};
+    VkImageView view{};
+    Allocation memory{};
+    VkFormat format{ VK_FORMAT_UNDEFINED };
+    VkExtent2D extent{};
+    uint32_t mip_levels{ 1 };
+};
+
+enum TextureState : uint32_t {
+    eTexturePending,
+    eTextureReady,
+    eTextureFailed,
+};
+
+// Handed out immediately by TextureStreamer::Load(), texture becomes valid
+// once state reads eTextureReady. The image is in SHADER_READ_ONLY_OPTIMAL
+// and owned by the graphics queue family by then.
+struct TextureRequest {
+    std::string path{};
+    std::atomic<uint32_t> state{ eTexturePending };
+    Texture texture{};
+    // Set by TextureStreamer::Release(), render thread only.
+    bool released{ false };
+
+    bool IsReady() const { return state.load(std::memory_order_acquire) == eTextureReady; }
+    bool IsFailed() const { return state.load(std::memory_order_acquire) == eTextureFailed; }
+};
+using TextureHandle = std::shared_ptr<TextureRequest>;
+
+// Decodes images on the job system straight into mapped staging memory and
+// uploads them on the transfer queue. Cooked .vbtx files skip decoding, their
+// payload is copied as is. Work is admitted against a byte budget
+// so a level load cannot balloon cpu or staging memory; one image larger
+// than the budget still goes through on its own. Loaded textures stay
+// resident until Release().
+class TextureStreamer {
+public:
+    using Callback = std::function<void(const TextureHandle&)>;
+
+    void Create(JobSystem* jobs);
+    // Waits for outstanding work and destroys every texture it created.
+    void Destroy();
+
+    // on_ready runs on the render thread inside Update(), also on failure.
+    TextureHandle Load(const std::string& path, Callback on_ready = nullptr);
+
+    // Render thread. Destroys the texture once no frame in flight can still
+    // sample it, a load that is still pending is dropped when it finishes
+    // and its callback does not run. The handle reads eTextureFailed after.
+    void Release(const TextureHandle& handle);
+
+    // Render thread, once per frame: submits decoded images in one batch,
+    // retires finished batches and runs their callbacks.
+    void Update();
+
+    uint32_t GetPendingCount();
+    // Memory of loaded textures, including released ones the gpu may still use.
+    VkDeviceSize GetResidentBytes();
+
+    VkDeviceSize budget{ 64ull << 20 };
+    // Caps resident plus in flight bytes, 0 for no cap. Loads over it wait
+    // for Release() to give memory back.
+    VkDeviceSize resident_budget{ 0 };
+
+private:
+    struct Job {
+        TextureHandle handle{};
+        Callback on_ready{};
+        TextureState result{ eTexturePending };
+        // Budget held by the job, returned once it finishes.
+        VkDeviceSize bytes{ 0 };
+        VkBuffer staging{};
+        Allocation staging_memory{};
+        std::vector<VkBufferImageCopy> regions{};
+        // Source file, mapped between probing and decoding.
+        MappedFile file{};
+    };
+    struct Batch {
+        VkCommandBuffer transfer_cmd{};
+        VkCommandBuffer acquire_cmd{};
+        VkSemaphore semaphore{};
+        VkFence fence{};
+        std::vector<std::unique_ptr<Job>> jobs{};
+    };
+
+    void Probe(std::unique_ptr<Job> job);
+    void Decode(std::unique_ptr<Job> job);
+    bool ProbeCooked(Job& job);
+    void DecodeCooked(Job& job);
+    // Takes budget if it fits, mutex_ is held.
+    bool Admit(VkDeviceSize bytes);
+    void Dispatch(std::unique_ptr<Job> job, void (TextureStreamer::*step)(std::unique_ptr<Job>));
+    void CreateImage(Job& job, uint32_t width, uint32_t height, VkFormat format, uint32_t mip_levels);
+    void CreateStaging(Job& job, VkDeviceSize size);
+    void DestroyStaging(Job& job);
+    void Finish(std::unique_ptr<Job> job, TextureState state);
+    void SubmitBatch(std::vector<std::unique_ptr<Job>> jobs);
+    void RetireBatches(bool wait);
+    // Destroys released textures whose last frame has finished, or all.
+    void RetireTextures(bool all);
+    void DestroyTexture(Texture& texture);
+
+    VkDevice device_{};
+    JobSystem* jobs_{ nullptr };
+    VkCommandPool transfer_pool_{};
+    VkCommandPool graphics_pool_{};
+
+    std::mutex mutex_{};
+    std::condition_variable idle_{};
+    VkDeviceSize bytes_in_flight_{ 0 };
+    VkDeviceSize resident_bytes_{ 0 };
+    // Queued on the job system, not yet decoded or parked.
+    uint32_t decoding_{ 0 };
+    std::deque<std::unique_ptr<Job>> waiting_{};
+    std::vector<std::unique_ptr<Job>> decoded_{};
+    std::vector<std::unique_ptr<Job>> finished_{};
+    std::vector<TextureHandle> textures_{};
+
+    struct RetiredTexture {
+        Texture texture{};
+        // Engine frame number at Release().
+        uint64_t frame{ 0 };
+    };
+
+    // Render thread only.
+    std::vector<Batch> batches_{};
+    std::vector<RetiredTexture> retired_{};
+};
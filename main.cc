@@ -6,35 +6,128 @@
 
 #include <iostream>
 #include <vector>
-#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
+#include "engine/chrome_trace.h"
+#include "engine/cpu_profiler.h"
 #include "engine/engine.h"
+#include "engine/frame_pacer.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "engine/stb_image.h"
 
-constexpr int kTickPerFrame = 1000 / 60;
+void PrintPacerStats(const FramePacer& pacer)
+{
+	auto stats = pacer.GetStats();
+	std::cout << stats.frames << " frames, mean " << stats.mean_ms << " ms, p99 "
+		<< stats.p99_ms << " ms, max " << stats.max_ms << " ms, missed "
+		<< stats.missed << std::endl;
+}
 
-std::vector<char> ReadFile(const char * filename)
+// Cpu scopes of every thread next to the gpu scopes, written on exit.
+struct FrameTrace {
+	const char* path{ nullptr };
+	// Binary cpu capture, see tools/ProfileConvert.cpp.
+	const char* dump_path{ nullptr };
+	ChromeTrace trace{};
+
+	void Start()
+	{
+		if (!path && !dump_path) return;
+		PROFILE_THREAD("Main thread");
+		GetCpuProfiler().Start();
+		if (path) GetEngine().GetGpuProfiler().StartCapture();
+	}
+	void Finish()
+	{
+		if (!path && !dump_path) return;
+		auto& cpu = GetCpuProfiler();
+		cpu.Stop();
+		if (cpu.GetDroppedCount() > 0) {
+			std::cout << "profile: " << cpu.GetDroppedCount() << " scopes dropped" << std::endl;
+		}
+		if (dump_path && cpu.WriteBinary(dump_path)) {
+			std::cout << "profile written to " << dump_path << std::endl;
+		}
+		if (!path) return;
+		auto& gpu = GetEngine().GetGpuProfiler();
+		gpu.StopCapture();
+		cpu.ExportTrace(trace);
+		gpu.ExportTrace(trace);
+		if (trace.Write(path)) std::cout << "trace written to " << path << std::endl;
+	}
+};
+
+// Renders a fixed number of frames without a window and reports frame times.
+int RunHeadless(uint32_t frame_count, FrameTrace& trace)
 {
-    std::ifstream fs{};
-    fs.open(filename, std::ios::binary);
-    fs.seekg(0, fs.end);
-    uint32_t length = (uint32_t)fs.tellg();
-    fs.seekg(0, fs.beg);
-    std::vector<char> data(length);
-    fs.read(data.data(), length);
-    fs.close();
-    return data;
+	GetEngine().headless = true;
+	GetEngine().Create();
+	trace.Start();
+
+	FramePacer pacer{};
+	pacer.SetMode(FramePacer::eUncapped);
+	for (uint32_t i = 0; i < frame_count; ++i) {
+		PROFILE_SCOPE("Frame");
+		if (!GetEngine().BeginFrame()) break;
+		GetEngine().EndFrame();
+		pacer.Pace();
+	}
+	std::vector<uint8_t> pixels{};
+	GetEngine().ReadbackFrame(pixels);
+
+	PrintPacerStats(pacer);
+	trace.Finish();
+
+	GetEngine().Destroy();
+	return 0;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+	bool headless = false;
+	uint32_t frame_count = 600;
+	FrameTrace trace{};
+	FramePacer pacer{};
+	pacer.SetTargetRate(60.0);
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+		} else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			frame_count = (uint32_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+			GetEngine().frames_in_flight = std::max(atoi(argv[++i]), 1);
+		} else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			// A rate, 0 for uncapped, or vsync to let the present mode pace.
+			const char* rate = argv[++i];
+			if (strcmp(rate, "vsync") == 0) pacer.SetMode(FramePacer::eDisplaySynced);
+			else pacer.SetTargetRate(atof(rate));
+		} else if (strcmp(argv[i], "--max-queued-frames") == 0 && i + 1 < argc) {
+			GetEngine().max_queued_frames = std::max(atoi(argv[++i]), 0);
+		} else if (strcmp(argv[i], "--present") == 0 && i + 1 < argc) {
+			const char* policy = argv[++i];
+			if (strcmp(policy, "low-latency") == 0) GetEngine().present_policy = eLowLatency;
+			else if (strcmp(policy, "throughput") == 0) GetEngine().present_policy = eThroughput;
+			else GetEngine().present_policy = ePowerSave;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			// Chrome trace of the whole run, cpu and gpu scopes.
+			trace.path = argv[++i];
+		} else if (strcmp(argv[i], "--profile-dump") == 0 && i + 1 < argc) {
+			trace.dump_path = argv[++i];
+		}
+	}
+	if (headless) {
+		return RunHeadless(frame_count, trace);
+	}
+
     GetWindow().Create();
 	GetEngine().Create();
+	trace.Start();
 
 	bool is_dragged = false;
 	int delta_x = 0, delta_y = 0;
@@ -69,7 +162,10 @@ int main()
     // Poll for user input.
     bool is_running = true;
     while(is_running) {
-		uint32_t frame_begin_tick = SDL_GetTicks();
+		// Block on the gpu before polling so the input used for this frame
+		// is as fresh as possible when recording starts.
+		PROFILE_SCOPE("Frame");
+		bool has_frame = GetEngine().WaitFrame();
 
         SDL_Event event;
         while(SDL_PollEvent(&event)) {
@@ -91,6 +187,11 @@ int main()
 			case SDL_KEYDOWN:
 				onkey(event.key.keysym.sym, x, y, z);
 				break;
+			case SDL_WINDOWEVENT:
+				if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+					GetEngine().RequestResize();
+				}
+				break;
             default:
                 break;
             }
@@ -100,13 +201,14 @@ int main()
 			break;
 		}
 
-		uint32_t frame_end_tick = SDL_GetTicks();
-
-		int delta_tick = frame_end_tick - frame_begin_tick;
-		if (delta_tick < kTickPerFrame) {
-			SDL_Delay(kTickPerFrame - delta_tick);
+		if (has_frame && GetEngine().BeginFrame()) {
+			GetEngine().EndFrame();
 		}
+
+		pacer.Pace();
     }
+	PrintPacerStats(pacer);
+	trace.Finish();
 
 	GetEngine().Destroy();
 	GetWindow().Destroy();
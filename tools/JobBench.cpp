@@ -0,0 +1,134 @@
+// Microbenchmark for engine/job_system: spawn and wait overhead per job,
+// how often nested work gets stolen, and ParallelFor scaling from one
+// worker up to every core.
+//
+// JobBench [--threads N] [--jobs N]
+//
+// g++ -O2 -std=c++17 tools/JobBench.cpp engine/job_system.cc -lpthread
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../engine/job_system.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Fixed amount of arithmetic the compiler cannot drop.
+static float Work(uint32_t seed, uint32_t iterations) {
+	float x = (float)seed;
+	for (uint32_t i = 0; i < iterations; ++i) {
+		x = std::sqrt(x * 1.0001f + 1.0f);
+	}
+	return x;
+}
+
+static std::atomic<uint32_t> g_sink{ 0 };
+
+// Empty jobs from the main thread, so this is all scheduling cost.
+static double SpawnCost(JobSystem& jobs, uint32_t job_count) {
+	JobCounter counter{};
+	auto start = Clock::now();
+	for (uint32_t i = 0; i < job_count; ++i) {
+		jobs.Run([] {}, &counter);
+	}
+	jobs.Wait(counter);
+	return Seconds(start) * 1e9 / job_count;
+}
+
+// One job fans out into many from a worker, they land on its own deque
+// and the others have to steal them.
+static double NestedSpawn(JobSystem& jobs, uint32_t job_count, uint64_t& stolen) {
+	uint64_t before = jobs.GetStats().stolen;
+	JobCounter outer{};
+	auto start = Clock::now();
+	jobs.Run([&] {
+		JobCounter inner{};
+		for (uint32_t i = 0; i < job_count; ++i) {
+			jobs.Run([i] { g_sink += (uint32_t)Work(i, 200); }, &inner);
+		}
+		jobs.Wait(inner);
+	}, &outer);
+	jobs.Wait(outer);
+	double seconds = Seconds(start);
+	stolen = jobs.GetStats().stolen - before;
+	return seconds * 1e9 / job_count;
+}
+
+// Dependent chain of batches, each waits on the previous counter.
+static double Chain(JobSystem& jobs, uint32_t batches, uint32_t batch_size) {
+	std::vector<JobCounter> counters(batches);
+	auto start = Clock::now();
+	for (uint32_t b = 0; b < batches; ++b) {
+		JobCounter* dependency = b > 0 ? &counters[b - 1] : nullptr;
+		for (uint32_t i = 0; i < batch_size; ++i) {
+			jobs.Run([i] { g_sink += (uint32_t)Work(i, 100); }, &counters[b], dependency);
+		}
+	}
+	jobs.Wait(counters.back());
+	return Seconds(start) * 1e6;
+}
+
+static double ParallelForTime(JobSystem& jobs, uint32_t count) {
+	auto start = Clock::now();
+	jobs.ParallelFor(count, [](uint32_t index) { g_sink += (uint32_t)Work(index, 20000); });
+	return Seconds(start) * 1e3;
+}
+
+int main(int argc, char** argv) {
+	uint32_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+	uint32_t job_count = 100000;
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+			max_threads = std::max(1, atoi(argv[++i]));
+		} else if (0 == strcmp(argv[i], "--jobs") && i + 1 < argc) {
+			job_count = std::max(1, atoi(argv[++i]));
+		} else {
+			std::cerr << "usage: JobBench [--threads N] [--jobs N]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "threads  spawn ns/job  nested ns/job  stolen  chain us  parallel-for ms  speedup" << std::endl;
+	double base = 0.0;
+	for (uint32_t threads = 1; threads <= max_threads; ++threads) {
+		// The main thread takes part in Wait() and ParallelFor(), so N
+		// threads means N - 1 workers. One thread still needs a worker for
+		// the nested test to have someone to steal.
+		JobSystem jobs{};
+		jobs.Create(std::max(1u, threads - 1));
+
+		// Warm up thread start and allocator.
+		SpawnCost(jobs, 1000);
+
+		double spawn = SpawnCost(jobs, job_count);
+		uint64_t stolen = 0;
+		double nested = NestedSpawn(jobs, job_count / 10, stolen);
+		double chain = Chain(jobs, 64, 64);
+		double parallel = ParallelForTime(jobs, 256);
+		if (threads == 1) base = parallel;
+
+		std::cout << std::setw(7) << threads
+			<< std::setw(14) << spawn
+			<< std::setw(15) << nested
+			<< std::setw(8) << stolen
+			<< std::setw(10) << chain
+			<< std::setw(17) << parallel
+			<< std::setw(8) << std::setprecision(2) << base / parallel << std::setprecision(1)
+			<< std::endl;
+		jobs.Destroy();
+	}
+	return g_sink == 0xFFFFFFFFu ? 1 : 0;
+}
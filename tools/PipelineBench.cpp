@@ -0,0 +1,285 @@
+// Startup benchmark for the pipeline cache: compiles the same set of
+// pipeline state permutations through engine/pipeline_state_cache twice,
+// first into an empty VkPipelineCache and then into one created from the
+// data the first pass left behind, the way Engine::Create loads it from disk.
+//
+// PipelineBench [--threads N] [--runs N] [--shaders <dir>]
+//
+// Meant for a software driver, where compiles are slow and stable, e.g.
+// lavapipe by pointing VK_ICD_FILENAMES at its lvp_icd json. Also set
+// MESA_SHADER_CACHE_DISABLE=true, otherwise Mesa's own disk cache makes
+// every cold pass after the very first one warm as well.
+//
+// g++ -O2 -std=c++17 tools/PipelineBench.cpp engine/pipeline_state_cache.cc
+//     engine/shader_cache.cc engine/mapped_file.cc engine/job_system.cc
+//     -lvulkan -lpthread
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../engine/job_system.h"
+#include "../engine/pipeline_state_cache.h"
+#include "../engine/shader_cache.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Device {
+	VkInstance instance{};
+	VkPhysicalDevice gpu{};
+	VkDevice device{};
+	VkPhysicalDeviceProperties properties{};
+};
+
+static bool CreateDevice(Device& out) {
+	VkApplicationInfo appInfo = {};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.pApplicationName = "PipelineBench";
+	appInfo.apiVersion = VK_API_VERSION_1_0;
+
+	VkInstanceCreateInfo instanceInfo = {};
+	instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instanceInfo.pApplicationInfo = &appInfo;
+	if (vkCreateInstance(&instanceInfo, nullptr, &out.instance) != VK_SUCCESS) return false;
+
+	uint32_t gpu_count = 0;
+	vkEnumeratePhysicalDevices(out.instance, &gpu_count, nullptr);
+	if (gpu_count == 0) return false;
+	std::vector<VkPhysicalDevice> gpus(gpu_count);
+	vkEnumeratePhysicalDevices(out.instance, &gpu_count, gpus.data());
+	out.gpu = gpus[0];
+	vkGetPhysicalDeviceProperties(out.gpu, &out.properties);
+
+	uint32_t family_count = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(out.gpu, &family_count, nullptr);
+	std::vector<VkQueueFamilyProperties> families(family_count);
+	vkGetPhysicalDeviceQueueFamilyProperties(out.gpu, &family_count, families.data());
+	uint32_t family = 0;
+	while (family < family_count && !(families[family].queueFlags & VK_QUEUE_GRAPHICS_BIT)) ++family;
+	if (family == family_count) return false;
+
+	float priority = 1.0f;
+	VkDeviceQueueCreateInfo queueInfo = {};
+	queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	queueInfo.queueFamilyIndex = family;
+	queueInfo.queueCount = 1;
+	queueInfo.pQueuePriorities = &priority;
+
+	VkDeviceCreateInfo deviceInfo = {};
+	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	deviceInfo.queueCreateInfoCount = 1;
+	deviceInfo.pQueueCreateInfos = &queueInfo;
+	return vkCreateDevice(out.gpu, &deviceInfo, nullptr, &out.device) == VK_SUCCESS;
+}
+
+// Color and depth, like the engine's main pass.
+static VkRenderPass CreateRenderPass(VkDevice device) {
+	VkAttachmentDescription attachments[2] = {};
+	attachments[0].format = VK_FORMAT_R8G8B8A8_UNORM;
+	attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+	attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	attachments[1] = attachments[0];
+	attachments[1].format = VK_FORMAT_D32_SFLOAT;
+	attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	VkAttachmentReference color = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+	VkAttachmentReference depth = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 1;
+	subpass.pColorAttachments = &color;
+	subpass.pDepthStencilAttachment = &depth;
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = 2;
+	renderPassInfo.pAttachments = attachments;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+
+	VkRenderPass render_pass = VK_NULL_HANDLE;
+	vkCreateRenderPass(device, &renderPassInfo, nullptr, &render_pass);
+	return render_pass;
+}
+
+// The uniform buffer and texture resources/textured.* use.
+static void CreateLayout(VkDevice device, VkDescriptorSetLayout& set_layout, VkPipelineLayout& layout) {
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+	VkDescriptorSetLayoutCreateInfo setInfo = {};
+	setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setInfo.bindingCount = 2;
+	setInfo.pBindings = bindings;
+	vkCreateDescriptorSetLayout(device, &setInfo, nullptr, &set_layout);
+
+	VkPipelineLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &set_layout;
+	vkCreatePipelineLayout(device, &layoutInfo, nullptr, &layout);
+}
+
+// Every combination of the states materials tend to differ in, over both
+// shader pairs in resources/.
+static std::vector<PipelineState> BuildStates(ShaderModuleCache& shaders, const std::string& dir,
+	VkPipelineLayout layout, VkRenderPass render_pass) {
+	struct Shaders {
+		VkShaderModule vertex, fragment;
+		bool textured;
+	};
+	Shaders pairs[2] = {
+		{ shaders.Load(dir + "/shader.vert.spv"), shaders.Load(dir + "/shader.frag.spv"), false },
+		{ shaders.Load(dir + "/textured.vert.spv"), shaders.Load(dir + "/textured.frag.spv"), true },
+	};
+	const VkCullModeFlags culls[] = { VK_CULL_MODE_NONE, VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_FRONT_BIT };
+	const VkFrontFace faces[] = { VK_FRONT_FACE_COUNTER_CLOCKWISE, VK_FRONT_FACE_CLOCKWISE };
+	const VkPrimitiveTopology topologies[] = { VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP };
+
+	std::vector<PipelineState> states{};
+	for (const Shaders& pair : pairs) {
+		if (!pair.vertex || !pair.fragment) continue;
+		for (VkCullModeFlags cull : culls)
+		for (VkFrontFace face : faces)
+		for (VkPrimitiveTopology topology : topologies)
+		for (uint32_t depth = 0; depth < 3; ++depth)
+		for (uint32_t blend = 0; blend < 2; ++blend) {
+			PipelineState state{};
+			state.vertex_shader = pair.vertex;
+			state.fragment_shader = pair.fragment;
+			if (pair.textured) {
+				state.vertex_bindings = { { 0, 24, VK_VERTEX_INPUT_RATE_VERTEX } };
+				state.vertex_attributes = {
+					{ 0, 0, VK_FORMAT_R32G32B32A32_SFLOAT, 0 },
+					{ 1, 0, VK_FORMAT_R32G32_SFLOAT, 16 },
+				};
+			}
+			state.topology = topology;
+			state.cull_mode = cull;
+			state.front_face = face;
+			state.depth_test = depth > 0;
+			state.depth_write = depth > 1;
+			state.blend_enable = blend > 0;
+			state.layout = layout;
+			state.render_pass = render_pass;
+			states.push_back(state);
+		}
+	}
+	return states;
+}
+
+// Compiles every state on the job system and returns the milliseconds until
+// the last one is done. data is what the cache starts with and, afterwards,
+// what it ended up holding.
+static double CompileAll(VkDevice device, JobSystem& jobs, const std::vector<PipelineState>& states,
+	std::vector<uint8_t>& data) {
+	VkPipelineCacheCreateInfo cacheInfo = {};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = data.size();
+	cacheInfo.pInitialData = data.data();
+	VkPipelineCache cache = VK_NULL_HANDLE;
+	vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache);
+
+	auto start = Clock::now();
+	PipelineStateCache pipelines{};
+	pipelines.Create(device, cache, &jobs);
+	for (const PipelineState& state : states) {
+		pipelines.Prefetch(state);
+	}
+	for (const PipelineState& state : states) {
+		pipelines.GetBlocking(state);
+	}
+	double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	pipelines.Destroy();
+
+	size_t size = 0;
+	vkGetPipelineCacheData(device, cache, &size, nullptr);
+	data.resize(size);
+	vkGetPipelineCacheData(device, cache, &size, data.data());
+	vkDestroyPipelineCache(device, cache, nullptr);
+	return ms;
+}
+
+int main(int argc, char** argv) {
+	uint32_t threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+	uint32_t runs = 3;
+	std::string dir = "resources";
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = std::max(1, atoi(argv[++i]));
+		} else if (0 == strcmp(argv[i], "--runs") && i + 1 < argc) {
+			runs = std::max(1, atoi(argv[++i]));
+		} else if (0 == strcmp(argv[i], "--shaders") && i + 1 < argc) {
+			dir = argv[++i];
+		} else {
+			std::cerr << "usage: PipelineBench [--threads N] [--runs N] [--shaders <dir>]" << std::endl;
+			return 1;
+		}
+	}
+
+	Device gpu{};
+	if (!CreateDevice(gpu)) {
+		std::cerr << "no Vulkan device with a graphics queue" << std::endl;
+		return 1;
+	}
+	ShaderModuleCache shaders{};
+	shaders.Create(gpu.device);
+	VkRenderPass render_pass = CreateRenderPass(gpu.device);
+	VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+	VkPipelineLayout layout = VK_NULL_HANDLE;
+	CreateLayout(gpu.device, set_layout, layout);
+
+	std::vector<PipelineState> states = BuildStates(shaders, dir, layout, render_pass);
+	if (states.empty()) {
+		std::cerr << "no shaders in " << dir << std::endl;
+		return 1;
+	}
+
+	JobSystem jobs{};
+	jobs.Create(threads);
+	std::cout << gpu.properties.deviceName << ", " << states.size() << " pipelines on "
+		<< threads << " threads" << std::endl;
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "run  cold ms  warm ms  cache bytes  speedup" << std::endl;
+	double cold_total = 0.0, warm_total = 0.0;
+	for (uint32_t run = 0; run < runs; ++run) {
+		std::vector<uint8_t> data{};
+		double cold = CompileAll(gpu.device, jobs, states, data);
+		size_t bytes = data.size();
+		double warm = CompileAll(gpu.device, jobs, states, data);
+		cold_total += cold;
+		warm_total += warm;
+		std::cout << std::setw(3) << run << std::setw(9) << cold << std::setw(9) << warm
+			<< std::setw(13) << bytes << std::setw(8) << cold / warm << "x" << std::endl;
+	}
+	std::cout << "mean" << std::setw(8) << cold_total / runs << std::setw(9) << warm_total / runs
+		<< std::setw(21) << cold_total / warm_total << "x" << std::endl;
+
+	jobs.Destroy();
+	vkDestroyPipelineLayout(gpu.device, layout, nullptr);
+	vkDestroyDescriptorSetLayout(gpu.device, set_layout, nullptr);
+	vkDestroyRenderPass(gpu.device, render_pass, nullptr);
+	shaders.Destroy();
+	vkDestroyDevice(gpu.device, nullptr);
+	vkDestroyInstance(gpu.instance, nullptr);
+	return 0;
+}
@@ -0,0 +1,118 @@
+// Converts a binary cpu profile dump (engine/profile_format.h) into a Chrome
+// trace for chrome://tracing or Perfetto, optionally with a per-scope
+// summary.
+//
+// ProfileConvert <input> <output.json> [--summary]
+//
+// g++ -O2 -std=c++17 tools/ProfileConvert.cpp engine/chrome_trace.cc
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../engine/chrome_trace.h"
+#include "../engine/profile_format.h"
+
+struct ScopeSummary {
+	uint64_t count = 0;
+	double total_ms = 0.0;
+	double max_ms = 0.0;
+};
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cerr << "usage: ProfileConvert <input> <output.json> [--summary]" << std::endl;
+		return 1;
+	}
+	bool summary = argc > 3 && 0 == strcmp(argv[3], "--summary");
+
+	std::ifstream file{ argv[1], std::ios::binary };
+	if (!file) {
+		std::cerr << "cannot read " << argv[1] << std::endl;
+		return 1;
+	}
+	std::vector<uint8_t> data{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+
+	ProfileHeader header{};
+	if (data.size() < sizeof(header)) {
+		std::cerr << argv[1] << ": truncated header" << std::endl;
+		return 1;
+	}
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != kProfileMagic || header.version != kProfileVersion) {
+		std::cerr << argv[1] << ": not a version " << kProfileVersion << " profile" << std::endl;
+		return 1;
+	}
+
+	const uint8_t* cursor = data.data() + sizeof(header);
+	const uint8_t* end = data.data() + data.size();
+	auto fail = [&]() {
+		std::cerr << argv[1] << ": corrupt at byte " << (cursor - data.data()) << std::endl;
+		return 1;
+	};
+
+	std::vector<std::string> strings(header.string_count);
+	for (auto& text : strings) {
+		uint64_t length = 0;
+		if (!ReadProfileVarint(cursor, end, length) || length > (uint64_t)(end - cursor)) return fail();
+		text.assign((const char*)cursor, (size_t)length);
+		cursor += length;
+	}
+	auto string_at = [&](uint64_t index) -> const std::string* {
+		return index < strings.size() ? &strings[index] : nullptr;
+	};
+
+	ChromeTrace trace{};
+	std::map<std::string, ScopeSummary> scopes{};
+	uint64_t event_total = 0;
+	for (uint32_t thread = 0; thread < header.thread_count; ++thread) {
+		uint64_t name = 0, count = 0;
+		if (!ReadProfileVarint(cursor, end, name) || !string_at(name)) return fail();
+		if (!ReadProfileVarint(cursor, end, count)) return fail();
+		trace.SetTrackName(thread, string_at(name)->c_str());
+
+		uint64_t begin = header.origin_ticks;
+		for (uint64_t i = 0; i < count; ++i) {
+			uint64_t scope = 0, delta = 0, duration = 0;
+			if (!ReadProfileVarint(cursor, end, scope) || !string_at(scope)) return fail();
+			if (!ReadProfileVarint(cursor, end, delta) || !ReadProfileVarint(cursor, end, duration)) return fail();
+			begin += delta;
+
+			int64_t begin_ns = header.origin_ns + (int64_t)((begin - header.origin_ticks) * header.ns_per_tick);
+			int64_t duration_ns = (int64_t)(duration * header.ns_per_tick);
+			trace.AddEvent(string_at(scope)->c_str(), thread, begin_ns, duration_ns);
+
+			ScopeSummary& entry = scopes[*string_at(scope)];
+			entry.count++;
+			entry.total_ms += duration_ns * 1e-6;
+			entry.max_ms = std::max(entry.max_ms, duration_ns * 1e-6);
+		}
+		event_total += count;
+	}
+	if (!trace.Write(argv[2])) return 1;
+
+	std::cout << argv[2] << ": " << event_total << " events on " << header.thread_count << " threads, "
+		<< (data.size() - sizeof(header)) / std::max<uint64_t>(event_total, 1) << " bytes per event";
+	if (header.dropped) std::cout << ", " << header.dropped << " dropped";
+	std::cout << std::endl;
+
+	if (summary) {
+		std::vector<std::pair<std::string, ScopeSummary>> sorted(scopes.begin(), scopes.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+			return a.second.total_ms > b.second.total_ms;
+		});
+		printf("%-40s %10s %12s %10s %10s\n", "scope", "count", "total ms", "mean ms", "max ms");
+		for (const auto& entry : sorted) {
+			const ScopeSummary& s = entry.second;
+			printf("%-40s %10llu %12.3f %10.4f %10.4f\n", entry.first.c_str(), (unsigned long long)s.count,
+				s.total_ms, s.total_ms / s.count, s.max_ms);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,528 @@
+// Cooks source images (jpg, png, tga, ...) into the engine's mip-chained,
+// block-compressed .vbtx container, see engine/texture_format.h.
+//
+// TextureCooker <input> <output> [--format rgba|bc1|bc3|bc7] [--linear]
+//               [--no-mips] [--threads N]
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define COOKER_SSE2 1
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../engine/stb_image.h"
+#include "../engine/texture_format.h"
+
+struct Image {
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<uint8_t> pixels{};
+};
+
+static uint32_t g_threadCount = 0;
+
+// Runs fn(i) for i in [0, count) on every core, handing out indices one at a
+// time so uneven rows balance out.
+void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& fn) {
+	uint32_t threadCount = std::min(g_threadCount, count);
+	if (threadCount <= 1) {
+		for (uint32_t i = 0; i < count; ++i) fn(i);
+		return;
+	}
+	std::atomic<uint32_t> next{ 0 };
+	auto worker = [&]() {
+		for (uint32_t i = next++; i < count; i = next++) fn(i);
+	};
+	std::vector<std::thread> threads{};
+	for (uint32_t t = 1; t < threadCount; ++t) threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads) thread.join();
+}
+
+// ---------------------------------------------------------------------------
+// Mip generation
+// ---------------------------------------------------------------------------
+
+// 2x2 box filter on one output row. Both source rows are valid, the caller
+// clamps them for odd heights.
+void DownsampleRow(const uint8_t* row0, const uint8_t* row1, uint8_t* dst, uint32_t srcWidth, uint32_t dstWidth) {
+	uint32_t x = 0;
+	if (srcWidth >= 2) {
+#ifdef COOKER_SSE2
+		// Two source pixels per output pixel, four output pixels per step.
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i round = _mm_set1_epi16(2);
+		for (; x + 4 <= dstWidth; x += 4) {
+			__m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + x * 8));
+			__m128i a1 = _mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16));
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + x * 8));
+			__m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16));
+
+			// Vertical sums in 16 bits, two pixels per register.
+			__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+			__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+			__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+			__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+			// Horizontal pair sums land in the low half of each register.
+			s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+			s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+			s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+			s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+
+			__m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), round), 2);
+			__m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), round), 2);
+			_mm_storeu_si128((__m128i*)(dst + x * 4), _mm_packus_epi16(lo, hi));
+		}
+#endif
+		for (; x < dstWidth; ++x) {
+			for (uint32_t c = 0; c < 4; ++c) {
+				uint32_t sum = row0[x * 8 + c] + row0[x * 8 + 4 + c] + row1[x * 8 + c] + row1[x * 8 + 4 + c];
+				dst[x * 4 + c] = (uint8_t)((sum + 2) >> 2);
+			}
+		}
+	} else {
+		for (uint32_t c = 0; c < 4; ++c) {
+			dst[c] = (uint8_t)((row0[c] + row1[c] + 1) >> 1);
+		}
+	}
+}
+
+Image Downsample(const Image& src) {
+	Image dst{};
+	dst.width = std::max(1u, src.width / 2);
+	dst.height = std::max(1u, src.height / 2);
+	dst.pixels.resize((size_t)dst.width * dst.height * 4);
+
+	ParallelFor(dst.height, [&](uint32_t y) {
+		uint32_t y0 = std::min(y * 2, src.height - 1);
+		uint32_t y1 = std::min(y * 2 + 1, src.height - 1);
+		DownsampleRow(&src.pixels[(size_t)y0 * src.width * 4], &src.pixels[(size_t)y1 * src.width * 4],
+			&dst.pixels[(size_t)y * dst.width * 4], src.width, dst.width);
+	});
+	return dst;
+}
+
+// sRGB data is filtered in linear light, otherwise mips darken.
+void ToLinear(const Image& image, std::vector<uint16_t>& linear) {
+	static uint16_t table[256];
+	static bool init = false;
+	if (!init) {
+		for (int i = 0; i < 256; ++i) {
+			double c = i / 255.0;
+			c = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+			table[i] = (uint16_t)std::lround(c * 65535.0);
+		}
+		init = true;
+	}
+	linear.resize(image.pixels.size());
+	for (size_t i = 0; i < image.pixels.size(); ++i) {
+		linear[i] = (i & 3) == 3 ? (uint16_t)(image.pixels[i] * 257) : table[image.pixels[i]];
+	}
+}
+
+uint8_t ToSrgb(uint32_t value) {
+	double c = value / 65535.0;
+	c = c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1.0 / 2.4) - 0.055;
+	return (uint8_t)std::min(255L, std::max(0L, std::lround(c * 255.0)));
+}
+
+Image DownsampleSrgb(const Image& src) {
+	std::vector<uint16_t> linear{};
+	ToLinear(src, linear);
+
+	Image dst{};
+	dst.width = std::max(1u, src.width / 2);
+	dst.height = std::max(1u, src.height / 2);
+	dst.pixels.resize((size_t)dst.width * dst.height * 4);
+
+	ParallelFor(dst.height, [&](uint32_t y) {
+		uint32_t y0 = std::min(y * 2, src.height - 1);
+		uint32_t y1 = std::min(y * 2 + 1, src.height - 1);
+		for (uint32_t x = 0; x < dst.width; ++x) {
+			uint32_t x0 = std::min(x * 2, src.width - 1);
+			uint32_t x1 = std::min(x * 2 + 1, src.width - 1);
+			for (uint32_t c = 0; c < 4; ++c) {
+				uint32_t sum = linear[((size_t)y0 * src.width + x0) * 4 + c] + linear[((size_t)y0 * src.width + x1) * 4 + c] +
+					linear[((size_t)y1 * src.width + x0) * 4 + c] + linear[((size_t)y1 * src.width + x1) * 4 + c];
+				sum = (sum + 2) >> 2;
+				dst.pixels[((size_t)y * dst.width + x) * 4 + c] = c == 3 ? (uint8_t)((sum + 128) / 257) : ToSrgb(sum);
+			}
+		}
+	});
+	return dst;
+}
+
+// ---------------------------------------------------------------------------
+// Block compression
+// ---------------------------------------------------------------------------
+
+struct Block {
+	uint8_t rgba[16][4];
+};
+
+void FetchBlock(const Image& image, uint32_t bx, uint32_t by, Block& block) {
+	// Edge blocks repeat the last row and column.
+	for (uint32_t y = 0; y < 4; ++y) {
+		uint32_t sy = std::min(by * 4 + y, image.height - 1);
+		for (uint32_t x = 0; x < 4; ++x) {
+			uint32_t sx = std::min(bx * 4 + x, image.width - 1);
+			memcpy(block.rgba[y * 4 + x], &image.pixels[((size_t)sy * image.width + sx) * 4], 4);
+		}
+	}
+}
+
+// Endpoints at the extremes of the principal axis of the block colors.
+void PrincipalEndpoints(const Block& block, uint32_t channels, float lo[4], float hi[4]) {
+	float mean[4] = {};
+	for (uint32_t i = 0; i < 16; ++i) {
+		for (uint32_t c = 0; c < channels; ++c) mean[c] += block.rgba[i][c];
+	}
+	for (uint32_t c = 0; c < channels; ++c) mean[c] /= 16.0f;
+
+	float cov[4][4] = {};
+	for (uint32_t i = 0; i < 16; ++i) {
+		float d[4];
+		for (uint32_t c = 0; c < channels; ++c) d[c] = block.rgba[i][c] - mean[c];
+		for (uint32_t a = 0; a < channels; ++a) {
+			for (uint32_t b = 0; b < channels; ++b) cov[a][b] += d[a] * d[b];
+		}
+	}
+
+	// Power iteration converges quickly for 3-4 dimensions.
+	float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	for (int iter = 0; iter < 8; ++iter) {
+		float next[4] = {};
+		for (uint32_t a = 0; a < channels; ++a) {
+			for (uint32_t b = 0; b < channels; ++b) next[a] += cov[a][b] * axis[b];
+		}
+		float len = 0.0f;
+		for (uint32_t c = 0; c < channels; ++c) len = std::max(len, std::fabs(next[c]));
+		if (len < 1e-6f) break;
+		for (uint32_t c = 0; c < channels; ++c) axis[c] = next[c] / len;
+	}
+
+	float minT = 1e30f, maxT = -1e30f;
+	for (uint32_t i = 0; i < 16; ++i) {
+		float t = 0.0f;
+		for (uint32_t c = 0; c < channels; ++c) t += (block.rgba[i][c] - mean[c]) * axis[c];
+		minT = std::min(minT, t);
+		maxT = std::max(maxT, t);
+	}
+	float axisLen = 0.0f;
+	for (uint32_t c = 0; c < channels; ++c) axisLen += axis[c] * axis[c];
+	if (axisLen < 1e-6f) axisLen = 1.0f;
+	for (uint32_t c = 0; c < channels; ++c) {
+		lo[c] = std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * minT / axisLen));
+		hi[c] = std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * maxT / axisLen));
+	}
+}
+
+uint16_t To565(const float color[3]) {
+	uint32_t r = (uint32_t)std::lround(color[0] * 31.0f / 255.0f);
+	uint32_t g = (uint32_t)std::lround(color[1] * 63.0f / 255.0f);
+	uint32_t b = (uint32_t)std::lround(color[2] * 31.0f / 255.0f);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+void From565(uint16_t value, int color[3]) {
+	int r = (value >> 11) & 31, g = (value >> 5) & 63, b = value & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+// Always the four color mode, alpha goes into a separate block if needed.
+void EncodeBC1Color(const Block& block, uint8_t* out) {
+	float lo[4], hi[4];
+	PrincipalEndpoints(block, 3, lo, hi);
+	uint16_t c0 = To565(hi);
+	uint16_t c1 = To565(lo);
+	if (c0 < c1) std::swap(c0, c1);
+
+	uint32_t indices = 0;
+	if (c0 != c1) {
+		int palette[4][3];
+		From565(c0, palette[0]);
+		From565(c1, palette[1]);
+		for (int c = 0; c < 3; ++c) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		for (uint32_t i = 0; i < 16; ++i) {
+			int best = 0, bestError = 1 << 30;
+			for (int p = 0; p < 4; ++p) {
+				int error = 0;
+				for (int c = 0; c < 3; ++c) {
+					int d = block.rgba[i][c] - palette[p][c];
+					error += d * d;
+				}
+				if (error < bestError) {
+					bestError = error;
+					best = p;
+				}
+			}
+			indices |= (uint32_t)best << (i * 2);
+		}
+	}
+	memcpy(out, &c0, 2);
+	memcpy(out + 2, &c1, 2);
+	memcpy(out + 4, &indices, 4);
+}
+
+// BC4 style alpha block with the eight value interpolation.
+void EncodeBC3Alpha(const Block& block, uint8_t* out) {
+	int a0 = 0, a1 = 255;
+	for (uint32_t i = 0; i < 16; ++i) {
+		a0 = std::max<int>(a0, block.rgba[i][3]);
+		a1 = std::min<int>(a1, block.rgba[i][3]);
+	}
+	out[0] = (uint8_t)a0;
+	out[1] = (uint8_t)a1;
+
+	int palette[8];
+	palette[0] = a0;
+	palette[1] = a1;
+	for (int p = 1; p < 7; ++p) palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+
+	uint64_t bits = 0;
+	for (uint32_t i = 0; i < 16; ++i) {
+		int best = 0, bestError = 1 << 30;
+		for (int p = 0; p < 8; ++p) {
+			int error = std::abs(block.rgba[i][3] - palette[p]);
+			if (error < bestError) {
+				bestError = error;
+				best = p;
+			}
+		}
+		bits |= (uint64_t)best << (i * 3);
+	}
+	for (int b = 0; b < 6; ++b) out[2 + b] = (uint8_t)(bits >> (b * 8));
+}
+
+// BC7 mode 6: one subset, RGBA 7.7.7.7 endpoints with a p-bit each and
+// 4 bit indices. Covers opaque and alpha content with a single mode.
+struct BitWriter {
+	uint8_t* out;
+	uint32_t pos = 0;
+	void Write(uint32_t value, uint32_t bits) {
+		for (uint32_t i = 0; i < bits; ++i, ++pos) {
+			if (value & (1u << i)) out[pos >> 3] |= (uint8_t)(1u << (pos & 7));
+		}
+	}
+};
+
+static const int kBC7Weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+uint32_t EncodeBC7Mode6Try(const Block& block, const float lo[4], const float hi[4], uint32_t p0, uint32_t p1,
+	uint32_t e0[4], uint32_t e1[4], uint8_t indices[16]) {
+	int ep[2][4];
+	for (int c = 0; c < 4; ++c) {
+		// 7 bit value plus the shared p-bit makes an 8 bit endpoint.
+		int q0 = std::min(127, std::max(0, (int)std::lround((lo[c] - p0) / 2.0f)));
+		int q1 = std::min(127, std::max(0, (int)std::lround((hi[c] - p1) / 2.0f)));
+		e0[c] = (uint32_t)q0;
+		e1[c] = (uint32_t)q1;
+		ep[0][c] = (q0 << 1) | (int)p0;
+		ep[1][c] = (q1 << 1) | (int)p1;
+	}
+
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < 16; ++i) {
+		uint32_t bestError = UINT32_MAX;
+		for (int w = 0; w < 16; ++w) {
+			uint32_t error = 0;
+			for (int c = 0; c < 4; ++c) {
+				int value = (ep[0][c] * (64 - kBC7Weights4[w]) + ep[1][c] * kBC7Weights4[w] + 32) >> 6;
+				int d = block.rgba[i][c] - value;
+				error += (uint32_t)(d * d);
+			}
+			if (error < bestError) {
+				bestError = error;
+				indices[i] = (uint8_t)w;
+			}
+		}
+		total += bestError;
+	}
+	return total;
+}
+
+void EncodeBC7(const Block& block, uint8_t* out) {
+	float lo[4], hi[4];
+	PrincipalEndpoints(block, 4, lo, hi);
+
+	uint32_t bestError = UINT32_MAX;
+	uint32_t e0[4], e1[4], bestE0[4], bestE1[4], bestP0 = 0, bestP1 = 0;
+	uint8_t indices[16], bestIndices[16];
+	for (uint32_t p = 0; p < 4; ++p) {
+		uint32_t error = EncodeBC7Mode6Try(block, lo, hi, p & 1, p >> 1, e0, e1, indices);
+		if (error < bestError) {
+			bestError = error;
+			memcpy(bestE0, e0, sizeof(e0));
+			memcpy(bestE1, e1, sizeof(e1));
+			memcpy(bestIndices, indices, sizeof(indices));
+			bestP0 = p & 1;
+			bestP1 = p >> 1;
+		}
+	}
+
+	// The anchor index is stored with its top bit implied zero.
+	if (bestIndices[0] & 8) {
+		std::swap(bestE0, bestE1);
+		std::swap(bestP0, bestP1);
+		for (auto& index : bestIndices) index = (uint8_t)(15 - index);
+	}
+
+	memset(out, 0, 16);
+	BitWriter writer{ out };
+	writer.Write(1u << 6, 7);
+	for (int c = 0; c < 4; ++c) {
+		writer.Write(bestE0[c], 7);
+		writer.Write(bestE1[c], 7);
+	}
+	writer.Write(bestP0, 1);
+	writer.Write(bestP1, 1);
+	writer.Write(bestIndices[0], 3);
+	for (int i = 1; i < 16; ++i) writer.Write(bestIndices[i], 4);
+}
+
+std::vector<uint8_t> Encode(const Image& image, uint32_t format) {
+	if (format == eCookedRGBA8) return image.pixels;
+
+	uint32_t blocksX = (image.width + 3) / 4;
+	uint32_t blocksY = (image.height + 3) / 4;
+	uint32_t blockBytes = GetCookedBlockBytes(format);
+	std::vector<uint8_t> data((size_t)blocksX * blocksY * blockBytes);
+
+	ParallelFor(blocksY, [&](uint32_t by) {
+		Block block;
+		for (uint32_t bx = 0; bx < blocksX; ++bx) {
+			uint8_t* out = &data[((size_t)by * blocksX + bx) * blockBytes];
+			FetchBlock(image, bx, by, block);
+			switch (format) {
+			case eCookedBC1:
+				EncodeBC1Color(block, out);
+				break;
+			case eCookedBC3:
+				EncodeBC3Alpha(block, out);
+				EncodeBC1Color(block, out + 8);
+				break;
+			case eCookedBC7:
+				EncodeBC7(block, out);
+				break;
+			}
+		}
+	});
+	return data;
+}
+
+// ---------------------------------------------------------------------------
+
+bool ParseFormat(const char* name, uint32_t& format) {
+	if (0 == strcmp(name, "rgba")) format = eCookedRGBA8;
+	else if (0 == strcmp(name, "bc1")) format = eCookedBC1;
+	else if (0 == strcmp(name, "bc3")) format = eCookedBC3;
+	else if (0 == strcmp(name, "bc7")) format = eCookedBC7;
+	else return false;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		std::cerr << "usage: TextureCooker <input> <output> [--format rgba|bc1|bc3|bc7] "
+			"[--linear] [--no-mips] [--threads N]" << std::endl;
+		return 1;
+	}
+
+	uint32_t format = eCookedBC7;
+	bool srgb = true;
+	bool mips = true;
+	g_threadCount = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 3; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "--format") && i + 1 < argc) {
+			if (!ParseFormat(argv[++i], format)) {
+				std::cerr << "unknown format " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (0 == strcmp(argv[i], "--linear")) {
+			srgb = false;
+		} else if (0 == strcmp(argv[i], "--no-mips")) {
+			mips = false;
+		} else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+			g_threadCount = std::max(1, atoi(argv[++i]));
+		}
+	}
+
+	int width, height, components;
+	stbi_uc* pixels = stbi_load(argv[1], &width, &height, &components, 4);
+	if (!pixels) {
+		std::cerr << "cannot load " << argv[1] << ": " << stbi_failure_reason() << std::endl;
+		return 1;
+	}
+
+	std::vector<Image> levels(1);
+	levels[0].width = (uint32_t)width;
+	levels[0].height = (uint32_t)height;
+	levels[0].pixels.assign(pixels, pixels + (size_t)width * height * 4);
+	stbi_image_free(pixels);
+
+	while (mips && (levels.back().width > 1 || levels.back().height > 1)) {
+		levels.push_back(srgb ? DownsampleSrgb(levels.back()) : Downsample(levels.back()));
+	}
+
+	CookedTextureHeader header{};
+	header.magic = kCookedTextureMagic;
+	header.version = kCookedTextureVersion;
+	header.format = format;
+	header.flags = srgb ? (uint32_t)eCookedSrgb : 0u;
+	header.width = levels[0].width;
+	header.height = levels[0].height;
+	header.mip_levels = (uint32_t)levels.size();
+	header.data_offset = (sizeof(CookedTextureHeader) + sizeof(CookedMipLevel) * levels.size() + 15) & ~15ull;
+
+	std::vector<CookedMipLevel> table(levels.size());
+	std::vector<std::vector<uint8_t>> encoded(levels.size());
+	uint64_t offset = 0;
+	for (size_t i = 0; i < levels.size(); ++i) {
+		encoded[i] = Encode(levels[i], format);
+		table[i].offset = offset;
+		table[i].size = encoded[i].size();
+		table[i].width = levels[i].width;
+		table[i].height = levels[i].height;
+		offset = (offset + encoded[i].size() + 15) & ~15ull;
+	}
+	header.data_size = offset;
+
+	std::ofstream file{ argv[2], std::ios::binary };
+	if (!file) {
+		std::cerr << "cannot write " << argv[2] << std::endl;
+		return 1;
+	}
+	std::vector<uint8_t> prefix(header.data_offset, 0);
+	memcpy(prefix.data(), &header, sizeof(header));
+	memcpy(prefix.data() + sizeof(header), table.data(), sizeof(CookedMipLevel) * table.size());
+	file.write((const char*)prefix.data(), prefix.size());
+
+	std::vector<uint8_t> payload(header.data_size, 0);
+	for (size_t i = 0; i < levels.size(); ++i) {
+		memcpy(payload.data() + table[i].offset, encoded[i].data(), encoded[i].size());
+	}
+	file.write((const char*)payload.data(), payload.size());
+
+	std::cout << argv[2] << ": " << header.width << "x" << header.height << ", "
+		<< header.mip_levels << " mips, " << header.data_size << " bytes" << std::endl;
+	return 0;
+}